@@ -0,0 +1,139 @@
+/*
+ *  Per-stage CPU time and interference accounting, see account.h.
+ *
+ *  Only stages run on the thread that enabled accounting are measured.
+ *  The ring flusher also runs writeback, and sometimes the transform.
+ *  Its runs would race on stages[] and mix two threads' clocks, so they
+ *  are only counted.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "account.h"
+
+struct stage_account
+{
+    unsigned long samples;
+    double wall, wall_max;
+    double cpu, cpu_max;
+    double interference_max;
+    unsigned long voluntary, involuntary;   /* context switches */
+    unsigned long minor_faults, major_faults;
+    unsigned long other_thread;             /* runs off the accounted thread, left out */
+
+    struct timespec cpu_start;
+    struct rusage usage_start;
+};
+
+static int enabled;
+static pthread_t accounted;
+static struct stage_account stages[STAGE_COUNT];
+
+
+static double seconds_between(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+void account_enable(void)
+{
+    accounted = pthread_self();
+    enabled = 1;
+}
+
+int account_enabled(void)
+{
+    return enabled;
+}
+
+void account_begin(enum metric_stage stage)
+{
+    struct stage_account *s = &stages[stage];
+
+    if (!enabled)
+        return;
+    if (!pthread_equal(pthread_self(), accounted))
+    {
+        __atomic_add_fetch(&s->other_thread, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &s->cpu_start);
+    getrusage(RUSAGE_THREAD, &s->usage_start);
+}
+
+/**
+ * @brief Closes a stage's accounting interval.
+ *
+ * @param stage Stage that just finished.
+ * @param wall_seconds The stage's wall-clock duration, as already measured by the caller.
+ */
+void account_end(enum metric_stage stage, double wall_seconds)
+{
+    struct stage_account *s = &stages[stage];
+    struct timespec cpu_end;
+    struct rusage usage_end;
+    double cpu, interference;
+
+    if (!enabled || !pthread_equal(pthread_self(), accounted))
+        return;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    getrusage(RUSAGE_THREAD, &usage_end);
+
+    cpu = seconds_between(&s->cpu_start, &cpu_end);
+    // the two clocks are read at slightly different points, never report negative interference
+    interference = wall_seconds > cpu ? wall_seconds - cpu : 0.0;
+
+    s->samples++;
+    s->wall += wall_seconds;
+    s->cpu += cpu;
+    if (wall_seconds > s->wall_max)
+        s->wall_max = wall_seconds;
+    if (cpu > s->cpu_max)
+        s->cpu_max = cpu;
+    if (interference > s->interference_max)
+        s->interference_max = interference;
+
+    s->voluntary += usage_end.ru_nvcsw - s->usage_start.ru_nvcsw;
+    s->involuntary += usage_end.ru_nivcsw - s->usage_start.ru_nivcsw;
+    s->minor_faults += usage_end.ru_minflt - s->usage_start.ru_minflt;
+    s->major_faults += usage_end.ru_majflt - s->usage_start.ru_majflt;
+}
+
+void account_report(void)
+{
+    int st;
+
+    if (!enabled)
+        return;
+
+    for (st = 0; st < STAGE_COUNT; st++)
+    {
+        struct stage_account *s = &stages[st];
+        double n = s->samples;
+
+        if (s->other_thread)
+            syslog(LOG_INFO, "CPU %s -- %lu runs on another thread than the accounted one, not measured\n",
+                   metrics_stage_name(st), s->other_thread);
+        if (!s->samples)
+            continue;
+
+        syslog(LOG_INFO, "CPU %s -- %lu frames, wall mean %.3lf ms worst %.3lf ms, "
+               "cpu mean %.3lf ms worst %.3lf ms, interference mean %.3lf ms worst %.3lf ms (%.1lf%%)\n",
+               metrics_stage_name(st), s->samples, s->wall / n * 1000.0, s->wall_max * 1000.0,
+               s->cpu / n * 1000.0, s->cpu_max * 1000.0,
+               (s->wall > s->cpu ? s->wall - s->cpu : 0.0) / n * 1000.0, s->interference_max * 1000.0,
+               s->wall > 0 ? 100.0 * (s->wall > s->cpu ? s->wall - s->cpu : 0.0) / s->wall : 0.0);
+        syslog(LOG_INFO, "CPU %s -- per frame %.3lf voluntary, %.3lf involuntary switches, "
+               "%.3lf minor, %.3lf major faults\n",
+               metrics_stage_name(st), s->voluntary / n, s->involuntary / n,
+               s->minor_faults / n, s->major_faults / n);
+    }
+}
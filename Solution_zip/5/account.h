@@ -0,0 +1,23 @@
+/*
+ *  Per-stage CPU time and interference accounting.
+ *
+ *  The stage durations in the log are wall-clock, so time the capture
+ *  thread spent preempted or blocked is counted as execution time. With
+ *  accounting on, every stage also takes CLOCK_THREAD_CPUTIME_ID and
+ *  getrusage(RUSAGE_THREAD) at its start and end. The exit summary
+ *  then splits each stage's wall time into CPU time (compute) and the
+ *  rest (interference: preemption, blocking in syscalls, page-fault
+ *  I/O), next to context switches and page faults per frame.
+ */
+#ifndef ACCOUNT_H
+#define ACCOUNT_H
+
+#include "metrics.h"
+
+void account_enable(void);
+int account_enabled(void);
+void account_begin(enum metric_stage stage);
+void account_end(enum metric_stage stage, double wall_seconds);
+void account_report(void);
+
+#endif /* ACCOUNT_H */
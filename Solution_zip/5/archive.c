@@ -0,0 +1,123 @@
+/*
+ *  Raw YUYV frame archive writer, see archive.h for the layout.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <linux/videodev2.h>
+
+#include "archive.h"
+#include "segment.h"
+#include "durable.h"
+
+static int fd = -1;
+static unsigned long frames;
+static unsigned long long archive_bytes, ppm_bytes;
+
+
+/**
+ * @brief Creates the archive and writes its magic.
+ *
+ * @param path Archive file, truncated if it exists, or NULL to write into the segments set up by segment_init().
+ * @return 0 on success, -1 on failure.
+ */
+int archive_open(const char *path)
+{
+    if (!path)
+        return segment_enabled() ? 0 : -1;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "Failed to create %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (write(fd, ARCHIVE_FILE_MAGIC, 8) != 8)
+    {
+        syslog(LOG_ERR, "Failed to write %s: %s", path, strerror(errno));
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+
+    archive_bytes = 8;
+    return 0;
+}
+
+/**
+ * @brief Appends one raw frame with its timestamp, with one writev().
+ *
+ * @param data YUYV payload as dequeued.
+ * @param size Bytes used in the payload.
+ * @param geometry Frame width and height; channels is ignored.
+ * @param tag Frame number.
+ * @param time Frame timestamp.
+ * @param syscalls Receives the number of syscalls this frame took.
+ * @return Bytes appended, or -1 on failure.
+ */
+int archive_write(const unsigned char *data, int size, const struct frame_geometry *geometry,
+                  unsigned int tag, const struct timespec *time, int *syscalls)
+{
+    struct archive_record rec;
+    struct iovec iov[2];
+    int total, out;
+    off_t offset;
+
+    *syscalls = 0;
+    if (segment_enabled() && segment_need(sizeof(rec) + size, syscalls) < 0)
+        return -1;
+    out = segment_enabled() ? segment_fd() : fd;
+    offset = segment_enabled() ? segment_offset() : (off_t)archive_bytes;
+    if (out < 0)
+        return -1;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.sec = time->tv_sec;
+    rec.nsec = time->tv_nsec;
+    rec.magic = ARCHIVE_RECORD_MAGIC;
+    rec.tag = tag;
+    rec.width = geometry->width;
+    rec.height = geometry->height;
+    rec.stride = geometry->height ? size / geometry->height : 0;
+    rec.payload = size;
+    rec.fourcc = V4L2_PIX_FMT_YUYV;
+
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = size;
+
+    total = writev_all(out, iov, 2, syscalls);
+    if (total < 0)
+        return -1;
+    durable_written(out, offset, total);
+    if (segment_enabled())
+        segment_wrote(total);
+
+    frames++;
+    archive_bytes += total;
+    ppm_bytes += (unsigned long long)geometry->width * geometry->height * 3 + 50;
+    return total;
+}
+
+void archive_close(void)
+{
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+    segment_close();
+}
+
+void archive_report(void)
+{
+    if (!frames)
+        return;
+
+    syslog(LOG_INFO, "Raw store -- %lu frames, %llu bytes vs about %llu as PPM (%.2lf%%)\n",
+           frames, archive_bytes, ppm_bytes, ppm_bytes ? 100.0 * archive_bytes / ppm_bytes : 0.0);
+}
@@ -0,0 +1,46 @@
+/*
+ *  Raw YUYV frame archive.
+ *
+ *  --store raw appends the camera's YUYV payload to one archive file
+ *  instead of converting and writing a PPM per frame. That takes the
+ *  conversion out of the real-time path and writes 2 bytes per pixel
+ *  instead of 3. yuyv_convert turns an archive into PPM/PGM files
+ *  afterwards, on all cores.
+ *
+ *  Layout, host byte order:
+ *      "CAPYUYV1"                          file magic
+ *      { struct archive_record, payload }  repeated
+ *  The payload is height lines of stride bytes, exactly as dequeued.
+ */
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "writeback.h"
+
+#define ARCHIVE_FILE_MAGIC      "CAPYUYV1"
+#define ARCHIVE_RECORD_MAGIC    (0x56555952u)   /* "RYUV" */
+
+struct archive_record
+{
+    int64_t sec;
+    int64_t nsec;
+    uint32_t magic;
+    uint32_t tag;           /* frame number, as in the PPM filenames */
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;        /* bytes per line */
+    uint32_t payload;       /* bytes following this header */
+    uint32_t fourcc;        /* V4L2 pixel format of the payload */
+    uint32_t reserved;
+};
+
+int archive_open(const char *path);
+int archive_write(const unsigned char *data, int size, const struct frame_geometry *geometry,
+                  unsigned int tag, const struct timespec *time, int *syscalls);
+void archive_close(void);
+void archive_report(void);
+
+#endif /* ARCHIVE_H */
@@ -0,0 +1,126 @@
+/*
+ *  Adaptive brightness and contrast, see autolevel.h.
+ */
+
+#include <syslog.h>
+
+#include "autolevel.h"
+#include "convert.h"
+
+#define LOW_PERCENTILE  (0.01)
+#define HIGH_PERCENTILE (0.99)
+#define SMOOTHING       (0.2)   /* weight of the newest frame's levels */
+#define ALPHA_MIN       (1.0)   /* never flatten a scene that already spans the range */
+#define ALPHA_MAX       (3.0)   /* limits how far noise in a dark frame is stretched */
+
+static int enabled;
+static double alpha = BRIGHTEN_ALPHA, beta = BRIGHTEN_BETA;
+static unsigned char lut[256];
+static int lut_ready;
+
+static unsigned long updates;
+static double alpha_total, beta_total, alpha_low = ALPHA_MAX, alpha_high = ALPHA_MIN;
+
+
+static void build_lut(void)
+{
+    double v;
+    int i;
+
+    for (i = 0; i < 256; i++)
+    {
+        v = alpha * i + beta + 0.5;
+        lut[i] = v > 255 ? 255 : v < 0 ? 0 : (unsigned char)v;
+    }
+    lut_ready = 1;
+}
+
+// Grey level a luma maps to under the selected colour matrix's range expansion
+static double luma_to_rgb(int y)
+{
+    unsigned char r, g, b;
+
+    yuv2rgb(y, 128, 128, &r, &g, &b);
+    return g;
+}
+
+void autolevel_enable(void)
+{
+    enabled = 1;
+}
+
+int autolevel_enabled(void)
+{
+    return enabled;
+}
+
+/**
+ * @brief Current level mapping, starting out as the fixed transform.
+ */
+const unsigned char *autolevel_lut(void)
+{
+    if (!lut_ready)
+        build_lut();
+    return lut;
+}
+
+/**
+ * @brief Derives the levels for the next frame from this frame's luma histogram.
+ *
+ * @param hist 256 luma bins.
+ * @param pixels Pixels counted in hist.
+ */
+void autolevel_update(const unsigned int *hist, unsigned long pixels)
+{
+    unsigned long below = 0, low_count, high_count;
+    double low, high, target_alpha, target_beta;
+    int y, low_bin = -1, high_bin = 255;
+
+    if (!pixels)
+        return;
+
+    low_count = (unsigned long)(pixels * LOW_PERCENTILE);
+    high_count = (unsigned long)(pixels * HIGH_PERCENTILE);
+    for (y = 0; y < 256; y++)
+    {
+        below += hist[y];
+        if (low_bin < 0 && below > low_count)
+            low_bin = y;
+        if (below > high_count)
+        {
+            high_bin = y;
+            break;
+        }
+    }
+
+    low = luma_to_rgb(low_bin);
+    high = luma_to_rgb(high_bin);
+    target_alpha = high > low ? 255.0 / (high - low) : ALPHA_MAX;
+    if (target_alpha < ALPHA_MIN)
+        target_alpha = ALPHA_MIN;
+    if (target_alpha > ALPHA_MAX)
+        target_alpha = ALPHA_MAX;
+    // Centre the stretched range when alpha was clamped
+    target_beta = 127.5 - target_alpha * (low + high) / 2.0;
+
+    alpha += SMOOTHING * (target_alpha - alpha);
+    beta += SMOOTHING * (target_beta - beta);
+    build_lut();
+
+    updates++;
+    alpha_total += alpha;
+    beta_total += beta;
+    if (alpha < alpha_low)
+        alpha_low = alpha;
+    if (alpha > alpha_high)
+        alpha_high = alpha;
+}
+
+void autolevel_report(void)
+{
+    if (!updates)
+        return;
+
+    syslog(LOG_INFO, "Auto levels -- %lu frames, alpha mean %.3lf range %.3lf..%.3lf, beta mean %.1lf, last %.3lf/%.1lf\n",
+           updates, alpha_total / updates, alpha_low, alpha_high, beta_total / updates, alpha, beta);
+}
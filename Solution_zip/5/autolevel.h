@@ -0,0 +1,21 @@
+/*
+ *  Adaptive brightness and contrast.
+ *
+ *  The fixed transform (alpha 1.25, beta 25) saturates bright scenes and
+ *  does little for dark ones. In adaptive mode the luma histogram from
+ *  the conversion pass is used to pick alpha and beta for the next
+ *  frame. The 1st and 99th percentiles are stretched to the full 0..255
+ *  range. The new values are smoothed against the previous ones so
+ *  exposure changes do not flicker, and then applied as a 256 entry LUT
+ *  on each RGB channel.
+ */
+#ifndef AUTOLEVEL_H
+#define AUTOLEVEL_H
+
+void autolevel_enable(void);
+int autolevel_enabled(void);
+const unsigned char *autolevel_lut(void);
+void autolevel_update(const unsigned int *hist, unsigned long pixels);
+void autolevel_report(void);
+
+#endif /* AUTOLEVEL_H */
@@ -0,0 +1,183 @@
+/*
+ *  Busy-poll capture and driver to user space latency, see busypoll.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "busypoll.h"
+
+#define LATENCY_BUCKET_US   (10)
+#define LATENCY_BUCKETS     (5000)      /* 50 ms, anything later lands in the last bucket */
+
+static int enabled, pinned;
+static int cpu = -1;
+static unsigned int pauses = 1;
+static struct timespec last_frame;
+
+static unsigned long long empty_polls, pause_total;
+static unsigned long frames, unstamped;
+static unsigned int histogram[LATENCY_BUCKETS];
+static double latency_sum, latency_min, latency_max;
+static unsigned int stamp_source;
+
+
+// One spin-wait hint to the CPU, nothing where there is none
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/**
+ * @brief Selects busy-poll mode on the given CPU.
+ *
+ * @return 0 on success, -1 if spec is not a CPU number.
+ */
+int busypoll_parse(const char *spec)
+{
+    char *end;
+    long n = strtol(spec, &end, 10);
+
+    if (*spec == '\0' || *end != '\0' || n < 0 || n >= CPU_SETSIZE)
+        return -1;
+    cpu = (int)n;
+    enabled = 1;
+    return 0;
+}
+
+int busypoll_enabled(void)
+{
+    return enabled;
+}
+
+/**
+ * @brief Pins the calling thread, the capture thread, to the busy-poll CPU.
+ *
+ * Polling carries on unpinned if the pin fails.
+ *
+ * @return 0 on success, -1 if the pin failed.
+ */
+int busypoll_start(void)
+{
+    cpu_set_t set;
+
+    clock_gettime(CLOCK_MONOTONIC, &last_frame);
+    if (!enabled)
+        return 0;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+    {
+        syslog(LOG_WARNING, "cannot pin capture to CPU %d, polling unpinned: %s", cpu, strerror(errno));
+        return -1;
+    }
+    pinned = 1;
+    return 0;
+}
+
+/**
+ * @brief Backs off after a poll that found no frame.
+ *
+ * @return 0 to poll again, -1 once no frame came for BUSYPOLL_TIMEOUT_S.
+ */
+int busypoll_idle(void)
+{
+    struct timespec now;
+    unsigned int i;
+
+    empty_polls++;
+    pause_total += pauses;
+    for (i = 0; i < pauses; i++)
+        cpu_relax();
+    if (pauses < BUSYPOLL_PAUSE_MAX)
+        pauses <<= 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - last_frame.tv_sec > BUSYPOLL_TIMEOUT_S)
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief Records a dequeued buffer's driver to user space latency, in either mode.
+ *
+ * Call straight after VIDIOC_DQBUF returns. Also restarts the backoff.
+ */
+void busypoll_observe(const struct v4l2_buffer *buf)
+{
+    struct timespec now;
+    double latency;
+    long bucket;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    last_frame = now;
+    pauses = 1;
+
+    // Only a monotonic stamp is on the same clock as ours
+    if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+    {
+        unstamped++;
+        return;
+    }
+    stamp_source = buf->flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK;
+
+    latency = (now.tv_sec - buf->timestamp.tv_sec) + (now.tv_nsec / 1000 - buf->timestamp.tv_usec) / 1e6;
+    if (latency < 0)
+        latency = 0;
+
+    bucket = (long)(latency * 1e6) / LATENCY_BUCKET_US;
+    histogram[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+    latency_sum += latency;
+    if (frames == 0 || latency < latency_min)
+        latency_min = latency;
+    if (latency > latency_max)
+        latency_max = latency;
+    frames++;
+}
+
+// Upper edge of the bucket holding the given fraction of the frames, in ms
+static double latency_percentile(double fraction)
+{
+    unsigned long want = (unsigned long)(fraction * frames), seen = 0;
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += histogram[i];
+        if (seen > want)
+            break;
+    }
+    return (i + 1) * LATENCY_BUCKET_US / 1000.0;
+}
+
+void busypoll_report(void)
+{
+    if (frames)
+        syslog(LOG_INFO, "Dequeue latency -- %s, %lu frames from %s of frame stamps, "
+               "min %.3lf ms mean %.3lf ms p50 %.2lf ms p99 %.2lf ms worst %.3lf ms\n",
+               enabled ? "busy poll" : "select", frames,
+               stamp_source == V4L2_BUF_FLAG_TSTAMP_SRC_SOE ? "start" : "end",
+               latency_min * 1000.0, latency_sum / frames * 1000.0,
+               latency_percentile(0.50), latency_percentile(0.99), latency_max * 1000.0);
+    if (unstamped)
+        syslog(LOG_INFO, "Dequeue latency -- %lu frames without monotonic driver stamps, not measured\n",
+               unstamped);
+
+    if (enabled)
+        syslog(LOG_INFO, "Busy poll -- CPU %d%s, %llu empty polls, %.1lf per frame, %llu pauses\n",
+               cpu, pinned ? "" : " (not pinned)", empty_polls,
+               frames + unstamped ? (double)empty_polls / (frames + unstamped) : 0.0, pause_total);
+}
@@ -0,0 +1,42 @@
+/*
+ *  Busy-poll capture for a dedicated core.
+ *
+ *  In the default mode mainloop() sleeps in select() until the driver
+ *  wakes it. Each frame then pays for the wakeup: the IPI, a possible
+ *  idle state exit, and the scheduler putting the thread back on a CPU.
+ *
+ *  --busy-poll cpu pins the capture thread to cpu and never sleeps.
+ *  The device is open O_NONBLOCK, so VIDIOC_DQBUF itself is the poll:
+ *  EAGAIN just means the frame is not there yet. Between empty polls the
+ *  thread pauses. The pause starts at one instruction and doubles up to
+ *  BUSYPOLL_PAUSE_MAX, which keeps the vb2 queue lock free for the
+ *  driver's completion and leaves the sibling hyperthread its share. A
+ *  frame still shows up within a few microseconds. The core is burnt at
+ *  100%, so use one kept clear of other work (isolcpus=, nohz_full=).
+ *
+ *  The pin happens right before the capture loop. Threads started
+ *  earlier (metrics, ring, sync, mapped flusher) keep their own
+ *  affinity and stay off the polled core.
+ *
+ *  Both modes record the latency from the driver's buffer timestamp to
+ *  the moment user space holds the buffer, so a run in each mode gives
+ *  the comparison. The latency is only meaningful when the driver stamps
+ *  with CLOCK_MONOTONIC. With start of frame stamps it includes the
+ *  readout of the frame, which the report shows.
+ */
+#ifndef BUSYPOLL_H
+#define BUSYPOLL_H
+
+#include <linux/videodev2.h>
+
+#define BUSYPOLL_PAUSE_MAX  (64)        /* pause instructions between polls once backed off */
+#define BUSYPOLL_TIMEOUT_S  (2)         /* no frame for this long ends the run, as select() does */
+
+int busypoll_parse(const char *spec);
+int busypoll_enabled(void);
+int busypoll_start(void);
+int busypoll_idle(void);
+void busypoll_observe(const struct v4l2_buffer *buf);
+void busypoll_report(void);
+
+#endif /* BUSYPOLL_H */
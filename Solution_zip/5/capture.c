@@ -33,6 +33,33 @@
 #include <linux/videodev2.h>
 
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "metrics.h"
+#include "trace.h"
+#include "deadline.h"
+#include "writeback.h"
+#include "selector.h"
+#include "warmup.h"
+#include "dedupe.h"
+#include "delta.h"
+#include "archive.h"
+#include "segment.h"
+#include "perf.h"
+#include "account.h"
+#include "stream.h"
+#include "control.h"
+#include "autolevel.h"
+#include "denoise.h"
+#include "preview.h"
+#include "roi.h"
+#include "mapped.h"
+#include "durable.h"
+#include "busypoll.h"
+#include "ring.h"
+#include "convert.h"
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 #define COLOR_CONVERT_RGB
@@ -49,7 +76,7 @@
 #define LAST_FRAMES (1)
 #define CAPTURE_FRAMES (1800+LAST_FRAMES)
 #define FRAMES_TO_ACQUIRE (CAPTURE_FRAMES + START_UP_FRAMES + LAST_FRAMES)
-// always ignore first 8 frames
+// always ignore first 8 frames, unless --warmup adaptive decides when the camera has settled
 int framecnt=-8;
 
 unsigned char bigbuffer[(1280*960)];
@@ -67,6 +94,9 @@ struct buffer
 {
         void   *start;
         size_t  length;
+        size_t  bytesused;  /* of the last frame dequeued into it */
+        void   *frame;      /* where the delivered image starts, past a software ROI offset */
+        struct timespec captured;   /* CLOCK_REALTIME when the last frame was dequeued */
 };
 
 static char            *dev_name;
@@ -79,6 +109,34 @@ static unsigned int     n_buffers;
 static int              out_buf;
 static int              force_format=1;
 static int              frame_count = (FRAMES_TO_ACQUIRE);
+static char            *metrics_path;
+static char            *trace_path;
+// Set by the deadline hook on the capture thread, read by the ring flusher too
+static _Atomic enum degrade_mode transform_mode = DEGRADE_NONE;
+static double           timelapse_hz;
+static int              adaptive_warmup;
+static double           warmup_timeout = 5.0;
+static double           dedupe_threshold;
+static enum writeback_store store = STORE_PPM;
+static int              key_interval = 30;
+static double           delta_threshold;
+static int              direct_io;
+static double           ring_before;
+static double           ring_after = 2.0;
+static int              ring_raw;
+static char            *ring_socket;
+static double           ring_motion;
+static int              continuous;
+static unsigned long    quota_mb;
+static unsigned long    segment_mb = 64;
+static volatile sig_atomic_t stop_requested;
+static int              perf_counters;
+static int              cpu_time;
+static int              denoise;
+static int              thumb_factor;
+static int              grey_copy;
+static enum stream_format stream_format = STREAM_Y4M;
+static const char      *colour_matrix = "auto";
 
 static double worst_frame_rate;
 static double fstart, fnow, fstop;
@@ -91,15 +149,22 @@ struct time_measure{
 };
 
 struct timespec acquisition_start, acquisition_end;
+// *_total sum stage durations, so average rate is count / total rather than a mean of 1/duration
 double acquisition_duration, acquisition_frame_rate, acq_total;
+unsigned long acq_count;
 struct time_measure acquisition;
 
-struct timespec transform_start, transform_end;
-double transform_duration, frame_rate, trans_total;
+// The ring flusher transforms and writes too, so these totals are kept under stage_lock
+static pthread_mutex_t stage_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t capture_thread;
+double trans_total;
+unsigned long trans_count;
 struct time_measure transform;
 
-struct timespec writeback_start, writeback_end;
-double writeback_duration, writeback_frame_rate, write_back_total = 0;
+// set when mainloop starts waiting for the next frame, so the DQBUF span covers select() too
+struct timespec dqbuf_wait_start;
+double write_back_total = 0;
+unsigned long write_back_count;
 struct time_measure write_back;
 
 
@@ -122,166 +187,324 @@ static int xioctl(int fh, int request, void *arg)
         return r;/* low-level i/o */
 }
 
-char ppm_header[]="P6\n#9999999999 sec 9999999999 msec \n"HRES_STR" "VRES_STR"\n255\n";
-char ppm_dumpname[]="frames/test0000.ppm";
+#define FRAMES_DIR "/home/suraj/RTES/RTES-Exercise4/Solution_zip/5/frames"
 
 #define SAT (255)
 
+// Write and transform also run on the ring flusher, which must not touch capture-only state
+static int on_capture_thread(void)
+{
+    return pthread_equal(pthread_self(), capture_thread);
+}
+
 /**
  * @brief Dumps image data to a PPM file with timestamp and resolution in the header.
  *
  * This function generates a PPM file for the provided image data. It creates a unique filename
  * based on a tag, writes a header including a timestamp and image resolution, and then writes
  * the image data itself. The PPM format is chosen for its simplicity, supporting easy image data
- * dumps without needing complex encoding.
+ * dumps without needing complex encoding. The header comes from a per-geometry template and is
+ * written together with the pixels in one writev(), see writeback.c.
+ *
+ * Single channel images are written as PGM instead, with the matching extension.
  *
  * @param p Pointer to the image data to be dumped.
  * @param size Size of the image data in bytes.
+ * @param geometry Width, height and channel count of the image.
  * @param tag An unsigned integer used to generate a unique filename.
  * @param time A pointer to a timespec structure containing the timestamp to be included in the header.
+ * @return Bytes written, or -1 on failure.
  */
-void write_ppm(const unsigned char *transformed_data, int size, unsigned int tag, struct timespec *time) {
-    int written, total, dumpfd;
-    char filename[255]; // Buffer for filename
-    char header[1024]; // Buffer for header
+int write_ppm(const unsigned char *transformed_data, int size, const struct frame_geometry *geometry,
+               unsigned int tag, const struct timespec *time) {
+    struct timespec writeback_start, writeback_end;
+    double writeback_duration, writeback_frame_rate;
+    int total, syscalls;
 
     // Start timing writeback
     clock_gettime(CLOCK_MONOTONIC, &writeback_start);
+    perf_begin(STAGE_WRITEBACK);
+    account_begin(STAGE_WRITEBACK);
 
-    // Format the filename and header
-    snprintf(filename, sizeof(filename), "/home/suraj/RTES/RTES-Exercise4/Solution_zip/5/frames/test%04d.ppm", tag);
-    snprintf(header, sizeof(header), "P6\n# timestamp %ld.%ld\n%d %d\n255\n", time->tv_sec, time->tv_nsec, HRES, VRES);
-
-    // Open or create the file with write permissions
-    dumpfd = open(filename,O_WRONLY | O_NONBLOCK | O_CREAT, 0666);
-    if (dumpfd < 0) {
-        syslog(LOG_ERR, "Failed to open file for writing: %s", strerror(errno));
-        return;
-    }
-
-    // Write the header and the image data
-    write(dumpfd, header, strlen(header));
-    total = write(dumpfd, transformed_data, size);
+    // Header and image data go out together
+    total = writeback_frame(transformed_data, size, geometry, tag, time, &syscalls);
 
     // End timing writeback and calculate duration
+    perf_end(STAGE_WRITEBACK, (unsigned long)geometry->width * geometry->height);
     clock_gettime(CLOCK_MONOTONIC, &writeback_end);
     writeback_duration = (writeback_end.tv_sec - writeback_start.tv_sec) + 
                          (writeback_end.tv_nsec - writeback_start.tv_nsec) / 1e9;
+    account_end(STAGE_WRITEBACK, writeback_duration);
     writeback_frame_rate = 1.0 / writeback_duration;
-    write_back_total += writeback_frame_rate;
+    metrics_observe(STAGE_WRITEBACK, writeback_duration);
+    trace_span("writeback", &writeback_start, &writeback_end, tag, -1);
+    // Deadlines are for the capture thread, a flushed ring frame is already late by design
+    if (on_capture_thread())
+        deadline_check(STAGE_WRITEBACK, writeback_duration, tag);
+
+    if (total > 0) {
+        metrics_count(METRIC_FRAMES_WRITTEN, 1);
+        metrics_count(METRIC_BYTES_WRITTEN, total);
+    } else {
+        metrics_count(METRIC_WRITE_ERRORS, 1);
+    }
 
     // Log transformation time and frame rate
-    syslog(LOG_INFO, "Write back duration: %lf s, Frame rate: %lf Hz FPS, for frame %d\n", writeback_duration, writeback_frame_rate, framecnt);
+    syslog(LOG_INFO, "Write back duration: %lf s, Frame rate: %lf Hz FPS, for frame %u\n", writeback_duration, writeback_frame_rate, tag);
 
     // Log the total bytes written to the file.
-    syslog(LOG_INFO,"wrote %d bytes\n", total);
-    // Close the file descriptor.
-    // Update worst frame rate 
+    syslog(LOG_INFO,"wrote %d bytes in %d syscalls\n", total, syscalls);
+    // Update totals and worst frame rate
+    pthread_mutex_lock(&stage_lock);
+    write_back_total += writeback_duration;
+    write_back_count++;
     if (write_back.worst_frame_rate == 0 || writeback_frame_rate < write_back.worst_frame_rate) {
         write_back.worst_frame_rate = writeback_frame_rate;
     }
+    pthread_mutex_unlock(&stage_lock);
 
-    // Close the file descriptor
-    close(dumpfd);
+    return total;
 }
 
 
 
-// This is probably the most acceptable conversion from camera YUYV to RGB
-//
-// Wikipedia has a good discussion on the details of various conversions and cites good references:
-// http://en.wikipedia.org/wiki/YUV
-//
-// Also http://www.fourcc.org/yuv.php
-//
-// What's not clear without knowing more about the camera in question is how often U & V are sampled compared
-// to Y.
-//
-// E.g. YUV444, which is equivalent to RGB, where both require 3 bytes for each pixel
-//      YUV422, which we assume here, where there are 2 bytes for each pixel, with two Y samples for one U & V,
-//              or as the name implies, 4Y and 2 UV pairs
-//      YUV420, where for every 4 Ys, there is a single UV pair, 1.5 bytes for each pixel or 36 bytes for 24 pixels
+// Whole lines present in size bytes of a frame laid out at bytesperline
+static int frame_rows(int size)
+{
+    int line = fmt.fmt.pix.width * 2, rows;
 
-void yuv2rgb(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned char *b)
+    if (size < line)
+        return 0;
+    rows = (size - line) / (int)fmt.fmt.pix.bytesperline + 1;
+    return rows < (int)fmt.fmt.pix.height ? rows : (int)fmt.fmt.pix.height;
+}
+
+// Copies lines back to back, dropping the stride padding or the area outside a software ROI
+static void pack_lines(const unsigned char *src, int first_row, int rows, unsigned char *dst)
 {
-   int r1, g1, b1;
+    int line = fmt.fmt.pix.width * 2, row;
 
-   // replaces floating point coefficients
-   int c = y-16, d = u - 128, e = v - 128;       
+    for (row = 0; row < rows; row++)
+        memcpy(dst + (size_t)row * line, src + (size_t)(first_row + row) * fmt.fmt.pix.bytesperline, line);
+}
 
-   // Conversion that avoids floating point
-   r1 = (298 * c           + 409 * e + 128) >> 8;
-   g1 = (298 * c - 100 * d - 208 * e + 128) >> 8;
-   b1 = (298 * c + 516 * d           + 128) >> 8;
+/**
+ * @brief Full quality conversion through a level LUT, with the optional extras fused in.
+ *
+ * The frame goes through in strips of PREVIEW_STRIP lines. Each strip is
+ * filtered (--denoise), converted and counted into the luma histogram
+ * (--auto-level), and then its side outputs are taken while the strip is
+ * still in cache (--thumbnail, --grey-copy). When lines are not packed
+ * (a software ROI, or a padded stride) each strip is first gathered into
+ * packed lines, which only reads the lines and bytes of the region.
+ */
+static void convert_in_strips(const unsigned char *src, int size, unsigned char *dst)
+{
+    static unsigned char gathered[PREVIEW_STRIP * 1280 * 2];
+    const unsigned char *lut = autolevel_enabled() ? autolevel_lut() : brighten_lut();
+    const unsigned char *in;
+    int line = fmt.fmt.pix.width * 2;
+    int packed = (int)fmt.fmt.pix.bytesperline == line;
+    int strip = preview_enabled() || !packed ? PREVIEW_STRIP * line : size;
+    unsigned int hist[256] = { 0 };
+    int offset, chunk;
+
+    // From here on offsets count packed bytes
+    if (!packed)
+        size = frame_rows(size) * line;
+
+    for (offset = 0; offset < size; offset += chunk) {
+        chunk = size - offset < strip ? size - offset : strip;
+        if (packed)
+            in = src + offset;
+        else {
+            pack_lines(src, offset / line, chunk / line, gathered);
+            in = gathered;
+        }
 
-   // Computed values may need clipping.
-   if (r1 > 255) r1 = 255;
-   if (g1 > 255) g1 = 255;
-   if (b1 > 255) b1 = 255;
+        if (denoise_enabled())
+            denoise_convert(in, offset, chunk, dst + offset / 2 * 3, lut, hist);
+        else
+            yuyv_to_rgb_lut(in, chunk, dst + offset / 2 * 3, lut, hist);
 
-   if (r1 < 0) r1 = 0;
-   if (g1 < 0) g1 = 0;
-   if (b1 < 0) b1 = 0;
+        if (preview_enabled())
+            preview_rows(denoise_enabled() ? denoise_filtered() + offset : in,
+                         dst + offset / 2 * 3, offset / line, chunk / line);
+    }
 
-   *r = r1 ;
-   *g = g1 ;
-   *b = b1 ;
+    // The histogram sets the levels for the next frame
+    if (autolevel_enabled())
+        autolevel_update(hist, size / 2);
 }
-void process_and_transform_image(const void *p, int size, unsigned char *transformed_data) {
-    int i, newi;
-    int y_temp, y2_temp, u_temp, v_temp;
+
+/**
+ * @brief Converts a YUYV frame to RGB, or to a cheaper degraded output.
+ *
+ * In DEGRADE_NONE the full frame is converted and brightened. The degraded
+ * modes trade output quality for time when deadlines keep being missed:
+ * DEGRADE_SKIP_BRIGHTNESS drops the brightness step, DEGRADE_HALF_RES keeps
+ * one pixel per YUYV pair on every other line, DEGRADE_GREY copies luma only.
+ *
+ * @param p YUYV source frame.
+ * @param size Bytes used in the source frame.
+ * @param transformed_data Destination, large enough for a full RGB frame.
+ * @param mode Transform mode selected by the deadline monitor.
+ * @param geometry Filled in with the shape of the output image.
+ * @param frame Frame number, for the log and trace.
+ * @return Number of bytes written to transformed_data.
+ */
+int process_and_transform_image(const void *p, int size, unsigned char *transformed_data,
+                                enum degrade_mode mode, struct frame_geometry *geometry, int frame) {
+    struct timespec transform_start, transform_end;
+    double transform_duration, frame_rate;
+    int row;
     unsigned char *pptr = (unsigned char *)p;
-    double alpha = 1.25;
-    unsigned char beta = 25;
+    int width = fmt.fmt.pix.width, height = fmt.fmt.pix.height;
+    int stride = fmt.fmt.pix.bytesperline;
+    // A packed frame converts in one run, otherwise (software ROI, padding) line by line
+    int packed = stride == width * 2;
+    int runs = packed ? 1 : frame_rows(size), run = packed ? size : width * 2;
 
     // Start timing processing and transformation
     clock_gettime(CLOCK_MONOTONIC, &transform_start);
-
-    // Process YUYV to RGB and apply brightness transformation
-    for (i = 0, newi = 0; i < size; i = i + 4, newi = newi + 6) {
-        y_temp = pptr[i];
-        u_temp = pptr[i + 1];
-        y2_temp = pptr[i + 2];
-        v_temp = pptr[i + 3];
-
-        unsigned char r, g, b;
-        yuv2rgb(y_temp, u_temp, v_temp, &r, &g, &b);
-        // Apply brightness transformation
-        transformed_data[newi] = (r * alpha) + beta > SAT ? SAT : (r * alpha) + beta;
-        transformed_data[newi + 1] = (g * alpha) + beta > SAT ? SAT : (g * alpha) + beta;
-        transformed_data[newi + 2] = (b * alpha) + beta > SAT ? SAT : (b * alpha) + beta;
-
-        yuv2rgb(y2_temp, u_temp, v_temp, &r, &g, &b);
-        transformed_data[newi + 3] = (r * alpha) + beta > SAT ? SAT : (r * alpha) + beta;
-        transformed_data[newi + 4] = (g * alpha) + beta > SAT ? SAT : (g * alpha) + beta;
-        transformed_data[newi + 5] = (b * alpha) + beta > SAT ? SAT : (b * alpha) + beta;
+    perf_begin(STAGE_TRANSFORM);
+    account_begin(STAGE_TRANSFORM);
+
+    geometry->width = width;
+    geometry->height = height;
+    geometry->channels = 3;
+
+    switch (mode) {
+    case DEGRADE_SKIP_BRIGHTNESS:
+        for (row = 0; row < runs; row++)
+            yuyv_to_rgb_plain(pptr + (size_t)row * stride, run, transformed_data + (size_t)row * width * 3);
+        break;
+
+    case DEGRADE_HALF_RES:
+        geometry->width = width / 2;
+        geometry->height = height / 2;
+        // the fixed brightness LUT gives the same levels the full frame gets
+        for (row = 0; row < geometry->height; row++)
+            yuyv_to_rgb_half(pptr + (size_t)(2 * row) * stride, geometry->width * 4,
+                             transformed_data + (size_t)row * geometry->width * 3, brighten_lut());
+        break;
+
+    case DEGRADE_GREY:
+        geometry->channels = 1;
+        for (row = 0; row < runs; row++)
+            yuyv_to_grey(pptr + (size_t)row * stride, run, transformed_data + (size_t)row * width);
+        break;
+
+    default:
+        if (denoise_enabled() || autolevel_enabled() || preview_enabled() || !packed) {
+            convert_in_strips(pptr, size, transformed_data);
+            break;
+        }
+        // Process YUYV to RGB and apply brightness transformation
+        yuyv_to_rgb(pptr, size, transformed_data);
+        break;
     }
 
     // End timing transformation
+    perf_end(STAGE_TRANSFORM, (unsigned long)width * height);
     clock_gettime(CLOCK_MONOTONIC, &transform_end);
 
     // Log transformation process
     transform_duration = (transform_end.tv_sec - transform_start.tv_sec) +
                          (transform_end.tv_nsec - transform_start.tv_nsec) / 1e9;
+    account_end(STAGE_TRANSFORM, transform_duration);
     frame_rate = 1.0 / transform_duration;
-    trans_total +=  frame_rate;
-
-    // Update worst frame rate 
+    metrics_observe(STAGE_TRANSFORM, transform_duration);
+    trace_span("transform", &transform_start, &transform_end, frame, -1);
+    if (on_capture_thread())
+        deadline_check(STAGE_TRANSFORM, transform_duration, frame);
+
+    // Update totals and worst frame rate
+    pthread_mutex_lock(&stage_lock);
+    trans_total += transform_duration;
+    trans_count++;
     if (transform.worst_frame_rate == 0 || frame_rate < transform.worst_frame_rate) {
         transform.worst_frame_rate = frame_rate;
     }
+    pthread_mutex_unlock(&stage_lock);
 
     // Log transformation time and frame rate
-    syslog(LOG_INFO, "Transformation duration: %lf s, Frame rate: %lf Hz FPS, for frame %d\n", transform_duration, frame_rate, framecnt);
+    syslog(LOG_INFO, "Transformation duration: %lf s, Frame rate: %lf Hz FPS, for frame %d\n", transform_duration, frame_rate, frame);
+
+    return geometry->width * geometry->height * geometry->channels;
 }
 
+static void request_stop(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
 
-void process_image(const void *p, int size) {
-    struct timespec frame_time;
-    unsigned char transformed_data[(1280*960)*3]; 
+// Deadline monitor hook, the new mode applies from the next frame on
+static void switch_transform_mode(enum degrade_mode mode, enum metric_stage cause)
+{
+    transform_mode = mode;
+    syslog(LOG_INFO, "transform mode now %s after %s misses\n",
+           deadline_mode_name(mode), metrics_stage_name(cause));
+}
+
+
+// Ring writer for raw mode: conversion is deferred until a frame is actually flushed
+static int flush_raw_frame(const unsigned char *data, int size, const struct frame_geometry *geometry,
+                           unsigned int tag, const struct timespec *time)
+{
+    static unsigned char converted[(1280*960)*3];
+    struct frame_geometry out;
+    int converted_size;
 
-    // record when process was called
-    clock_gettime(CLOCK_REALTIME, &frame_time);    
+    (void)geometry;
+    converted_size = process_and_transform_image(data, size, converted, transform_mode, &out, tag);
+    return write_ppm(converted, converted_size, &out, tag, time);
+}
+
+/**
+ * @brief Keeps a frame in the pre-trigger ring instead of writing it.
+ *
+ * Raw mode stores the YUYV bytes and skips the transform, so only the
+ * frames around a trigger are ever converted.
+ *
+ * @param transformed_data process_image's frame buffer, used for the conversion or packed lines.
+ */
+static void ring_image(const void *p, int size, const struct timespec *frame_time, unsigned char *transformed_data)
+{
+    struct frame_geometry geometry;
+    int transformed_size;
+
+    // Warm-up frames are numbered below zero and are neither kept nor allowed to trigger
+    if (framecnt < 0)
+        return;
+
+    if (ring_raw) {
+        geometry.width = fmt.fmt.pix.width;
+        geometry.height = fmt.fmt.pix.height;
+        geometry.channels = 2;
+        if (store == STORE_RAW && (int)fmt.fmt.pix.bytesperline != geometry.width * 2) {
+            // Written as stored, so like the raw store without a ring it keeps packed lines of the region
+            pack_lines(p, 0, frame_rows(size), transformed_data);
+            ring_store(transformed_data, frame_rows(size) * geometry.width * 2, &geometry, framecnt, frame_time);
+        } else
+            ring_store(p, size, &geometry, framecnt, frame_time);
+    } else {
+        transformed_size = process_and_transform_image(p, size, transformed_data, transform_mode, &geometry,
+                                                       framecnt);
+        ring_store(transformed_data, transformed_size, &geometry, framecnt, frame_time);
+    }
+
+    ring_poll(framecnt, p, fmt.fmt.pix.bytesperline);
+}
+
+// Stamped with its dequeue time, as the selector may hand a frame over up to a period later
+void process_image(const void *p, int size, const struct timespec *dequeued) {
+    struct timespec frame_time = *dequeued;
+    unsigned char transformed_data[(1280*960)*3]; 
+    unsigned char *dst;
+    struct frame_geometry geometry;
+    int transformed_size, written, reference_tag;
 
     framecnt++;
     syslog(LOG_INFO,"frame %d: ", framecnt);
@@ -289,11 +512,55 @@ void process_image(const void *p, int size) {
     // Check for the frame format and process accordingly
     if(fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV) {
 
+        if (stream_enabled()) {
+            // The reader is gone, nothing more to capture for
+            if (stream_frame(p, size, framecnt, &frame_time) < 0)
+                stop_requested = 1;
+            return;
+        }
+
+        if (ring_enabled()) {
+            ring_image(p, size, &frame_time, transformed_data);
+            return;
+        }
+
+        // Nothing changed since the last written frame, note that instead of writing it again
+        if (dedupe_enabled() && !dedupe_check(p, fmt.fmt.pix.bytesperline, &reference_tag)) {
+            dedupe_skipped(writeback_reference(framecnt, reference_tag, &frame_time));
+            syslog(LOG_INFO, "frame %d unchanged from frame %d, not written\n", framecnt, reference_tag);
+            return;
+        }
+
+        if (store == STORE_RAW) {
+            // Conversion happens offline in yuyv_convert, the payload goes out as dequeued
+            geometry.width = fmt.fmt.pix.width;
+            geometry.height = fmt.fmt.pix.height;
+            geometry.channels = 2;
+            if ((int)fmt.fmt.pix.bytesperline != geometry.width * 2) {
+                // The file holds packed lines of the region only
+                pack_lines(p, 0, frame_rows(size), transformed_data);
+                written = write_ppm(transformed_data, frame_rows(size) * geometry.width * 2, &geometry,
+                                    framecnt, &frame_time);
+            } else
+                written = write_ppm(p, size, &geometry, framecnt, &frame_time);
+            if (dedupe_enabled() && written > 0)
+                dedupe_commit(framecnt, written);
+            return;
+        }
+
+        // The mapped store hands out the frame's spot in the output file, so nothing is copied
+        dst = writeback_buffer();
+        if (!dst)
+            dst = transformed_data;
+
         // Process and transform the image (including YUYV to RGB conversion and brightness adjustment)
-        process_and_transform_image(p, size, transformed_data);
+        transformed_size = process_and_transform_image(p, size, dst, transform_mode, &geometry, framecnt);
 
         // Perform writeback
-        write_ppm(transformed_data, ((size*6)/4), framecnt, &frame_time); // Make sure the size is correct based on the conversion ratio
+        written = write_ppm(dst, transformed_size, &geometry, framecnt, &frame_time);
+        preview_write(framecnt, &frame_time);
+        if (dedupe_enabled() && written > 0)
+            dedupe_commit(framecnt, written);
     } else {
         printf("ERROR - unknown dump format\n");
     }
@@ -304,13 +571,76 @@ void process_image(const void *p, int size) {
 
 
 
-static int read_frame(void)
+/**
+ * @brief Hands a buffer back to the driver.
+ *
+ * @param index V4L2 buffer index.
+ * @param frame Frame number the buffer held, for the trace.
+ */
+static void requeue_buffer(unsigned int index, int frame)
 {
     struct v4l2_buffer buf;
+    struct timespec qbuf_start, qbuf_end;
+
+    CLEAR(buf);
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+
+    clock_gettime(CLOCK_MONOTONIC, &qbuf_start);
+    if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+        errno_exit("VIDIOC_QBUF");
+    clock_gettime(CLOCK_MONOTONIC, &qbuf_end);
+    trace_span("qbuf", &qbuf_start, &qbuf_end, frame, index);
+
+    metrics_gauge_add(METRIC_APP_BUFFERS_HELD, -1);
+    metrics_gauge_add(METRIC_DRIVER_QUEUE_DEPTH, 1);
+}
+
+/**
+ * @brief Requeues a processed buffer, unless the output stream still references it.
+ *
+ * Buffers the stream reader has finished with since are requeued as well.
+ *
+ * @param index V4L2 buffer index.
+ * @param frame Frame number the buffer held, for the trace.
+ */
+static void release_buffer(unsigned int index, int frame)
+{
+    const void *done;
     unsigned int i;
 
-    // Start timing transformation
+    if (!stream_holds(buffers[index].frame))
+        requeue_buffer(index, frame);
+
+    while ((done = stream_reclaim()) != NULL)
+        for (i = 0; i < n_buffers; i++)
+            if (buffers[i].frame == done)
+                requeue_buffer(i, frame);
+}
+
+static void begin_acquisition(void)
+{
     clock_gettime(CLOCK_MONOTONIC, &acquisition_start);
+    perf_begin(STAGE_ACQUISITION);
+    account_begin(STAGE_ACQUISITION);
+}
+
+/*
+ * Returns 1 when a frame was processed, 0 when one was dequeued but
+ * dropped (warm-up, selector) or the driver reported EIO, and -1 when
+ * there was no frame yet (EAGAIN), which is what a busy poll backs off on.
+ */
+static int read_frame(void)
+{
+    static unsigned int last_sequence;
+    static int have_sequence;
+    struct v4l2_buffer buf;
+    int emit, release;
+
+    // A busy poll comes through here on every spin, so its stage starts once a frame is in
+    if (!busypoll_enabled())
+        begin_acquisition();
     CLEAR(buf);
 
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -321,7 +651,7 @@ static int read_frame(void)
                 switch (errno)
                 {
                     case EAGAIN:
-                        return 0;
+                        return -1;
 
                     case EIO:
                         /* Could ignore EIO, but drivers should only set for serious errors, although some set for
@@ -337,13 +667,38 @@ static int read_frame(void)
             }
 
     assert(buf.index < n_buffers);
+    busypoll_observe(&buf);
+    clock_gettime(CLOCK_REALTIME, &buffers[buf.index].captured);
+    if (busypoll_enabled())
+        begin_acquisition();
+    control_observe(&buf.timestamp);
     // End timing for acquisition
+    perf_end(STAGE_ACQUISITION, (unsigned long)fmt.fmt.pix.width * fmt.fmt.pix.height);
     clock_gettime(CLOCK_MONOTONIC, &acquisition_end);
+    buffers[buf.index].bytesused = buf.bytesused;
+
+    metrics_count(METRIC_FRAMES_IN, 1);
+    metrics_gauge_add(METRIC_APP_BUFFERS_HELD, 1);
+    metrics_gauge_add(METRIC_DRIVER_QUEUE_DEPTH, -1);
+    // The driver numbers every frame it captures, so a jump means frames were lost
+    if (have_sequence && buf.sequence - last_sequence > 1)
+    {
+        metrics_count(METRIC_FRAMES_DROPPED, buf.sequence - last_sequence - 1);
+        trace_instant("drop", &acquisition_end, framecnt + 1, buf.sequence - last_sequence - 1);
+    }
+    last_sequence = buf.sequence;
+    have_sequence = 1;
+
     // Calculate acquisition duration and frame rate
     acquisition_duration = (acquisition_end.tv_sec - acquisition_start.tv_sec) +
                         (acquisition_end.tv_nsec - acquisition_start.tv_nsec) / 1e9;
+    account_end(STAGE_ACQUISITION, acquisition_duration);
     acquisition_frame_rate = 1.0 / acquisition_duration;
-    acq_total += acquisition_frame_rate;
+    acq_total += acquisition_duration;
+    acq_count++;
+    metrics_observe(STAGE_ACQUISITION, acquisition_duration);
+    trace_span("acquisition", &acquisition_start, &acquisition_end, framecnt + 1, buf.index);
+    deadline_check(STAGE_ACQUISITION, acquisition_duration, framecnt + 1);
             
 
     // Update worst frame rate 
@@ -354,10 +709,45 @@ static int read_frame(void)
     // Log acquisition time and frame rate
     syslog(LOG_INFO, "Acquision duration: %lf s, Frame rate: %lf Hz FPS, for frame %d\n", acquisition_duration, acquisition_frame_rate, framecnt);
 
-    process_image(buffers[buf.index].start, buf.bytesused);
+    if (!warmup_done())
+    {
+        if (!warmup_offer(buffers[buf.index].frame, fmt.fmt.pix.bytesperline, &buf.timestamp,
+                          &acquisition_end))
+        {
+            // Still settling, nothing downstream sees this frame
+            trace_span("dqbuf_wait", &dqbuf_wait_start, &acquisition_end, framecnt + 1, buf.index);
+            requeue_buffer(buf.index, framecnt + 1);
+            clock_gettime(CLOCK_MONOTONIC, &dqbuf_wait_start);
+            return 0;
+        }
+        // first good frame becomes frame 0
+        framecnt = -1;
+    }
 
-    if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-        errno_exit("VIDIOC_QBUF");
+    if (selector_enabled())
+    {
+        // Only the best frame of each period is transformed and written, the rest go straight back
+        selector_offer(buf.index, buffers[buf.index].frame, fmt.fmt.pix.bytesperline, &acquisition_end,
+                       &emit, &release);
+        trace_span("dqbuf_wait", &dqbuf_wait_start, &acquisition_end, framecnt + 1, buf.index);
+        if (release >= 0)
+            requeue_buffer(release, framecnt + 1);
+        if (emit < 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &dqbuf_wait_start);
+            return 0;
+        }
+
+        process_image(buffers[emit].frame, roi_size(buffers[emit].bytesused), &buffers[emit].captured);
+        release_buffer(emit, framecnt);
+        return 1;
+    }
+
+    process_image(buffers[buf.index].frame, roi_size(buf.bytesused), &buffers[buf.index].captured);
+    // framecnt now names the frame this buffer became
+    trace_span("dqbuf_wait", &dqbuf_wait_start, &acquisition_end, framecnt, buf.index);
+
+    release_buffer(buf.index, framecnt);
     
     return 1;
 }
@@ -380,39 +770,70 @@ static void mainloop(void)
 
     count = frame_count;
 
-    while (count > 0)
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    fstart = (double)time_start.tv_sec + (double)time_start.tv_nsec / 1000000000.0;
+
+    while (count > 0 && !stop_requested)
     {
+        clock_gettime(CLOCK_MONOTONIC, &dqbuf_wait_start);
+
         for (;;)
         {
             fd_set fds;
             struct timeval tv;
             int r;
 
-            FD_ZERO(&fds);
-            FD_SET(fd, &fds);
-
-            /* Timeout. */
-            tv.tv_sec = 2;
-            tv.tv_usec = 0;
-
-            r = select(fd + 1, &fds, NULL, NULL, &tv);
-
-            if (-1 == r)
+            if (busypoll_enabled())
             {
-                if (EINTR == errno)
+                // The dequeue is the poll, EAGAIN only means the frame is not there yet
+                r = read_frame();
+                if (r < 0)
+                {
+                    if (stop_requested)
+                        break;
+                    if (busypoll_idle() < 0)
+                    {
+                        fprintf(stderr, "busy poll timeout\n");
+                        exit(EXIT_FAILURE);
+                    }
                     continue;
-                errno_exit("select");
+                }
             }
-
-            if (0 == r)
+            else
             {
-                fprintf(stderr, "select timeout\n");
-                exit(EXIT_FAILURE);
+                FD_ZERO(&fds);
+                FD_SET(fd, &fds);
+
+                /* Timeout. */
+                tv.tv_sec = 2;
+                tv.tv_usec = 0;
+
+                r = select(fd + 1, &fds, NULL, NULL, &tv);
+
+                if (-1 == r)
+                {
+                    if (EINTR == errno)
+                    {
+                        if (stop_requested)
+                            break;
+                        continue;
+                    }
+                    errno_exit("select");
+                }
+
+                if (0 == r)
+                {
+                    fprintf(stderr, "select timeout\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                r = read_frame();
             }
 
-            if (read_frame())
+            if (r > 0)
             {
-                if(nanosleep(&read_delay, &time_error) != 0)
+                // a busy poll never sleeps, a frame arriving meanwhile would wait
+                if(!busypoll_enabled() && nanosleep(&read_delay, &time_error) != 0)
                     perror("nanosleep");
                 else
                 {
@@ -444,7 +865,9 @@ static void mainloop(void)
                     }
                 }
 
-                count--;
+                // continuous capture runs until a stop signal
+                if (!continuous)
+                    count--;
                 break;
             }
 
@@ -486,6 +909,7 @@ static void start_capturing(void)
             if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
                     errno_exit("VIDIOC_QBUF");
         }
+        metrics_gauge_set(METRIC_DRIVER_QUEUE_DEPTH, n_buffers);
         type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
         errno_exit("VIDIOC_STREAMON");
@@ -520,6 +944,7 @@ static void init_read(unsigned int buffer_size)
         fprintf(stderr, "Out of memory\n");
         exit(EXIT_FAILURE);
     }
+    buffers[0].frame = roi_frame(buffers[0].start);
 }
 
 static void init_mmap(void)
@@ -581,6 +1006,7 @@ static void init_mmap(void)
 
             if (MAP_FAILED == buffers[n_buffers].start)
                 errno_exit("mmap");
+            buffers[n_buffers].frame = roi_frame(buffers[n_buffers].start);
         }
 }
 
@@ -619,6 +1045,7 @@ static void init_userp(unsigned int buffer_size)
                         fprintf(stderr, "Out of memory\n");
                         exit(EXIT_FAILURE);
                 }
+                buffers[n_buffers].frame = roi_frame(buffers[n_buffers].start);
         }
 }
 
@@ -741,11 +1168,47 @@ static void init_device(void)
     if (fmt.fmt.pix.sizeimage < min)
             fmt.fmt.pix.sizeimage = min;
 
+    // Cropping changes the format, so it goes in before the controls and the buffers
+    if (roi_apply(fd, &fmt) < 0)
+    {
+        fprintf(stderr, "ROI does not fit in the %ux%u frame\n", fmt.fmt.pix.width, fmt.fmt.pix.height);
+        exit(EXIT_FAILURE);
+    }
+
+    // A format change resets exposure and frame interval, so the profile goes on afterwards
+    control_apply(fd);
+
 
     init_mmap();
 }
 
 
+/**
+ * @brief Colour matrix the driver says its YUYV is encoded with.
+ *
+ * Unset encoding and quantization follow the V4L2 defaults for the
+ * colourspace: BT.709 for HD colourspaces, BT.601 otherwise, limited
+ * range unless the colourspace is JPEG.
+ */
+static const char *format_matrix(void)
+{
+    unsigned int enc = V4L2_YCBCR_ENC_DEFAULT, quant = V4L2_QUANTIZATION_DEFAULT;
+
+    // The encoding fields are only filled in by drivers that set the extended format magic
+    if (fmt.fmt.pix.priv == V4L2_PIX_FMT_PRIV_MAGIC) {
+        enc = fmt.fmt.pix.ycbcr_enc;
+        quant = fmt.fmt.pix.quantization;
+    }
+    if (enc == V4L2_YCBCR_ENC_DEFAULT)
+        enc = V4L2_MAP_YCBCR_ENC_DEFAULT(fmt.fmt.pix.colorspace);
+    if (quant == V4L2_QUANTIZATION_DEFAULT)
+        quant = V4L2_MAP_QUANTIZATION_DEFAULT(0, fmt.fmt.pix.colorspace, enc);
+
+    if (enc == V4L2_YCBCR_ENC_709)
+        return quant == V4L2_QUANTIZATION_FULL_RANGE ? "bt709-full" : "bt709";
+    return quant == V4L2_QUANTIZATION_FULL_RANGE ? "bt601-full" : "bt601";
+}
+
 static void close_device(void)
 {
         if (-1 == close(fd))
@@ -789,15 +1252,82 @@ static void usage(FILE *fp, int argc, char **argv)
                  "-m | --mmap          Use memory mapped buffers [default]\n"
                  "-r | --read          Use read() calls\n"
                  "-u | --userp         Use application allocated buffers\n"
-                 "-o | --output        Outputs stream to stdout\n"
+                 "-o | --output        Stream frames to stdout instead of writing files\n"
                  "-f | --format        Force format to 640x480 GREY\n"
                  "-c | --count         Number of frames to grab [%i]\n"
+                 "--metrics path       Serve live Prometheus metrics on a unix socket\n"
+                 "--trace file.json    Write per-frame stage spans as Chrome trace JSON\n"
+                 "--deadline svc=ms,.. Deadlines for acquisition, transform, writeback\n"
+                 "--degrade mode       On persistent misses switch to skip-brightness, half-res or grey\n"
+                 "--degrade-after n    Consecutive misses before degrading [3]\n"
+                 "--recover-after n    Consecutive met deadlines before recovering [30]\n"
+                 "--timelapse hz       Keep only the sharpest, most stable frame per 1/hz period\n"
+                 "--warmup mode        fixed skips 8 frames, adaptive waits for exposure to settle [fixed]\n"
+                 "--warmup-timeout s   Longest adaptive warm-up before accepting frames [5]\n"
+                 "--dedupe levels      Skip frames whose 16x16 blocks all changed less than this\n"
+                 "--store kind         ppm files per frame, delta archive frames.cdl, raw YUYV frames.yuyv,\n"
+                 "                     or mapped, a PPM stream transformed straight into mmapped frames.pnm [ppm]\n"
+                 "--key-interval n     Delta store: whole frame at least every n frames [30]\n"
+                 "--delta-threshold l  Delta store: reuse blocks differing less than l levels [0, lossless]\n"
+                 "--direct             Write PPM files with O_DIRECT, bypassing the page cache\n"
+                 "--ring s             Keep the last s seconds in RAM, write only around triggers\n"
+                 "--ring-after s       Seconds recorded after a trigger [2]\n"
+                 "--ring-raw           Keep raw YUYV in the ring, convert only flushed frames\n"
+                 "--ring-socket path   Trigger on any datagram sent to this unix socket\n"
+                 "--ring-motion levels Trigger when mean luma change between frames exceeds this\n"
+                 "                     SIGUSR1 always triggers in ring mode\n"
+                 "--continuous         Capture until SIGINT/SIGTERM instead of a frame count\n"
+                 "--quota MB           Disk budget; old frames or archive segments are reused\n"
+                 "--segment MB         Archive segment size under a quota [64]\n"
+                 "--perf               Count cycles, instructions, cache and branch misses per stage\n"
+                 "--cpu-time           Split stage time into thread CPU time and interference\n"
+                 "--output-format fmt  -o stream as y4m (planar 4:2:2) or raw YUYV [y4m]\n"
+                 "--auto-level         Set brightness and contrast per frame from the luma histogram\n"
+                 "--denoise            Motion adaptive temporal noise filter in the transform\n"
+                 "--thumbnail n        Also write an RGB thumbnail box-downscaled by 2 or 4, not with --ring\n"
+                 "--grey-copy          Also write a full resolution grey PGM, not with --ring\n"
+                 "--roi WxH+X+Y        Keep only this region, cropped by the driver or in software\n"
+                 "--colour-matrix m    bt601, bt601-full, bt709, bt709-full, or auto from the driver [auto]\n"
+                 "--durability p       Sync written frames: none, every=N, interval=ms or writebehind [none]\n"
+                 "--busy-poll cpu      Spin on DQBUF pinned to cpu instead of sleeping in select()\n"
+                 "--controls spec      Camera profile fixed, steady or auto, plus key=value overrides:\n"
+                 "                     exposure, exposure-abs, gain, powerline, priority, fps\n"
                  "",
                  argv[0], dev_name, frame_count);
 }
 
 static const char short_options[] = "d:hmruofc:";
 
+// Options without a short form start above the character range
+enum long_only_option
+{
+        OPT_METRICS = 256,
+        OPT_TRACE,
+        OPT_DEADLINE,
+        OPT_DEGRADE,
+        OPT_DEGRADE_AFTER,
+        OPT_RECOVER_AFTER,
+        OPT_TIMELAPSE,
+        OPT_WARMUP,
+        OPT_WARMUP_TIMEOUT,
+        OPT_DEDUPE,
+        OPT_STORE,
+        OPT_KEY_INTERVAL,
+        OPT_DELTA_THRESHOLD,
+        OPT_DIRECT,
+        OPT_RING,
+        OPT_RING_AFTER,
+        OPT_RING_RAW,
+        OPT_RING_SOCKET,
+        OPT_RING_MOTION,
+        OPT_CONTINUOUS,
+        OPT_QUOTA,
+        OPT_SEGMENT,
+        OPT_PERF, OPT_CPU_TIME, OPT_OUTPUT_FORMAT, OPT_CONTROLS, OPT_AUTO_LEVEL, OPT_DENOISE, OPT_THUMBNAIL, OPT_GREY_COPY,
+        OPT_ROI, OPT_COLOUR_MATRIX, OPT_DURABILITY,
+        OPT_BUSY_POLL,
+};
+
 static const struct option
 long_options[] = {
         { "device", required_argument, NULL, 'd' },
@@ -808,12 +1338,51 @@ long_options[] = {
         { "output", no_argument,       NULL, 'o' },
         { "format", no_argument,       NULL, 'f' },
         { "count",  required_argument, NULL, 'c' },
+        { "metrics", required_argument, NULL, OPT_METRICS },
+        { "trace",  required_argument, NULL, OPT_TRACE },
+        { "deadline", required_argument, NULL, OPT_DEADLINE },
+        { "degrade", required_argument, NULL, OPT_DEGRADE },
+        { "degrade-after", required_argument, NULL, OPT_DEGRADE_AFTER },
+        { "recover-after", required_argument, NULL, OPT_RECOVER_AFTER },
+        { "timelapse", required_argument, NULL, OPT_TIMELAPSE },
+        { "warmup", required_argument, NULL, OPT_WARMUP },
+        { "warmup-timeout", required_argument, NULL, OPT_WARMUP_TIMEOUT },
+        { "dedupe", required_argument, NULL, OPT_DEDUPE },
+        { "store", required_argument, NULL, OPT_STORE },
+        { "key-interval", required_argument, NULL, OPT_KEY_INTERVAL },
+        { "delta-threshold", required_argument, NULL, OPT_DELTA_THRESHOLD },
+        { "direct", no_argument, NULL, OPT_DIRECT },
+        { "ring", required_argument, NULL, OPT_RING },
+        { "ring-after", required_argument, NULL, OPT_RING_AFTER },
+        { "ring-raw", no_argument, NULL, OPT_RING_RAW },
+        { "ring-socket", required_argument, NULL, OPT_RING_SOCKET },
+        { "ring-motion", required_argument, NULL, OPT_RING_MOTION },
+        { "continuous", no_argument, NULL, OPT_CONTINUOUS },
+        { "quota", required_argument, NULL, OPT_QUOTA },
+        { "segment", required_argument, NULL, OPT_SEGMENT },
+        { "perf", no_argument, NULL, OPT_PERF },
+        { "cpu-time", no_argument, NULL, OPT_CPU_TIME },
+        { "output-format", required_argument, NULL, OPT_OUTPUT_FORMAT },
+        { "controls", required_argument, NULL, OPT_CONTROLS },
+        { "auto-level", no_argument, NULL, OPT_AUTO_LEVEL },
+        { "denoise", no_argument, NULL, OPT_DENOISE },
+        { "thumbnail", required_argument, NULL, OPT_THUMBNAIL },
+        { "grey-copy", no_argument, NULL, OPT_GREY_COPY },
+        { "roi", required_argument, NULL, OPT_ROI },
+        { "colour-matrix", required_argument, NULL, OPT_COLOUR_MATRIX },
+        { "durability", required_argument, NULL, OPT_DURABILITY },
+        { "busy-poll", required_argument, NULL, OPT_BUSY_POLL },
         { 0, 0, 0, 0 }
 };
 
 int main(int argc, char **argv)
 {
-    if(argc > 1)
+    int degrade = DEGRADE_NONE;
+    unsigned int degrade_after = 3, recover_after = 30;
+    unsigned long side_bytes = 0;
+
+    capture_thread = pthread_self();
+    if(argc > 1 && argv[1][0] != '-')
         dev_name = argv[1];
     else
         dev_name = "/dev/video0";
@@ -869,34 +1438,387 @@ int main(int argc, char **argv)
                         errno_exit(optarg);
                 break;
 
+            case OPT_METRICS:
+                metrics_path = optarg;
+                break;
+
+            case OPT_TRACE:
+                trace_path = optarg;
+                break;
+
+            case OPT_DEADLINE:
+                if (deadline_parse(optarg) < 0) {
+                        fprintf(stderr, "bad deadline list '%s'\n", optarg);
+                        exit(EXIT_FAILURE);
+                }
+                break;
+
+            case OPT_DEGRADE:
+                degrade = deadline_parse_mode(optarg);
+                if (degrade < 0) {
+                        fprintf(stderr, "unknown degrade mode '%s'\n", optarg);
+                        exit(EXIT_FAILURE);
+                }
+                break;
+
+            case OPT_DEGRADE_AFTER:
+                degrade_after = strtoul(optarg, NULL, 0);
+                break;
+
+            case OPT_RECOVER_AFTER:
+                recover_after = strtoul(optarg, NULL, 0);
+                break;
+
+            case OPT_TIMELAPSE:
+                timelapse_hz = strtod(optarg, NULL);
+                break;
+
+            case OPT_WARMUP:
+                if (strcmp(optarg, "adaptive") == 0)
+                        adaptive_warmup = 1;
+                else if (strcmp(optarg, "fixed") == 0)
+                        adaptive_warmup = 0;
+                else {
+                        fprintf(stderr, "unknown warmup mode '%s'\n", optarg);
+                        exit(EXIT_FAILURE);
+                }
+                break;
+
+            case OPT_WARMUP_TIMEOUT:
+                warmup_timeout = strtod(optarg, NULL);
+                break;
+
+            case OPT_DEDUPE:
+                dedupe_threshold = strtod(optarg, NULL);
+                break;
+
+            case OPT_STORE:
+                if (strcmp(optarg, "delta") == 0)
+                        store = STORE_DELTA;
+                else if (strcmp(optarg, "raw") == 0)
+                        store = STORE_RAW;
+                else if (strcmp(optarg, "ppm") == 0)
+                        store = STORE_PPM;
+                else if (strcmp(optarg, "mapped") == 0)
+                        store = STORE_MAPPED;
+                else {
+                        fprintf(stderr, "unknown store '%s'\n", optarg);
+                        exit(EXIT_FAILURE);
+                }
+                break;
+
+            case OPT_KEY_INTERVAL:
+                key_interval = atoi(optarg);
+                break;
+
+            case OPT_DELTA_THRESHOLD:
+                delta_threshold = strtod(optarg, NULL);
+                break;
+
+            case OPT_DIRECT:
+                direct_io = 1;
+                break;
+
+            case OPT_RING:
+                ring_before = strtod(optarg, NULL);
+                break;
+
+            case OPT_RING_AFTER:
+                ring_after = strtod(optarg, NULL);
+                break;
+
+            case OPT_RING_RAW:
+                ring_raw = 1;
+                break;
+
+            case OPT_RING_SOCKET:
+                ring_socket = optarg;
+                break;
+
+            case OPT_RING_MOTION:
+                ring_motion = strtod(optarg, NULL);
+                break;
+
+            case OPT_CONTINUOUS:
+                continuous = 1;
+                break;
+
+            case OPT_QUOTA:
+                quota_mb = strtoul(optarg, NULL, 10);
+                break;
+
+            case OPT_SEGMENT:
+                segment_mb = strtoul(optarg, NULL, 10);
+                break;
+
+            case OPT_PERF:
+                perf_counters = 1;
+                break;
+
+            case OPT_CPU_TIME:
+                cpu_time = 1;
+                break;
+
+            case OPT_OUTPUT_FORMAT:
+                if (strcmp(optarg, "y4m") == 0)
+                        stream_format = STREAM_Y4M;
+                else if (strcmp(optarg, "raw") == 0)
+                        stream_format = STREAM_RAW;
+                else {
+                        fprintf(stderr, "unknown output format '%s'\n", optarg);
+                        exit(EXIT_FAILURE);
+                }
+                break;
+
+            case OPT_CONTROLS:
+                if (control_parse(optarg) < 0) {
+                        fprintf(stderr, "bad control spec '%s'\n", optarg);
+                        exit(EXIT_FAILURE);
+                }
+                break;
+
+            case OPT_AUTO_LEVEL:
+                autolevel_enable();
+                break;
+
+            case OPT_DENOISE:
+                denoise = 1;
+                break;
+
+            case OPT_THUMBNAIL:
+                thumb_factor = atoi(optarg);
+                break;
+
+            case OPT_GREY_COPY:
+                grey_copy = 1;
+                break;
+
+            case OPT_COLOUR_MATRIX:
+                colour_matrix = optarg;
+                break;
+
+            case OPT_DURABILITY:
+                if (durable_parse(optarg) < 0) {
+                        fprintf(stderr, "bad durability '%s', expected none, every=N, interval=ms or writebehind\n", optarg);
+                        exit(EXIT_FAILURE);
+                }
+                break;
+
+            case OPT_BUSY_POLL:
+                if (busypoll_parse(optarg) < 0) {
+                        fprintf(stderr, "bad busy poll CPU '%s'\n", optarg);
+                        exit(EXIT_FAILURE);
+                }
+                break;
+
+            case OPT_ROI:
+                if (roi_parse(optarg) < 0) {
+                        fprintf(stderr, "bad ROI '%s', expected WxH+X+Y with even W and X\n", optarg);
+                        exit(EXIT_FAILURE);
+                }
+                break;
+
             default:
                 usage(stderr, argc, argv);
                 exit(EXIT_FAILURE);
         }
     }
 
+    // ring frames are written long after their strips went by, so there is nothing to take side outputs from
+    if ((thumb_factor || grey_copy) && ring_before > 0)
+    {
+        fprintf(stderr, "--thumbnail and --grey-copy cannot be used with --ring\n");
+        exit(EXIT_FAILURE);
+    }
+
+    deadline_set_policy(degrade, degrade_after, recover_after);
+    deadline_set_hook(switch_transform_mode);
+    writeback_init(FRAMES_DIR);
+    writeback_set_direct(direct_io);
+    if (durable_start(FRAMES_DIR) < 0)
+    {
+        fprintf(stderr, "cannot start the sync thread\n");
+        exit(EXIT_FAILURE);
+    }
+
     // initialization of V4L2
     open_device();
     init_device();
+
+    if (strcmp(colour_matrix, "auto") == 0)
+        colour_matrix = format_matrix();
+    if (convert_set_matrix(colour_matrix) < 0)
+    {
+        fprintf(stderr, "unknown colour matrix '%s'\n", colour_matrix);
+        exit(EXIT_FAILURE);
+    }
+    syslog(LOG_INFO, "colour matrix %s\n", convert_matrix_name());
+
+    // the quota is shared out in units of the largest frame file and its side outputs, so it needs the format
+    // (the raw store writes no side outputs, it never transforms)
+    if (thumb_factor && store != STORE_RAW)
+        side_bytes += (unsigned long)(fmt.fmt.pix.width / thumb_factor) * (fmt.fmt.pix.height / thumb_factor) * 3 + 64;
+    if (grey_copy && store != STORE_RAW)
+        side_bytes += (unsigned long)fmt.fmt.pix.width * fmt.fmt.pix.height + 64;
+    writeback_set_quota(quota_mb * 1024ULL * 1024ULL, segment_mb * 1024ULL * 1024ULL,
+                        (unsigned long)fmt.fmt.pix.width * fmt.fmt.pix.height * 3 + 64, side_bytes);
+    if (writeback_set_store(store, key_interval, delta_threshold) < 0)
+    {
+        fprintf(stderr, "cannot create the frame archive\n");
+        exit(EXIT_FAILURE);
+    }
+    // at least two buffers stay with the driver while the stream reader holds the rest
+    if (out_buf && stream_open(stream_format, fmt.fmt.pix.width, fmt.fmt.pix.height,
+                               fmt.fmt.pix.bytesperline, control_frame_rate(), n_buffers - 2) < 0)
+    {
+        fprintf(stderr, "cannot stream to stdout\n");
+        exit(EXIT_FAILURE);
+    }
+    if (denoise && denoise_init(fmt.fmt.pix.width * fmt.fmt.pix.height * 2) < 0)
+    {
+        fprintf(stderr, "cannot set up the denoise history\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((thumb_factor || grey_copy) &&
+        preview_init(fmt.fmt.pix.width, fmt.fmt.pix.height, thumb_factor, grey_copy) < 0)
+    {
+        fprintf(stderr, "thumbnail factor must be 2 or 4\n");
+        exit(EXIT_FAILURE);
+    }
+    if (timelapse_hz > 0 &&
+        selector_init(timelapse_hz, fmt.fmt.pix.width, fmt.fmt.pix.height) < 0)
+    {
+        fprintf(stderr, "cannot set up time-lapse selection\n");
+        exit(EXIT_FAILURE);
+    }
+    if (adaptive_warmup)
+    {
+        if (warmup_init(fmt.fmt.pix.width, fmt.fmt.pix.height, warmup_timeout) < 0)
+        {
+            fprintf(stderr, "cannot set up adaptive warm-up\n");
+            exit(EXIT_FAILURE);
+        }
+        // discarded warm-up frames are not counted, so drop the fixed allowance
+        if (frame_count == FRAMES_TO_ACQUIRE)
+            frame_count -= START_UP_FRAMES;
+    }
+    if (dedupe_threshold > 0 &&
+        dedupe_init(fmt.fmt.pix.width, fmt.fmt.pix.height, dedupe_threshold) < 0)
+    {
+        fprintf(stderr, "cannot set up change detection\n");
+        exit(EXIT_FAILURE);
+    }
+    if (ring_before > 0)
+    {
+        size_t slot;
+        ring_writer writer = ring_raw ? flush_raw_frame : write_ppm;
+
+        // A raw store keeps raw frames and writes them as they are
+        if (store == STORE_RAW)
+        {
+            ring_raw = 1;
+            writer = write_ppm;
+        }
+        slot = ring_raw ? fmt.fmt.pix.sizeimage : (size_t)fmt.fmt.pix.width * fmt.fmt.pix.height * 3;
+
+        if (ring_init(ring_before, ring_after, control_frame_rate(), slot, writer) < 0 ||
+            (ring_motion > 0 && ring_set_motion(fmt.fmt.pix.width, fmt.fmt.pix.height, ring_motion) < 0))
+        {
+            fprintf(stderr, "cannot set up the frame ring\n");
+            exit(EXIT_FAILURE);
+        }
+        if (ring_socket)
+            ring_listen(ring_socket);
+    }
+    if (continuous)
+    {
+        struct sigaction sa;
+
+        // no SA_RESTART, so a blocked select() returns and the run shuts down cleanly
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = request_stop;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        if (!quota_mb)
+            syslog(LOG_WARNING, "continuous capture without --quota, the frames directory will grow\n");
+    }
     start_capturing();
+    warmup_start();
+
+    // metrics are served from their own thread, capture only bumps atomics
+    if (metrics_path)
+        metrics_start(metrics_path);
+    if (trace_path)
+        trace_open(trace_path);
+    // counters follow the thread that opens them, which is the capture thread
+    if (perf_counters)
+        perf_init();
+    if (cpu_time)
+        account_enable();
+
+    // pinned last, so the threads started above stay off the polled core
+    if (busypoll_start() < 0)
+        fprintf(stderr, "cannot pin to the busy poll CPU, polling unpinned\n");
 
     // service loop frame read
     mainloop();
 
+    // the last period's best frame is still held, it goes out before the buffers are taken back
+    if (selector_enabled())
+    {
+        int held = selector_flush();
+
+        if (held >= 0)
+        {
+            process_image(buffers[held].frame, roi_size(buffers[held].bytesused), &buffers[held].captured);
+            release_buffer(held, framecnt);
+        }
+    }
+
     // shutdown of frame acquisition service
     stop_capturing();
+    ring_stop();
+    stream_close();
+    // the stores' last writes (segment end marker, mapped trim) are queued for syncing as they close
+    writeback_close();
+    durable_stop();
+    metrics_stop();
+    trace_close();
 
     // Calculate average fps freq
-    double average_transformation_fps = trans_total /(CAPTURE_FRAMES-LAST_FRAMES) ;
-    double average_writeback_fps = write_back_total /(CAPTURE_FRAMES-LAST_FRAMES) ;
-    double average_aquisition_fps = acq_total/ (CAPTURE_FRAMES-LAST_FRAMES);
+    double average_transformation_fps = trans_total > 0 ? trans_count / trans_total : 0;
+    double average_writeback_fps = write_back_total > 0 ? write_back_count / write_back_total : 0;
+    double average_aquisition_fps = acq_total > 0 ? acq_count / acq_total : 0;
     // Log the total acquisition time, average FPS, and worst frame rate
-    syslog(LOG_INFO, "Acquisition -- %d frames, Lowest FPS=%lf hz,  Average FPS=%lf hz\n",
-        CAPTURE_FRAMES, acquisition.worst_frame_rate, average_aquisition_fps);
-    syslog(LOG_INFO, "Transformation -- %d frames, %lf lowest FPS hz, Average FPS is %lf hz", 
-         CAPTURE_FRAMES + 1, transform.worst_frame_rate, average_transformation_fps);
-    syslog(LOG_INFO, "Write back --%d total frames, %lf lowest FPS hz, Average FPS is %lf hz", 
-    CAPTURE_FRAMES + 1, write_back.worst_frame_rate, average_writeback_fps);
+    syslog(LOG_INFO, "Acquisition -- %lu frames, Lowest FPS=%lf hz,  Average FPS=%lf hz\n",
+        acq_count, acquisition.worst_frame_rate, average_aquisition_fps);
+    syslog(LOG_INFO, "Transformation -- %lu frames, %lf lowest FPS hz, Average FPS is %lf hz", 
+         trans_count, transform.worst_frame_rate, average_transformation_fps);
+    syslog(LOG_INFO, "Write back --%lu total frames, %lf lowest FPS hz, Average FPS is %lf hz", 
+    write_back_count, write_back.worst_frame_rate, average_writeback_fps);
+    syslog(LOG_INFO, "Overall -- %d frames in %lf s, %lf FPS hz\n",
+        framecnt + 1, fstop - fstart, (fstop - fstart) > 0 ? (framecnt + 1) / (fstop - fstart) : 0);
+    deadline_report();
+    busypoll_report();
+    control_report();
+    roi_report();
+    autolevel_report();
+    denoise_report();
+    preview_report();
+    writeback_report();
+    delta_report();
+    archive_report();
+    mapped_report();
+    durable_report();
+    segment_report();
+    perf_report();
+    account_report();
+    ring_report();
+    stream_report();
+    selector_report();
+    warmup_report();
+    dedupe_report();
 
     uninit_device();
     close_device();
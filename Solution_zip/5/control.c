@@ -0,0 +1,350 @@
+/*
+ *  Camera control profiles, see control.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#include "control.h"
+
+#define DRIFT_WINDOW    (30)    /* intervals averaged per delivered-rate check */
+#define DRIFT_LIMIT     (0.05)  /* relative rate error that is worth a warning */
+
+struct setting
+{
+    unsigned int id;
+    const char *key;
+    int value;
+    int use_default;    /* pin at the driver's default rather than a given value */
+    int requested;
+};
+
+// Applied in this order: the exposure mode decides whether the absolute exposure takes effect
+static struct setting settings[] =
+{
+    { V4L2_CID_EXPOSURE_AUTO,           "exposure",     0, 0, 0 },
+    { V4L2_CID_EXPOSURE_AUTO_PRIORITY,  "priority",     0, 0, 0 },
+    { V4L2_CID_EXPOSURE_ABSOLUTE,       "exposure-abs", 0, 0, 0 },
+    { V4L2_CID_GAIN,                    "gain",         0, 0, 0 },
+    { V4L2_CID_POWER_LINE_FREQUENCY,    "powerline",    0, 0, 0 },
+};
+#define N_SETTINGS  (sizeof(settings) / sizeof(settings[0]))
+
+static int active;
+static double requested_fps;
+static double granted_fps;
+
+static struct timeval last_timestamp;
+static int have_timestamp;
+static unsigned long intervals, window_intervals, drift_windows;
+static double interval_total, interval_min, interval_max, window_total;
+static int drifting;
+
+
+static struct setting *find_setting(const char *key)
+{
+    unsigned int i;
+
+    for (i = 0; i < N_SETTINGS; i++)
+        if (strcmp(settings[i].key, key) == 0)
+            return &settings[i];
+    return NULL;
+}
+
+static void request(const char *key, int value, int use_default)
+{
+    struct setting *s = find_setting(key);
+
+    s->value = value;
+    s->use_default = use_default;
+    s->requested = 1;
+}
+
+static int load_profile(const char *name)
+{
+    if (strcmp(name, "fixed") == 0)
+    {
+        request("exposure", V4L2_EXPOSURE_MANUAL, 0);
+        request("priority", 0, 0);
+        request("exposure-abs", 150, 0);    // 15 ms, well inside a 30 fps period
+        request("gain", 0, 1);
+    }
+    else if (strcmp(name, "steady") == 0)
+    {
+        request("exposure", V4L2_EXPOSURE_APERTURE_PRIORITY, 0);
+        request("priority", 0, 0);
+    }
+    else if (strcmp(name, "auto") != 0)
+        return -1;
+
+    if (requested_fps <= 0)
+        requested_fps = NOMINAL_FPS;
+    return 0;
+}
+
+static int parse_value(const char *key, const char *text, int *value, int *use_default)
+{
+    char *end;
+
+    *use_default = strcmp(text, "default") == 0;
+    if (*use_default)
+        return 0;
+
+    if (strcmp(key, "exposure") == 0)
+    {
+        if (strcmp(text, "auto") == 0)
+            *value = V4L2_EXPOSURE_AUTO;
+        else if (strcmp(text, "manual") == 0)
+            *value = V4L2_EXPOSURE_MANUAL;
+        else if (strcmp(text, "aperture") == 0)
+            *value = V4L2_EXPOSURE_APERTURE_PRIORITY;
+        else if (strcmp(text, "shutter") == 0)
+            *value = V4L2_EXPOSURE_SHUTTER_PRIORITY;
+        else
+            return -1;
+        return 0;
+    }
+
+    if (strcmp(key, "powerline") == 0)
+    {
+        if (strcmp(text, "off") == 0)
+            *value = V4L2_CID_POWER_LINE_FREQUENCY_DISABLED;
+        else if (strcmp(text, "50") == 0)
+            *value = V4L2_CID_POWER_LINE_FREQUENCY_50HZ;
+        else if (strcmp(text, "60") == 0)
+            *value = V4L2_CID_POWER_LINE_FREQUENCY_60HZ;
+        else if (strcmp(text, "auto") == 0)
+            *value = V4L2_CID_POWER_LINE_FREQUENCY_AUTO;
+        else
+            return -1;
+        return 0;
+    }
+
+    *value = (int)strtol(text, &end, 10);
+    return *end == '\0' && end != text ? 0 : -1;
+}
+
+/**
+ * @brief Parses a control spec: profile names and key=value overrides, comma separated.
+ *
+ * @param spec e.g. "fixed,exposure-abs=200,fps=15".
+ * @return 0 on success, -1 on an unknown profile, key or value.
+ */
+int control_parse(const char *spec)
+{
+    char *copy, *item, *save, *eq;
+    int value = 0, use_default, rc = 0;
+
+    copy = strdup(spec);
+    if (!copy)
+        return -1;
+
+    for (item = strtok_r(copy, ",", &save); item && rc == 0; item = strtok_r(NULL, ",", &save))
+    {
+        eq = strchr(item, '=');
+        if (!eq)
+        {
+            rc = load_profile(item);
+            continue;
+        }
+
+        *eq = '\0';
+        if (strcmp(item, "fps") == 0)
+        {
+            requested_fps = strtod(eq + 1, NULL);
+            rc = requested_fps > 0 ? 0 : -1;
+        }
+        else if (!find_setting(item) || parse_value(item, eq + 1, &value, &use_default) < 0)
+            rc = -1;
+        else
+            request(item, value, use_default);
+    }
+
+    free(copy);
+    active = rc == 0;
+    return rc;
+}
+
+static int xioctl(int fd, unsigned long request, void *arg)
+{
+    int r;
+
+    do
+        r = ioctl(fd, request, arg);
+    while (r == -1 && errno == EINTR);
+    return r;
+}
+
+static void apply_setting(int fd, struct setting *s)
+{
+    struct v4l2_queryctrl query;
+    struct v4l2_control ctrl;
+    int value = s->value;
+
+    memset(&query, 0, sizeof(query));
+    query.id = s->id;
+    if (xioctl(fd, VIDIOC_QUERYCTRL, &query) < 0 || (query.flags & V4L2_CTRL_FLAG_DISABLED))
+    {
+        syslog(LOG_WARNING, "control %s not supported by the camera, left alone\n", s->key);
+        return;
+    }
+
+    if (s->use_default)
+        value = query.default_value;
+    if (query.type == V4L2_CTRL_TYPE_INTEGER)
+    {
+        if (value < query.minimum)
+            value = query.minimum;
+        if (value > query.maximum)
+            value = query.maximum;
+        if (query.step > 1)
+            value = query.minimum + (value - query.minimum) / query.step * query.step;
+    }
+
+    ctrl.id = s->id;
+    ctrl.value = value;
+    if (xioctl(fd, VIDIOC_S_CTRL, &ctrl) < 0)
+    {
+        syslog(LOG_WARNING, "control %s=%d rejected: %s\n", s->key, value, strerror(errno));
+        return;
+    }
+
+    // The driver may adjust what it was given, or ignore it in the current mode
+    ctrl.value = 0;
+    if (xioctl(fd, VIDIOC_G_CTRL, &ctrl) == 0)
+    {
+        if (ctrl.value != value)
+            syslog(LOG_WARNING, "control %s set to %d, camera reports %d\n", s->key, value, ctrl.value);
+        else
+            syslog(LOG_INFO, "control %s = %d\n", s->key, value);
+    }
+}
+
+/**
+ * @brief Applies the requested controls and frame interval, then reads back the interval in force.
+ *
+ * Must follow VIDIOC_S_FMT. Without a profile only the current interval is read.
+ *
+ * @param fd Open capture device.
+ */
+void control_apply(int fd)
+{
+    struct v4l2_streamparm parm;
+    unsigned int i;
+
+    if (active)
+        for (i = 0; i < N_SETTINGS; i++)
+            if (settings[i].requested)
+                apply_setting(fd, &settings[i]);
+
+    memset(&parm, 0, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (xioctl(fd, VIDIOC_G_PARM, &parm) < 0)
+    {
+        syslog(LOG_WARNING, "VIDIOC_G_PARM: %s, assuming %.0lf fps\n", strerror(errno), NOMINAL_FPS);
+        return;
+    }
+
+    if (active && requested_fps > 0)
+    {
+        if (!(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
+            syslog(LOG_WARNING, "camera does not accept a frame interval\n");
+        else
+        {
+            parm.parm.capture.timeperframe.numerator = 1000;
+            parm.parm.capture.timeperframe.denominator = (unsigned int)(requested_fps * 1000 + 0.5);
+            if (xioctl(fd, VIDIOC_S_PARM, &parm) < 0)
+                syslog(LOG_WARNING, "VIDIOC_S_PARM: %s\n", strerror(errno));
+
+            memset(&parm, 0, sizeof(parm));
+            parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            xioctl(fd, VIDIOC_G_PARM, &parm);
+        }
+    }
+
+    if (parm.parm.capture.timeperframe.numerator && parm.parm.capture.timeperframe.denominator)
+        granted_fps = (double)parm.parm.capture.timeperframe.denominator /
+                      parm.parm.capture.timeperframe.numerator;
+
+    if (active && requested_fps > 0 && granted_fps > 0 &&
+        (granted_fps < requested_fps * (1.0 - DRIFT_LIMIT) || granted_fps > requested_fps * (1.0 + DRIFT_LIMIT)))
+        syslog(LOG_WARNING, "asked for %.2lf fps, driver set %.2lf fps\n", requested_fps, granted_fps);
+    syslog(LOG_INFO, "Controls -- frame interval %u/%u s (%.2lf fps)\n",
+           parm.parm.capture.timeperframe.numerator, parm.parm.capture.timeperframe.denominator, granted_fps);
+}
+
+/**
+ * @brief Frame rate to plan with: what the driver confirmed, else the nominal rate.
+ */
+double control_frame_rate(void)
+{
+    return granted_fps > 0 ? granted_fps : NOMINAL_FPS;
+}
+
+/**
+ * @brief Accumulates the interval between consecutive buffer timestamps.
+ *
+ * Each window of DRIFT_WINDOW intervals is checked against the expected
+ * rate; a warning is logged when the delivered rate drifts off, and again
+ * when it comes back.
+ *
+ * @param timestamp Driver timestamp of the dequeued buffer.
+ */
+void control_observe(const struct timeval *timestamp)
+{
+    double interval, expected, delivered;
+
+    if (have_timestamp)
+    {
+        interval = (timestamp->tv_sec - last_timestamp.tv_sec) +
+                   (timestamp->tv_usec - last_timestamp.tv_usec) / 1e6;
+
+        if (!intervals || interval < interval_min)
+            interval_min = interval;
+        if (interval > interval_max)
+            interval_max = interval;
+        interval_total += interval;
+        intervals++;
+
+        window_total += interval;
+        if (++window_intervals == DRIFT_WINDOW)
+        {
+            expected = control_frame_rate();
+            delivered = window_total > 0 ? window_intervals / window_total : 0.0;
+            if (delivered < expected * (1.0 - DRIFT_LIMIT) || delivered > expected * (1.0 + DRIFT_LIMIT))
+            {
+                drift_windows++;
+                if (!drifting)
+                    syslog(LOG_WARNING, "camera delivering %.2lf fps, expected %.2lf fps\n", delivered, expected);
+                drifting = 1;
+            }
+            else if (drifting)
+            {
+                syslog(LOG_INFO, "camera back at %.2lf fps\n", delivered);
+                drifting = 0;
+            }
+            window_intervals = 0;
+            window_total = 0;
+        }
+    }
+
+    last_timestamp = *timestamp;
+    have_timestamp = 1;
+}
+
+void control_report(void)
+{
+    if (!intervals)
+        return;
+
+    syslog(LOG_INFO, "Controls -- expected %.2lf fps, delivered %.2lf fps, interval min %.3lf ms max %.3lf ms, "
+           "%lu of %lu windows off by more than %.0lf%%\n",
+           control_frame_rate(), interval_total > 0 ? intervals / interval_total : 0.0,
+           interval_min * 1000.0, interval_max * 1000.0, drift_windows, intervals / DRIFT_WINDOW,
+           DRIFT_LIMIT * 100.0);
+}
@@ -0,0 +1,43 @@
+/*
+ *  Camera control profiles for deterministic frame timing.
+ *
+ *  With auto exposure, UVC cameras such as the C270 stretch the exposure
+ *  in dim light and quietly lower the frame rate. A profile pins the
+ *  controls that decide frame timing. They are applied in init_device()
+ *  after the format is set, because a format change resets them:
+ *
+ *    fixed   manual exposure and gain, exposure may not lower the rate
+ *    steady  auto exposure, but still not allowed to lower the rate
+ *    auto    driver defaults, only the frame interval is requested
+ *
+ *  A spec is a comma separated list. Each item is a profile name or a
+ *  key=value override applied on top of it:
+ *
+ *    exposure=auto|manual|aperture   V4L2_CID_EXPOSURE_AUTO
+ *    exposure-abs=n                  V4L2_CID_EXPOSURE_ABSOLUTE, 100 us units
+ *    gain=n                          V4L2_CID_GAIN
+ *    powerline=off|50|60             V4L2_CID_POWER_LINE_FREQUENCY
+ *    priority=0|1                    V4L2_CID_EXPOSURE_AUTO_PRIORITY
+ *    fps=n                           frame interval via VIDIOC_S_PARM
+ *
+ *  e.g. --controls fixed,exposure-abs=200,powerline=50
+ *
+ *  Every control is read back after it is set. The driver's frame
+ *  interval is read back with VIDIOC_G_PARM. The interval actually
+ *  delivered is measured from buffer timestamps, and a warning is logged
+ *  if it drifts from the request.
+ */
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <sys/time.h>
+
+#define NOMINAL_FPS (30.0)
+
+int control_parse(const char *spec);
+void control_apply(int fd);
+double control_frame_rate(void);
+void control_observe(const struct timeval *timestamp);
+void control_report(void);
+
+#endif /* CONTROL_H */
@@ -0,0 +1,177 @@
+/*
+ *  YUYV to RGB, grey and planar conversion shared by capture and yuyv_convert.
+ */
+
+#include <string.h>
+
+#include "convert.h"
+
+#define SAT (255)
+
+
+// This is probably the most acceptable conversion from camera YUYV to RGB
+//
+// Wikipedia has a good discussion on the details of various conversions and cites good references:
+// http://en.wikipedia.org/wiki/YUV
+//
+// Also http://www.fourcc.org/yuv.php
+//
+// What's not clear without knowing more about the camera in question is how often U & V are sampled compared
+// to Y.
+//
+// E.g. YUV444, which is equivalent to RGB, where both require 3 bytes for each pixel
+//      YUV422, which we assume here, where there are 2 bytes for each pixel, with two Y samples for one U & V,
+//              or as the name implies, 4Y and 2 UV pairs
+//      YUV420, where for every 4 Ys, there is a single UV pair, 1.5 bytes for each pixel or 36 bytes for 24 pixels
+
+// Coefficient in 8.8 fixed point, folded to a constant at compile time
+#define FIX(x)  ((int)((x) * 256.0 + 0.5))
+
+#define MATRIX      bt601_limited
+#define KR          (0.299)
+#define KB          (0.114)
+#define FULL_RANGE  (0)
+#include "convert_kernel.h"
+
+#define MATRIX      bt601_full
+#define KR          (0.299)
+#define KB          (0.114)
+#define FULL_RANGE  (1)
+#include "convert_kernel.h"
+
+#define MATRIX      bt709_limited
+#define KR          (0.2126)
+#define KB          (0.0722)
+#define FULL_RANGE  (0)
+#include "convert_kernel.h"
+
+#define MATRIX      bt709_full
+#define KR          (0.2126)
+#define KB          (0.0722)
+#define FULL_RANGE  (1)
+#include "convert_kernel.h"
+
+struct matrix_kernels
+{
+    const char *name;
+    void (*pixel)(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned char *b);
+    void (*frame)(const unsigned char *yuyv, int size, unsigned char *rgb);
+    void (*frame_plain)(const unsigned char *yuyv, int size, unsigned char *rgb);
+    void (*half)(const unsigned char *yuyv, int size, unsigned char *rgb, const unsigned char *lut);
+    void (*frame_lut)(const unsigned char *yuyv, int size, unsigned char *rgb,
+                      const unsigned char *lut, unsigned int *hist);
+};
+
+#define KERNELS(name, m)    { name, yuv2rgb_pixel_##m, yuyv_to_rgb_##m, yuyv_to_rgb_plain_##m, \
+                              yuyv_to_rgb_half_##m, yuyv_to_rgb_lut_##m }
+
+static const struct matrix_kernels matrices[] =
+{
+    KERNELS("bt601", bt601_limited),
+    KERNELS("bt601-full", bt601_full),
+    KERNELS("bt709", bt709_limited),
+    KERNELS("bt709-full", bt709_full),
+};
+#define N_MATRICES  (sizeof(matrices) / sizeof(matrices[0]))
+
+static const struct matrix_kernels *selected = &matrices[0];
+
+// Start out as limited range BT.601, what the camera code always assumed
+void (*yuv2rgb)(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned char *b) =
+    yuv2rgb_pixel_bt601_limited;
+void (*yuyv_to_rgb)(const unsigned char *yuyv, int size, unsigned char *rgb) = yuyv_to_rgb_bt601_limited;
+void (*yuyv_to_rgb_plain)(const unsigned char *yuyv, int size, unsigned char *rgb) = yuyv_to_rgb_plain_bt601_limited;
+void (*yuyv_to_rgb_half)(const unsigned char *yuyv, int size, unsigned char *rgb,
+                         const unsigned char *lut) = yuyv_to_rgb_half_bt601_limited;
+void (*yuyv_to_rgb_lut)(const unsigned char *yuyv, int size, unsigned char *rgb,
+                        const unsigned char *lut, unsigned int *hist) = yuyv_to_rgb_lut_bt601_limited;
+
+/**
+ * @brief Selects the colour matrix every conversion uses from now on.
+ *
+ * Call once at startup, before any frame is converted.
+ *
+ * @param name bt601, bt601-full, bt709 or bt709-full.
+ * @return 0 on success, -1 for an unknown name.
+ */
+int convert_set_matrix(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < N_MATRICES; i++)
+        if (strcmp(matrices[i].name, name) == 0)
+        {
+            selected = &matrices[i];
+            yuv2rgb = selected->pixel;
+            yuyv_to_rgb = selected->frame;
+            yuyv_to_rgb_plain = selected->frame_plain;
+            yuyv_to_rgb_half = selected->half;
+            yuyv_to_rgb_lut = selected->frame_lut;
+            return 0;
+        }
+    return -1;
+}
+
+const char *convert_matrix_name(void)
+{
+    return selected->name;
+}
+
+/**
+ * @brief The fixed brightness transform as a LUT, matching yuyv_to_rgb() exactly.
+ */
+const unsigned char *brighten_lut(void)
+{
+    static unsigned char lut[256];
+    static int ready;
+    int i;
+
+    if (!ready) {
+        for (i = 0; i < 256; i++)
+            lut[i] = (i * BRIGHTEN_ALPHA) + BRIGHTEN_BETA > SAT ? SAT : (i * BRIGHTEN_ALPHA) + BRIGHTEN_BETA;
+        ready = 1;
+    }
+    return lut;
+}
+
+/**
+ * @brief Copies the luma of a YUYV frame, one byte per pixel.
+ */
+void yuyv_to_grey(const unsigned char *yuyv, int size, unsigned char *grey)
+{
+    int i, newi;
+
+    for (i = 0, newi = 0; i < size; i = i + 2, newi++)
+        grey[newi] = yuyv[i];
+}
+
+/**
+ * @brief Splits a YUYV frame into Y, U and V planes (4:2:2, as Y4M C422 expects).
+ *
+ * @param yuyv Source frame.
+ * @param width Pixels per line, even.
+ * @param height Lines.
+ * @param stride Bytes per source line.
+ * @param y Destination luma plane, width x height.
+ * @param u Destination Cb plane, width / 2 x height.
+ * @param v Destination Cr plane, width / 2 x height.
+ */
+void yuyv_to_planar422(const unsigned char *yuyv, int width, int height, int stride,
+                       unsigned char *y, unsigned char *u, unsigned char *v)
+{
+    int row, i;
+
+    for (row = 0; row < height; row++) {
+        const unsigned char *line = yuyv + (long)row * stride;
+
+        for (i = 0; i < width / 2; i++) {
+            y[2 * i] = line[4 * i];
+            u[i] = line[4 * i + 1];
+            y[2 * i + 1] = line[4 * i + 2];
+            v[i] = line[4 * i + 3];
+        }
+        y += width;
+        u += width / 2;
+        v += width / 2;
+    }
+}
@@ -0,0 +1,36 @@
+/*
+ *  YUYV to RGB, grey and planar conversion shared by capture and yuyv_convert.
+ *
+ *  The RGB conversions come in one variant per colour matrix: BT.601 or
+ *  BT.709, limited or full range. Each variant is generated from
+ *  convert_kernel.h with its coefficients as compile-time constants.
+ *  convert_set_matrix() points yuv2rgb and the yuyv_to_rgb kernels at
+ *  one set once at startup, so no per-pixel choice is made. The frame
+ *  and line kernels inline their matrix; yuv2rgb is for single values
+ *  only. The default is limited range BT.601.
+ */
+#ifndef CONVERT_H
+#define CONVERT_H
+
+// Brightness transform applied on top of the RGB conversion
+#define BRIGHTEN_ALPHA  (1.25)
+#define BRIGHTEN_BETA   (25)
+
+int convert_set_matrix(const char *name);
+const char *convert_matrix_name(void);
+
+// The selected matrix: a pixel, a frame with the brightness transform or without it,
+// a line at half width and a frame through a level LUT
+extern void (*yuv2rgb)(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned char *b);
+extern void (*yuyv_to_rgb)(const unsigned char *yuyv, int size, unsigned char *rgb);
+extern void (*yuyv_to_rgb_plain)(const unsigned char *yuyv, int size, unsigned char *rgb);
+extern void (*yuyv_to_rgb_half)(const unsigned char *yuyv, int size, unsigned char *rgb,
+                                const unsigned char *lut);
+extern void (*yuyv_to_rgb_lut)(const unsigned char *yuyv, int size, unsigned char *rgb,
+                               const unsigned char *lut, unsigned int *hist);
+const unsigned char *brighten_lut(void);
+void yuyv_to_grey(const unsigned char *yuyv, int size, unsigned char *grey);
+void yuyv_to_planar422(const unsigned char *yuyv, int width, int height, int stride,
+                       unsigned char *y, unsigned char *u, unsigned char *v);
+
+#endif /* CONVERT_H */
@@ -0,0 +1,144 @@
+/*
+ *  Conversion kernels for one colour matrix. This file is a template:
+ *  convert.c includes it once per matrix, after defining
+ *
+ *    MATRIX        suffix of the generated names, e.g. bt709_full
+ *    KR, KB        luma weights of red and blue
+ *    FULL_RANGE    1 for 0..255 luma and chroma, 0 for 16..235 / 16..240
+ *
+ *  Every coefficient is a constant expression over these, so each
+ *  instance compiles to fixed 8.8 multipliers. The same arithmetic as
+ *  the original BT.601 yuv2rgb() is used, and the choice of matrix costs
+ *  nothing per pixel. The BT.601 limited instance reproduces that
+ *  function bit for bit.
+ */
+
+#define PASTE2(a, b)    a##_##b
+#define PASTE(a, b)     PASTE2(a, b)
+#define KERNEL(fn)      PASTE(fn, MATRIX)
+
+#define KG              (1.0 - (KR) - (KB))
+#define Y_OFFSET        (FULL_RANGE ? 0 : 16)
+#define Y_GAIN          (FULL_RANGE ? 1.0 : 255.0 / 219.0)
+#define C_GAIN          (FULL_RANGE ? 1.0 : 255.0 / 224.0)
+
+#define Y_MUL           FIX(Y_GAIN)
+#define R_V             FIX(2.0 * (1.0 - (KR)) * C_GAIN)
+#define G_U             FIX(2.0 * (KB) * (1.0 - (KB)) / KG * C_GAIN)
+#define G_V             FIX(2.0 * (KR) * (1.0 - (KR)) / KG * C_GAIN)
+#define B_U             FIX(2.0 * (1.0 - (KB)) * C_GAIN)
+
+static inline void KERNEL(yuv2rgb)(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned char *b)
+{
+    int c = Y_MUL * (y - Y_OFFSET), d = u - 128, e = v - 128;
+    int r1 = (c + R_V * e + 128) >> 8;
+    int g1 = (c - G_U * d - G_V * e + 128) >> 8;
+    int b1 = (c + B_U * d + 128) >> 8;
+
+    *r = r1 > 255 ? 255 : r1 < 0 ? 0 : r1;
+    *g = g1 > 255 ? 255 : g1 < 0 ? 0 : g1;
+    *b = b1 > 255 ? 255 : b1 < 0 ? 0 : b1;
+}
+
+// Out of line copy for the function pointer
+static void KERNEL(yuv2rgb_pixel)(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned char *b)
+{
+    KERNEL(yuv2rgb)(y, u, v, r, g, b);
+}
+
+// A YUYV frame to RGB with the capture brightness transform
+static void KERNEL(yuyv_to_rgb)(const unsigned char *yuyv, int size, unsigned char *rgb)
+{
+    int i, newi;
+    double alpha = BRIGHTEN_ALPHA;
+    unsigned char beta = BRIGHTEN_BETA;
+    unsigned char r, g, b;
+
+    for (i = 0, newi = 0; i < size; i = i + 4, newi = newi + 6) {
+        KERNEL(yuv2rgb)(yuyv[i], yuyv[i + 1], yuyv[i + 3], &r, &g, &b);
+        rgb[newi] = (r * alpha) + beta > SAT ? SAT : (r * alpha) + beta;
+        rgb[newi + 1] = (g * alpha) + beta > SAT ? SAT : (g * alpha) + beta;
+        rgb[newi + 2] = (b * alpha) + beta > SAT ? SAT : (b * alpha) + beta;
+
+        KERNEL(yuv2rgb)(yuyv[i + 2], yuyv[i + 1], yuyv[i + 3], &r, &g, &b);
+        rgb[newi + 3] = (r * alpha) + beta > SAT ? SAT : (r * alpha) + beta;
+        rgb[newi + 4] = (g * alpha) + beta > SAT ? SAT : (g * alpha) + beta;
+        rgb[newi + 5] = (b * alpha) + beta > SAT ? SAT : (b * alpha) + beta;
+    }
+}
+
+// A YUYV frame to RGB as converted, no brightness transform
+static void KERNEL(yuyv_to_rgb_plain)(const unsigned char *yuyv, int size, unsigned char *rgb)
+{
+    int i, newi;
+
+    for (i = 0, newi = 0; i < size; i = i + 4, newi = newi + 6) {
+        KERNEL(yuv2rgb)(yuyv[i], yuyv[i + 1], yuyv[i + 3], &rgb[newi], &rgb[newi + 1], &rgb[newi + 2]);
+        KERNEL(yuv2rgb)(yuyv[i + 2], yuyv[i + 1], yuyv[i + 3], &rgb[newi + 3], &rgb[newi + 4], &rgb[newi + 5]);
+    }
+}
+
+// One RGB pixel per YUYV pair through a level LUT, from the average of the two lumas that share its chroma
+static void KERNEL(yuyv_to_rgb_half)(const unsigned char *yuyv, int size, unsigned char *rgb,
+                                     const unsigned char *lut)
+{
+    unsigned char r, g, b;
+    int i, newi;
+
+    for (i = 0, newi = 0; i + 4 <= size; i = i + 4, newi = newi + 3) {
+        KERNEL(yuv2rgb)((yuyv[i] + yuyv[i + 2] + 1) >> 1, yuyv[i + 1], yuyv[i + 3], &r, &g, &b);
+        rgb[newi] = lut[r];
+        rgb[newi + 1] = lut[g];
+        rgb[newi + 2] = lut[b];
+    }
+}
+
+/*
+ * A YUYV frame to RGB through a level LUT, with a luma histogram on the
+ * way, so adaptive levels do not read the frame twice. The two lumas of a
+ * pair count into separate tables, so back to back increments of the same
+ * bin do not wait on each other. hist is added to, so a frame can be
+ * converted in strips.
+ */
+static void KERNEL(yuyv_to_rgb_lut)(const unsigned char *yuyv, int size, unsigned char *rgb,
+                                    const unsigned char *lut, unsigned int *hist)
+{
+    unsigned int even[256] = { 0 }, odd[256] = { 0 };
+    unsigned char r, g, b;
+    int i, newi;
+
+    for (i = 0, newi = 0; i < size; i = i + 4, newi = newi + 6) {
+        even[yuyv[i]]++;
+        odd[yuyv[i + 2]]++;
+
+        KERNEL(yuv2rgb)(yuyv[i], yuyv[i + 1], yuyv[i + 3], &r, &g, &b);
+        rgb[newi] = lut[r];
+        rgb[newi + 1] = lut[g];
+        rgb[newi + 2] = lut[b];
+
+        KERNEL(yuv2rgb)(yuyv[i + 2], yuyv[i + 1], yuyv[i + 3], &r, &g, &b);
+        rgb[newi + 3] = lut[r];
+        rgb[newi + 4] = lut[g];
+        rgb[newi + 5] = lut[b];
+    }
+
+    for (i = 0; i < 256; i++)
+        hist[i] += even[i] + odd[i];
+}
+
+#undef PASTE2
+#undef PASTE
+#undef KERNEL
+#undef KG
+#undef Y_OFFSET
+#undef Y_GAIN
+#undef C_GAIN
+#undef Y_MUL
+#undef R_V
+#undef G_U
+#undef G_V
+#undef B_U
+#undef MATRIX
+#undef KR
+#undef KB
+#undef FULL_RANGE
@@ -0,0 +1,226 @@
+/*
+ *  Per-service deadline monitoring with overrun counters and a
+ *  degradation hook.
+ *
+ *  Deadlines are given in milliseconds per service, for example
+ *      --deadline acquisition=100,transform=30,writeback=15
+ *  A service with no deadline is still timed but never counts misses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "deadline.h"
+#include "metrics.h"
+#include "trace.h"
+
+struct service_deadline
+{
+    double deadline;                /* seconds, 0 when not monitored */
+    unsigned long checked;
+    unsigned long misses;
+    unsigned int consecutive;
+    unsigned int worst_consecutive;
+    double worst_overrun;
+};
+
+static struct service_deadline services[STAGE_COUNT];
+
+static enum degrade_mode degrade_target = DEGRADE_NONE;
+static enum degrade_mode current_mode = DEGRADE_NONE;
+static unsigned int miss_limit = 3;
+static unsigned int recover_after = 30;
+static unsigned int met_in_a_row;
+static unsigned long degrade_switches;
+static degrade_hook hook;
+
+static const char *mode_names[DEGRADE_MODE_COUNT] =
+{
+    "none", "skip-brightness", "half-res", "grey"
+};
+
+static const enum metric_counter miss_counter[STAGE_COUNT] =
+{
+    METRIC_DEADLINE_MISSES_ACQUISITION,
+    METRIC_DEADLINE_MISSES_TRANSFORM,
+    METRIC_DEADLINE_MISSES_WRITEBACK,
+};
+
+/**
+ * @brief Parses a comma separated list of service=milliseconds deadlines.
+ *
+ * @param spec e.g. "transform=30,writeback=15"
+ * @return 0 on success, -1 on an unknown service or bad number.
+ */
+int deadline_parse(const char *spec)
+{
+    char copy[256], *item, *save, *eq, *end;
+    double ms;
+    int s;
+
+    if (strlen(spec) >= sizeof(copy))
+        return -1;
+    strcpy(copy, spec);
+
+    for (item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save))
+    {
+        eq = strchr(item, '=');
+        if (!eq)
+            return -1;
+        *eq = '\0';
+
+        ms = strtod(eq + 1, &end);
+        if (end == eq + 1 || *end != '\0' || ms < 0)
+            return -1;
+
+        for (s = 0; s < STAGE_COUNT; s++)
+            if (strcmp(item, metrics_stage_name(s)) == 0)
+                break;
+        if (s == STAGE_COUNT)
+            return -1;
+
+        services[s].deadline = ms / 1000.0;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Maps a degradation mode name to its value.
+ *
+ * @return The mode, or -1 if the name is unknown.
+ */
+int deadline_parse_mode(const char *name)
+{
+    int m;
+
+    for (m = 0; m < DEGRADE_MODE_COUNT; m++)
+        if (strcmp(name, mode_names[m]) == 0)
+            return m;
+    return -1;
+}
+
+/**
+ * @brief Configures when the pipeline degrades and recovers.
+ *
+ * @param mode Mode to switch to when misses persist, DEGRADE_NONE to only monitor.
+ * @param limit Consecutive misses of any one service that trigger degradation.
+ * @param recover Consecutive met deadlines, over all services, before returning to normal.
+ */
+void deadline_set_policy(enum degrade_mode mode, unsigned int limit, unsigned int recover)
+{
+    degrade_target = mode;
+    miss_limit = limit ? limit : 1;
+    recover_after = recover ? recover : 1;
+}
+
+void deadline_set_hook(degrade_hook h)
+{
+    hook = h;
+}
+
+enum degrade_mode deadline_mode(void)
+{
+    return current_mode;
+}
+
+const char *deadline_mode_name(enum degrade_mode mode)
+{
+    return mode_names[mode];
+}
+
+static void switch_mode(enum degrade_mode mode, enum metric_stage cause, int frame)
+{
+    struct timespec now;
+
+    if (mode == current_mode)
+        return;
+
+    syslog(LOG_WARNING, "deadline: switching from %s to %s at frame %d (%s)\n",
+           mode_names[current_mode], mode_names[mode], frame, metrics_stage_name(cause));
+
+    current_mode = mode;
+    degrade_switches++;
+    metrics_gauge_set(METRIC_DEGRADE_MODE, mode);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    trace_instant("degrade", &now, frame, mode);
+
+    if (hook)
+        hook(mode, cause);
+}
+
+/**
+ * @brief Checks one measured stage duration against its deadline.
+ *
+ * Called on the capture thread right after the duration is computed, so a
+ * mode switch takes effect from the next frame on.
+ *
+ * @param stage Service that just completed.
+ * @param seconds Its measured duration.
+ * @param frame Frame number, for logging.
+ * @return 1 if the deadline was missed, 0 otherwise.
+ */
+int deadline_check(enum metric_stage stage, double seconds, int frame)
+{
+    struct service_deadline *svc = &services[stage];
+
+    if (svc->deadline <= 0)
+        return 0;
+
+    svc->checked++;
+
+    if (seconds <= svc->deadline)
+    {
+        svc->consecutive = 0;
+        met_in_a_row++;
+        if (current_mode != DEGRADE_NONE && met_in_a_row >= recover_after)
+            switch_mode(DEGRADE_NONE, stage, frame);
+        return 0;
+    }
+
+    svc->misses++;
+    svc->consecutive++;
+    met_in_a_row = 0;
+    if (svc->consecutive > svc->worst_consecutive)
+        svc->worst_consecutive = svc->consecutive;
+    if (seconds - svc->deadline > svc->worst_overrun)
+        svc->worst_overrun = seconds - svc->deadline;
+
+    metrics_count(miss_counter[stage], 1);
+
+    // Only the start of a streak is logged so overload is not made worse by syslog
+    if (svc->consecutive == 1)
+        syslog(LOG_WARNING, "deadline: %s missed by %lf s for frame %d\n",
+               metrics_stage_name(stage), seconds - svc->deadline, frame);
+
+    if (svc->consecutive >= miss_limit && degrade_target != DEGRADE_NONE)
+        switch_mode(degrade_target, stage, frame);
+
+    return 1;
+}
+
+void deadline_report(void)
+{
+    int s;
+
+    for (s = 0; s < STAGE_COUNT; s++)
+    {
+        struct service_deadline *svc = &services[s];
+
+        if (svc->deadline <= 0)
+            continue;
+
+        syslog(LOG_INFO, "Deadline %s -- D=%lf s, %lu of %lu missed (%.2lf%%), "
+               "longest miss streak %u, worst overrun %lf s\n",
+               metrics_stage_name(s), svc->deadline, svc->misses, svc->checked,
+               svc->checked ? 100.0 * svc->misses / svc->checked : 0.0,
+               svc->worst_consecutive, svc->worst_overrun);
+    }
+
+    if (degrade_target != DEGRADE_NONE)
+        syslog(LOG_INFO, "Deadline degradation -- mode %s, %lu switches, ended in %s\n",
+               mode_names[degrade_target], degrade_switches, mode_names[current_mode]);
+}
@@ -0,0 +1,35 @@
+/*
+ *  Online deadline monitoring for the capture services.
+ *
+ *  Every stage duration is compared against its configured deadline as
+ *  soon as it is measured. Persistent misses switch the pipeline into a
+ *  degraded mode through a hook, and a run of met deadlines switches it
+ *  back, so the acquisition rate is protected under overload.
+ */
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include "metrics.h"
+
+enum degrade_mode
+{
+    DEGRADE_NONE,
+    DEGRADE_SKIP_BRIGHTNESS,    /* colour convert only */
+    DEGRADE_HALF_RES,           /* convert and write every other pixel and line */
+    DEGRADE_GREY,               /* write the luma plane only, as PGM */
+    DEGRADE_MODE_COUNT
+};
+
+typedef void (*degrade_hook)(enum degrade_mode mode, enum metric_stage cause);
+
+int deadline_parse(const char *spec);
+int deadline_parse_mode(const char *name);
+void deadline_set_policy(enum degrade_mode mode, unsigned int miss_limit, unsigned int recover_after);
+void deadline_set_hook(degrade_hook hook);
+
+int deadline_check(enum metric_stage stage, double seconds, int frame);
+enum degrade_mode deadline_mode(void);
+const char *deadline_mode_name(enum degrade_mode mode);
+void deadline_report(void);
+
+#endif /* DEADLINE_H */
@@ -0,0 +1,124 @@
+/*
+ *  Block based duplicate frame detection against the last written frame.
+ *
+ *  Blocks are 16x16 pixels (16 luma columns by 4 sampled lines of every
+ *  4th line). Comparing against the last written frame rather than the
+ *  previous frame means slow drift still triggers a write once it adds
+ *  up, instead of being skipped forever one small step at a time.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "dedupe.h"
+#include "luma.h"
+#include "metrics.h"
+
+#define SAMPLE_ROW_STEP (4)
+#define BLOCK_ROWS      (4)
+
+static int enabled;
+static double block_threshold;
+static struct luma_sample samples[2];
+static int reference;           /* index into samples of the last written frame */
+static int have_reference;
+static int last_written_tag;
+static int reference_bytes;
+
+static unsigned long checked, skipped;
+static unsigned long long bytes_saved;
+static double detect_time, detect_time_max;
+
+
+/**
+ * @brief Enables change gating.
+ *
+ * @param threshold Mean absolute luma difference of a 16x16 block that counts as a change.
+ * @return 0 on success, -1 if the samples could not be allocated.
+ */
+int dedupe_init(int width, int height, double threshold)
+{
+    if (luma_sample_init(&samples[0], width, height, SAMPLE_ROW_STEP) < 0 ||
+        luma_sample_init(&samples[1], width, height, SAMPLE_ROW_STEP) < 0)
+        return -1;
+
+    block_threshold = threshold;
+    enabled = 1;
+    return 0;
+}
+
+int dedupe_enabled(void)
+{
+    return enabled;
+}
+
+/**
+ * @brief Decides whether a frame differs enough from the last written one.
+ *
+ * @param yuyv Frame data.
+ * @param stride Bytes per line.
+ * @param reference_tag Set to the frame number this one duplicates when 0 is returned.
+ * @return 1 if the frame should be written, 0 if it is a duplicate.
+ */
+int dedupe_check(const void *yuyv, int stride, int *reference_tag)
+{
+    struct luma_sample *cur = &samples[reference ^ 1];
+    struct timespec t0, t1;
+    double cost;
+    int changed = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    luma_sample_take(cur, yuyv, stride);
+    if (have_reference)
+        changed = luma_changed_blocks(cur, &samples[reference], BLOCK_ROWS, block_threshold) > 0;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    cost = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    detect_time += cost;
+    if (cost > detect_time_max)
+        detect_time_max = cost;
+    checked++;
+
+    *reference_tag = last_written_tag;
+    return changed;
+}
+
+/**
+ * @brief Makes the frame last passed to dedupe_check() the new reference.
+ *
+ * @param tag Its frame number.
+ * @param bytes_written Bytes it took on disk, the saving for each later duplicate.
+ */
+void dedupe_commit(int tag, int bytes_written)
+{
+    reference ^= 1;
+    have_reference = 1;
+    last_written_tag = tag;
+    reference_bytes = bytes_written;
+}
+
+// Accounts a skipped duplicate that was replaced by a reference record
+void dedupe_skipped(int record_bytes)
+{
+    int saved = reference_bytes - (record_bytes > 0 ? record_bytes : 0);
+
+    skipped++;
+    if (saved > 0)
+    {
+        bytes_saved += saved;
+        metrics_count(METRIC_BYTES_SAVED, saved);
+    }
+    metrics_count(METRIC_FRAMES_SKIPPED_UNCHANGED, 1);
+}
+
+void dedupe_report(void)
+{
+    if (!enabled)
+        return;
+
+    syslog(LOG_INFO, "Dedupe -- %lu of %lu frames unchanged, %llu bytes saved, "
+           "detector mean %lf s, worst %lf s\n",
+           skipped, checked, bytes_saved,
+           checked ? detect_time / checked : 0.0, detect_time_max);
+}
@@ -0,0 +1,19 @@
+/*
+ *  Change-gated writeback.
+ *
+ *  Each frame's sampled luma is compared block by block with the last
+ *  frame that was actually written. When no block changed by more than
+ *  the threshold the frame is not transformed or written; a one line
+ *  reference record names the frame it duplicates instead.
+ */
+#ifndef DEDUPE_H
+#define DEDUPE_H
+
+int dedupe_init(int width, int height, double threshold);
+int dedupe_enabled(void);
+int dedupe_check(const void *yuyv, int stride, int *reference_tag);
+void dedupe_commit(int tag, int bytes_written);
+void dedupe_skipped(int record_bytes);
+void dedupe_report(void);
+
+#endif /* DEDUPE_H */
@@ -0,0 +1,302 @@
+/*
+ *  Delta-encoded frame archive writer, see delta.h for the layout.
+ *
+ *  Blocks are compared against the reconstruction, the frame a decoder
+ *  holds after the previous record, not against the previous camera
+ *  frame. With a non-zero threshold that keeps small per-frame changes
+ *  from accumulating into drift: once a block has moved far enough from
+ *  what was stored, it is stored again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#include "delta.h"
+#include "segment.h"
+#include "durable.h"
+#include "simd.h"
+
+static int fd = -1;
+static int key_every;
+static double block_threshold;
+
+static struct frame_geometry current;
+static unsigned char *recon;        /* frame as the decoder will see it */
+static unsigned char *staging;      /* delta payload being built */
+static size_t recon_size, staging_size;
+static int since_key;
+static int ppm_header;              /* header bytes the same frame would have as a PPM */
+
+static unsigned long key_frames, delta_frames, blocks_stored;
+static unsigned long long archive_bytes, ppm_bytes;
+static double encode_time, encode_time_max;
+
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Creates the archive and writes its magic.
+ *
+ * @param path Archive file, truncated if it exists, or NULL to write into the segments set up by segment_init().
+ * @param key_interval Store a whole frame at least every key_interval frames.
+ * @param threshold Mean absolute difference per sample that marks a block changed, 0 stores every change.
+ * @return 0 on success, -1 on failure.
+ */
+int delta_open(const char *path, int key_interval, double threshold)
+{
+    key_every = key_interval > 0 ? key_interval : 1;
+    block_threshold = threshold;
+    if (!path)
+        return segment_enabled() ? 0 : -1;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "Failed to create %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (write(fd, DELTA_FILE_MAGIC, 8) != 8)
+    {
+        syslog(LOG_ERR, "Failed to write %s: %s", path, strerror(errno));
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+
+    archive_bytes = 8;
+    return 0;
+}
+
+// Buffers only grow, so after the first frame of each shape nothing is allocated
+static int reshape(const struct frame_geometry *geometry, int size)
+{
+    size_t blocks = (size_t)((geometry->width + DELTA_BLOCK - 1) / DELTA_BLOCK) *
+                    ((geometry->height + DELTA_BLOCK - 1) / DELTA_BLOCK);
+    size_t need = (size_t)size + blocks * sizeof(uint32_t);
+
+    if ((size_t)size > recon_size)
+    {
+        free(recon);
+        recon = malloc(size);
+        recon_size = recon ? size : 0;
+    }
+    if (need > staging_size)
+    {
+        free(staging);
+        staging = malloc(need);
+        staging_size = staging ? need : 0;
+    }
+    if (!recon || !staging)
+        return -1;
+
+    current = *geometry;
+    ppm_header = snprintf(NULL, 0, "P6\n# timestamp %010d.%09d\n%d %d\n255\n",
+                          0, 0, geometry->width, geometry->height);
+    return 0;
+}
+
+// Sum of absolute differences over one block, rows of `bytes` samples
+static unsigned long block_sad(const unsigned char *a, const unsigned char *b,
+                               int stride, int bytes, int rows)
+{
+    unsigned long total = 0;
+    int r, x;
+
+    for (r = 0; r < rows; r++, a += stride, b += stride)
+    {
+        v8u16 acc = { 0 };
+
+        for (x = 0; x + 16 <= bytes; x += 16)
+            acc = widen_add(acc, absdiff16(load16(a + x), load16(b + x)));
+        total += reduce16(acc);
+
+        for (; x < bytes; x++)
+            total += abs(a[x] - b[x]);
+    }
+
+    return total;
+}
+
+/**
+ * @brief Builds the delta payload in staging and updates the reconstruction.
+ *
+ * @return Payload bytes, or -1 when the delta would not be smaller than a key frame.
+ */
+static long encode_blocks(const unsigned char *data, int size, uint32_t *blocks)
+{
+    int stride = current.width * current.channels;
+    int bx, by, r;
+    unsigned char *out = staging;
+    uint32_t index = 0;
+
+    *blocks = 0;
+    for (by = 0; by < current.height; by += DELTA_BLOCK)
+    {
+        int rows = current.height - by < DELTA_BLOCK ? current.height - by : DELTA_BLOCK;
+
+        for (bx = 0; bx < current.width; bx += DELTA_BLOCK, index++)
+        {
+            int width = current.width - bx < DELTA_BLOCK ? current.width - bx : DELTA_BLOCK;
+            int bytes = width * current.channels;
+            size_t offset = (size_t)by * stride + (size_t)bx * current.channels;
+            unsigned long sad = block_sad(data + offset, recon + offset, stride, bytes, rows);
+
+            if (sad == 0 || sad <= block_threshold * bytes * rows)
+                continue;
+
+            if (out - staging + sizeof(index) + (size_t)bytes * rows >= (size_t)size)
+                return -1;
+
+            memcpy(out, &index, sizeof(index));
+            out += sizeof(index);
+            for (r = 0; r < rows; r++)
+            {
+                memcpy(out, data + offset + (size_t)r * stride, bytes);
+                memcpy(recon + offset + (size_t)r * stride, out, bytes);
+                out += bytes;
+            }
+            (*blocks)++;
+        }
+    }
+
+    return out - staging;
+}
+
+/**
+ * @brief Appends one frame to the archive as a key or delta record, with one writev().
+ *
+ * @param data Pixel data.
+ * @param size Bytes of pixel data.
+ * @param geometry Image shape; a change forces a key frame.
+ * @param tag Frame number.
+ * @param time Frame timestamp.
+ * @param syscalls Receives the number of syscalls this frame took.
+ * @return Bytes appended, or -1 on failure.
+ */
+int delta_write(const unsigned char *data, int size, const struct frame_geometry *geometry,
+                unsigned int tag, const struct timespec *time, int *syscalls)
+{
+    struct delta_record rec;
+    struct iovec iov[2];
+    double start = now_seconds(), elapsed;
+    long payload = -1;
+    int key, total, out, rotated = 0;
+    off_t offset;
+
+    *syscalls = 0;
+    // Every segment has to decode on its own, so a new one starts with a key frame
+    if (segment_enabled() && (rotated = segment_need(sizeof(rec) + size, syscalls)) < 0)
+        return -1;
+    out = segment_enabled() ? segment_fd() : fd;
+    offset = segment_enabled() ? segment_offset() : (off_t)archive_bytes;
+    if (out < 0)
+        return -1;
+
+    key = rotated || since_key >= key_every - 1 || geometry->width != current.width ||
+          geometry->height != current.height || geometry->channels != current.channels;
+    if (key && reshape(geometry, size) < 0)
+    {
+        syslog(LOG_ERR, "Delta store out of memory for %dx%dx%d", geometry->width,
+               geometry->height, geometry->channels);
+        return -1;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    if (!key)
+        payload = encode_blocks(data, size, &rec.blocks);
+
+    if (payload < 0)
+    {
+        // Either due, or so much changed that the whole frame is smaller.
+        // A failed delta may have patched part of recon, so refresh all of it.
+        memcpy(recon, data, size);
+        rec.type = DELTA_KEY;
+        rec.blocks = 0;
+        payload = size;
+        iov[1].iov_base = (void *)data;
+        since_key = 0;
+        key_frames++;
+    }
+    else
+    {
+        rec.type = DELTA_BLOCKS;
+        iov[1].iov_base = staging;
+        since_key++;
+        delta_frames++;
+        blocks_stored += rec.blocks;
+    }
+
+    rec.sec = time->tv_sec;
+    rec.nsec = time->tv_nsec;
+    rec.magic = DELTA_RECORD_MAGIC;
+    rec.tag = tag;
+    rec.payload = payload;
+    rec.width = geometry->width;
+    rec.height = geometry->height;
+    rec.channels = geometry->channels;
+    rec.block = DELTA_BLOCK;
+
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_len = payload;
+
+    total = writev_all(out, iov, payload ? 2 : 1, syscalls);
+
+    elapsed = now_seconds() - start;
+    encode_time += elapsed;
+    if (elapsed > encode_time_max)
+        encode_time_max = elapsed;
+
+    if (total < 0)
+    {
+        // The decoder's view is now unknown, start over from a key frame
+        since_key = key_every;
+        return -1;
+    }
+
+    durable_written(out, offset, total);
+    if (segment_enabled())
+        segment_wrote(total);
+    archive_bytes += total;
+    ppm_bytes += ppm_header + size;
+    return total;
+}
+
+void delta_close(void)
+{
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+    segment_close();
+    free(recon);
+    free(staging);
+    recon = staging = NULL;
+    recon_size = staging_size = 0;
+}
+
+void delta_report(void)
+{
+    unsigned long frames = key_frames + delta_frames;
+
+    if (!frames)
+        return;
+
+    syslog(LOG_INFO, "Delta store -- %lu frames (%lu key, %lu delta, %.1lf blocks/delta), "
+           "%llu bytes vs %llu as PPM (%.2lf%%), write mean %.3lf ms worst %.3lf ms\n",
+           frames, key_frames, delta_frames,
+           delta_frames ? (double)blocks_stored / delta_frames : 0.0,
+           archive_bytes, ppm_bytes, ppm_bytes ? 100.0 * archive_bytes / ppm_bytes : 0.0,
+           encode_time / frames * 1000.0, encode_time_max * 1000.0);
+}
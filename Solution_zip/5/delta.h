@@ -0,0 +1,59 @@
+/*
+ *  Delta-encoded frame archive.
+ *
+ *  Instead of one PPM per frame, frames are appended to a single archive
+ *  file. Every key_interval-th frame (and any frame whose shape changed)
+ *  is stored whole; the frames in between store only the 16x16 blocks
+ *  that differ from the previous frame as it will be decoded. A static
+ *  scene then costs a record header per frame instead of 900 KB.
+ *
+ *  Layout, host byte order:
+ *      "CAPDELT1"                         file magic
+ *      { struct delta_record, payload }   repeated
+ *  A key payload is the raw pixels. A delta payload is `blocks` entries
+ *  of a uint32_t block index (row-major over the block grid) followed by
+ *  the block's pixels row by row, clipped at the right and bottom edges.
+ *
+ *  delta_decode rebuilds any frame of an archive as a PPM/PGM.
+ */
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "writeback.h"
+
+#define DELTA_FILE_MAGIC    "CAPDELT1"
+#define DELTA_RECORD_MAGIC  (0x4d524644u)   /* "DFRM" */
+#define DELTA_BLOCK         (16)
+
+enum delta_type
+{
+    DELTA_KEY = 0,
+    DELTA_BLOCKS = 1,
+};
+
+struct delta_record
+{
+    int64_t sec;
+    int64_t nsec;
+    uint32_t magic;
+    uint32_t type;          /* enum delta_type */
+    uint32_t tag;           /* frame number, as in the PPM filenames */
+    uint32_t blocks;        /* changed blocks, delta records only */
+    uint32_t payload;       /* bytes following this header */
+    uint16_t width;
+    uint16_t height;
+    uint16_t channels;
+    uint16_t block;         /* block edge in pixels */
+    uint32_t reserved;
+};
+
+int delta_open(const char *path, int key_interval, double threshold);
+int delta_write(const unsigned char *data, int size, const struct frame_geometry *geometry,
+                unsigned int tag, const struct timespec *time, int *syscalls);
+void delta_close(void);
+void delta_report(void);
+
+#endif /* DELTA_H */
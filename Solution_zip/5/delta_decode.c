@@ -0,0 +1,290 @@
+/*
+ *  Rebuilds frames from a capture --store delta archive.
+ *
+ *  The archive is indexed first by skipping from record header to record
+ *  header, so extracting one frame only decodes from the key frame before
+ *  it, not from the start of the run.
+ *
+ *  Usage: delta_decode [-f tag | -a] [-o dir] [-s] frames.cdl
+ *      -f tag   write frame `tag` as test<tag>.ppm/pgm
+ *      -a       write every frame
+ *      -o dir   output directory [.]
+ *      -s       print record statistics only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+
+#include "delta.h"
+
+struct entry
+{
+    long offset;
+    struct delta_record rec;
+};
+
+static struct entry *entries;
+static size_t n_entries, capacity;
+static unsigned char *frame, *payload;
+static size_t frame_size, payload_size;
+
+
+static int build_index(FILE *fp)
+{
+    struct delta_record rec;
+    char magic[8];
+    long offset;
+
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, DELTA_FILE_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "not a delta archive\n");
+        return -1;
+    }
+
+    for (offset = 8; fread(&rec, sizeof(rec), 1, fp) == 1; offset += sizeof(rec) + rec.payload)
+    {
+        // Zeros end a preallocated segment; a step back in time is a previous cycle's leftovers
+        if (rec.magic == 0 || (n_entries && (rec.sec < entries[n_entries - 1].rec.sec ||
+            (rec.sec == entries[n_entries - 1].rec.sec && rec.nsec < entries[n_entries - 1].rec.nsec))))
+            break;
+        if (rec.magic != DELTA_RECORD_MAGIC || rec.block != DELTA_BLOCK)
+        {
+            fprintf(stderr, "bad record at offset %ld, stopping\n", offset);
+            break;
+        }
+        if (n_entries == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 4096;
+            entries = realloc(entries, capacity * sizeof(*entries));
+            if (!entries)
+            {
+                fprintf(stderr, "out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        entries[n_entries].offset = offset;
+        entries[n_entries].rec = rec;
+        n_entries++;
+
+        if (fseek(fp, rec.payload, SEEK_CUR) != 0)
+            break;
+    }
+
+    // A run cut short leaves a truncated last record behind
+    fseek(fp, 0, SEEK_END);
+    if (n_entries && entries[n_entries - 1].offset + sizeof(struct delta_record) +
+                     entries[n_entries - 1].rec.payload > (unsigned long)ftell(fp))
+        n_entries--;
+
+    return 0;
+}
+
+static int grow(unsigned char **buf, size_t *have, size_t need)
+{
+    if (need <= *have)
+        return 0;
+    free(*buf);
+    *buf = malloc(need);
+    *have = *buf ? need : 0;
+    return *buf ? 0 : -1;
+}
+
+// Applies record i on top of the frame buffer
+static int apply(FILE *fp, size_t i)
+{
+    const struct delta_record *rec = &entries[i].rec;
+    size_t size = (size_t)rec->width * rec->height * rec->channels;
+    int stride = rec->width * rec->channels;
+    int cols = (rec->width + DELTA_BLOCK - 1) / DELTA_BLOCK;
+    unsigned char *p, *end;
+    uint32_t b, index;
+
+    if (grow(&frame, &frame_size, size) < 0 || grow(&payload, &payload_size, rec->payload) < 0)
+        return -1;
+
+    fseek(fp, entries[i].offset + sizeof(*rec), SEEK_SET);
+    if (fread(payload, 1, rec->payload, fp) != rec->payload)
+        return -1;
+
+    if (rec->type == DELTA_KEY)
+    {
+        memcpy(frame, payload, size);
+        return 0;
+    }
+
+    p = payload;
+    end = payload + rec->payload;
+    for (b = 0; b < rec->blocks; b++)
+    {
+        int bx, by, width, rows, r;
+
+        if (p + sizeof(index) > end)
+            return -1;
+        memcpy(&index, p, sizeof(index));
+        p += sizeof(index);
+
+        bx = (index % cols) * DELTA_BLOCK;
+        by = (index / cols) * DELTA_BLOCK;
+        width = rec->width - bx < DELTA_BLOCK ? rec->width - bx : DELTA_BLOCK;
+        rows = rec->height - by < DELTA_BLOCK ? rec->height - by : DELTA_BLOCK;
+        if (by >= rec->height || p + (size_t)width * rec->channels * rows > end)
+            return -1;
+
+        for (r = 0; r < rows; r++)
+        {
+            memcpy(frame + (size_t)(by + r) * stride + (size_t)bx * rec->channels, p,
+                   (size_t)width * rec->channels);
+            p += (size_t)width * rec->channels;
+        }
+    }
+    return 0;
+}
+
+static int write_frame(const char *dir, size_t i)
+{
+    const struct delta_record *rec = &entries[i].rec;
+    char path[4096];
+    FILE *out;
+    int ok;
+
+    snprintf(path, sizeof(path), "%s/test%04u.%s", dir, rec->tag, rec->channels == 1 ? "pgm" : "ppm");
+    out = fopen(path, "wb");
+    if (!out)
+    {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(out, "P%c\n# timestamp %010lld.%09lld\n%d %d\n255\n", rec->channels == 1 ? '5' : '6',
+            (long long)rec->sec, (long long)rec->nsec, rec->width, rec->height);
+    ok = fwrite(frame, (size_t)rec->width * rec->height * rec->channels, 1, out) == 1;
+    return fclose(out) == 0 && ok ? 0 : -1;
+}
+
+// Decodes records first..last inclusive, writing the ones selected
+static int decode_range(FILE *fp, const char *dir, size_t first, size_t last, int write_all)
+{
+    size_t i;
+
+    for (i = first; i <= last; i++)
+    {
+        if (apply(fp, i) < 0)
+        {
+            fprintf(stderr, "corrupt record %zu (frame %u)\n", i, entries[i].rec.tag);
+            return -1;
+        }
+        if ((write_all || i == last) && write_frame(dir, i) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void print_stats(void)
+{
+    unsigned long long bytes = 8, ppm = 0, blocks = 0;
+    size_t i, keys = 0;
+
+    for (i = 0; i < n_entries; i++)
+    {
+        const struct delta_record *rec = &entries[i].rec;
+
+        bytes += sizeof(*rec) + rec->payload;
+        ppm += (size_t)rec->width * rec->height * rec->channels + 50;
+        blocks += rec->blocks;
+        if (rec->type == DELTA_KEY)
+            keys++;
+    }
+
+    printf("%zu frames, %zu key, %zu delta, %.1f blocks per delta\n", n_entries, keys,
+           n_entries - keys, n_entries > keys ? (double)blocks / (n_entries - keys) : 0.0);
+    printf("archive %llu bytes, as PPM about %llu bytes, %.2f%%\n", bytes, ppm,
+           ppm ? 100.0 * bytes / ppm : 0.0);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-f tag | -a] [-o dir] [-s] frames.cdl\n"
+                    "-f   write frame tag\n"
+                    "-a   write every frame\n"
+                    "-o   output directory [.]\n"
+                    "-s   print record statistics\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = ".";
+    long tag = -1;
+    int c, all = 0, stats = 0, rc = EXIT_SUCCESS;
+    size_t i, key;
+    FILE *fp;
+
+    while ((c = getopt(argc, argv, "f:ao:sh")) != -1)
+    {
+        switch (c)
+        {
+            case 'f':
+                tag = atol(optarg);
+                break;
+            case 'a':
+                all = 1;
+                break;
+            case 'o':
+                dir = optarg;
+                break;
+            case 's':
+                stats = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1 || (!stats && !all && tag < 0))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    fp = fopen(argv[optind], "rb");
+    if (!fp)
+    {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (build_index(fp) < 0)
+    {
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+
+    if (stats)
+        print_stats();
+
+    if (all && n_entries && decode_range(fp, dir, 0, n_entries - 1, 1) < 0)
+        rc = EXIT_FAILURE;
+
+    if (tag >= 0)
+    {
+        for (i = 0; i < n_entries && entries[i].rec.tag != (uint32_t)tag; i++)
+            ;
+        if (i == n_entries)
+        {
+            fprintf(stderr, "frame %ld not in archive\n", tag);
+            rc = EXIT_FAILURE;
+        }
+        else
+        {
+            for (key = i; entries[key].rec.type != DELTA_KEY && key > 0; key--)
+                ;
+            if (entries[key].rec.type != DELTA_KEY || decode_range(fp, dir, key, i, 0) < 0)
+                rc = EXIT_FAILURE;
+        }
+    }
+
+    fclose(fp);
+    return rc;
+}
@@ -0,0 +1,153 @@
+/*
+ *  Temporal denoise fused into the YUYV to RGB conversion, see denoise.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "denoise.h"
+#include "convert.h"
+#include "simd.h"
+
+#define MOTION_SHIFT    (2)     /* weight climbs one sixteenth per 4 levels of difference */
+#define FLUSH_EVERY     (1024)  /* vectors between motion counter reductions, keeps 16 bit lanes from wrapping */
+
+static int enabled, priming;
+static unsigned char *frame_history;
+static int history_size;
+
+static unsigned long frames;
+static unsigned long long bytes_filtered, bytes_moving;
+
+
+// Weighted blend of the new bytes into the history; moving lanes come back all ones
+static inline v16u8 blend16(v16u8 cur, v16u8 prev, v16u8 *moving)
+{
+    v16u8 w = (absdiff16(cur, prev) >> MOTION_SHIFT) + DENOISE_STILL_WEIGHT;
+    v16u8 full = (v16u8)(w >= 16);
+    v8u16 wl, wh, lo, hi;
+
+    w = (w & ~full) | (full & 16);
+    *moving = full;
+
+    // Even and odd bytes in 16 bit lanes, 255 * 16 cannot overflow them
+    wl = (v8u16)w & 0x00ff;
+    wh = (v8u16)w >> 8;
+    lo = (((v8u16)cur & 0x00ff) * wl + ((v8u16)prev & 0x00ff) * (16 - wl) + 8) >> 4;
+    hi = (((v8u16)cur >> 8) * wh + ((v8u16)prev >> 8) * (16 - wh) + 8) >> 4;
+    return (v16u8)(lo | (hi << 8));
+}
+
+static inline unsigned char blend1(unsigned char cur, unsigned char prev)
+{
+    int d = cur > prev ? cur - prev : prev - cur;
+    int w = (d >> MOTION_SHIFT) + DENOISE_STILL_WEIGHT;
+
+    if (w >= 16)
+    {
+        bytes_moving++;
+        w = 16;
+    }
+    return (cur * w + prev * (16 - w) + 8) >> 4;
+}
+
+/**
+ * @brief Allocates the history frame; the first converted frame fills it.
+ *
+ * @param size Bytes in a YUYV frame.
+ * @return 0 on success, -1 if the history could not be allocated.
+ */
+int denoise_init(int size)
+{
+    frame_history = malloc(size);
+    if (!frame_history)
+        return -1;
+
+    // Touched now so the first filtered frame does not take the page faults
+    memset(frame_history, 0, size);
+    history_size = size;
+    enabled = 1;
+    return 0;
+}
+
+int denoise_enabled(void)
+{
+    return enabled;
+}
+
+/**
+ * @brief Filters YUYV against the history and converts it to RGB in the same pass.
+ *
+ * @param yuyv Source, 4 bytes per pixel pair.
+ * @param offset Where yuyv starts in the frame, in bytes, so a frame can be done in strips.
+ * @param size Bytes of source.
+ * @param rgb Destination, 3 bytes per pixel.
+ * @param lut 256 entry level mapping applied to each RGB channel.
+ * @param hist 256 luma bins of the filtered frame, added to.
+ */
+void denoise_convert(const unsigned char *yuyv, int offset, int size, unsigned char *rgb,
+                     const unsigned char *lut, unsigned int *hist)
+{
+    v16u8 out, moving, one = (v16u8){ 0 } + 1;
+    v8u16 motion = { 0 };
+    unsigned char *history = frame_history + offset;
+    int i, block, vectors = 0;
+
+    if (offset + size > history_size)
+        size = history_size - offset;
+    // Frames are whole pixel pairs, a stray byte is neither filtered nor converted
+    size -= size % 4;
+
+    // The first frame has nothing to average with, it only fills the history
+    if (offset == 0)
+        priming = frames++ == 0;
+    if (priming)
+        memcpy(history, yuyv, size);
+
+    for (block = 0; block < size; block += DENOISE_BLOCK)
+    {
+        int end = size - block < DENOISE_BLOCK ? size : block + DENOISE_BLOCK;
+
+        for (i = block; i + 16 <= end; i += 16)
+        {
+            out = blend16(load16(yuyv + i), load16(history + i), &moving);
+            memcpy(history + i, &out, sizeof(out));
+
+            motion = widen_add(motion, moving & one);
+            if (++vectors == FLUSH_EVERY)
+            {
+                bytes_moving += reduce16(motion);
+                motion = (v8u16){ 0 };
+                vectors = 0;
+            }
+        }
+
+        // Blocks are whole vectors, the end of the frame not always
+        for (; i < end; i++)
+            history[i] = blend1(yuyv[i], history[i]);
+
+        // Converted by the selected matrix's kernel while the filtered block is still in cache
+        yuyv_to_rgb_lut(history + block, end - block, rgb + block / 2 * 3, lut, hist);
+    }
+    bytes_moving += reduce16(motion);
+
+    bytes_filtered += size;
+}
+
+/**
+ * @brief The filtered frame, as of the last denoise_convert().
+ */
+const unsigned char *denoise_filtered(void)
+{
+    return frame_history;
+}
+
+void denoise_report(void)
+{
+    if (!frames)
+        return;
+
+    syslog(LOG_INFO, "Denoise -- %lu frames, %.1lf%% of samples taken as motion\n",
+           frames, bytes_filtered ? 100.0 * bytes_moving / bytes_filtered : 0.0);
+}
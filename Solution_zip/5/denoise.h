@@ -0,0 +1,31 @@
+/*
+ *  Temporal denoise fused into the YUYV to RGB conversion.
+ *
+ *  Each YUYV byte is blended with the same byte of a single history
+ *  frame, an exponential moving average of past frames. The blend is
+ *  motion adaptive. Where the frame barely changed, the new frame only
+ *  gets DENOISE_STILL_WEIGHT sixteenths, which averages sensor noise
+ *  away. The weight rises with the difference and reaches the whole new
+ *  value once the difference is around 48 levels, so moving edges do
+ *  not smear. The filtered bytes become the new history.
+ *
+ *  The filter runs 16 bytes at a time (8 pixels) with the vector helpers
+ *  in simd.h, a DENOISE_BLOCK at a time. Each filtered block is converted
+ *  by the selected matrix's frame kernel while it is still in cache, so
+ *  the frame is read from memory once and no pixel goes through a
+ *  function pointer.
+ */
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#define DENOISE_STILL_WEIGHT    (4)     /* sixteenths of a new frame taken where nothing moved */
+#define DENOISE_BLOCK           (16384) /* bytes filtered before they are converted, a multiple of 16 */
+
+int denoise_init(int size);
+int denoise_enabled(void);
+void denoise_convert(const unsigned char *yuyv, int offset, int size, unsigned char *rgb,
+                     const unsigned char *lut, unsigned int *hist);
+const unsigned char *denoise_filtered(void);
+void denoise_report(void);
+
+#endif /* DENOISE_H */
@@ -0,0 +1,370 @@
+/*
+ *  Durability policy on a sync thread, see durable.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "durable.h"
+
+enum durability
+{
+    DURABLE_NONE,
+    DURABLE_EVERY,
+    DURABLE_INTERVAL,
+    DURABLE_WRITEBEHIND,
+};
+
+struct pending
+{
+    int fd;
+    off_t offset;
+    off_t length;               /* 0 means to the end of the file */
+    struct timespec queued;
+};
+
+static enum durability policy = DURABLE_NONE;
+static int every_frames;
+static long interval_ms;
+static int dir_fd = -1;
+
+static pthread_t syncer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;     /* sync thread has work */
+static pthread_cond_t space = PTHREAD_COND_INITIALIZER;    /* queue has room */
+static struct pending queue[DURABLE_QUEUE];
+static int queued, running, stopping;
+static int frames_queued;               /* since the last batch */
+
+// Capture side
+static unsigned long writes, capture_waits;
+static double wait_time, wait_max;
+// Sync thread side, read once it has stopped
+static unsigned long syncs, sync_errors, synced_writes;
+static double sync_time, sync_max, age_max;
+
+
+static double seconds_between(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+// interval_ms from now on the clock the condition variable waits on
+static void next_deadline(struct timespec *deadline)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_nsec += (interval_ms % 1000) * 1000000L;
+    deadline->tv_sec += interval_ms / 1000 + deadline->tv_nsec / 1000000000L;
+    deadline->tv_nsec %= 1000000000L;
+}
+
+/**
+ * @brief Parses none, every=N, interval=ms or writebehind.
+ *
+ * @return 0 on success, -1 on an unknown policy or a bad number.
+ */
+int durable_parse(const char *spec)
+{
+    if (strcmp(spec, "none") == 0)
+        policy = DURABLE_NONE;
+    else if (strcmp(spec, "writebehind") == 0)
+        policy = DURABLE_WRITEBEHIND;
+    else if (sscanf(spec, "every=%d", &every_frames) == 1 && every_frames > 0)
+        policy = DURABLE_EVERY;
+    else if (sscanf(spec, "interval=%ld", &interval_ms) == 1 && interval_ms > 0)
+        policy = DURABLE_INTERVAL;
+    else
+        return -1;
+    return 0;
+}
+
+int durable_enabled(void)
+{
+    return running;
+}
+
+// fdatasync each write of the batch, then the directory for the names of new files
+static int sync_batch(struct pending *batch, int n)
+{
+    struct stat st;
+    dev_t last_dev = 0;
+    ino_t last_ino = 0;
+    int i, rc = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        // Dups of one archive or store follow each other, one sync covers them all
+        if (fstat(batch[i].fd, &st) == 0)
+        {
+            if (i > 0 && st.st_dev == last_dev && st.st_ino == last_ino)
+                continue;
+            last_dev = st.st_dev;
+            last_ino = st.st_ino;
+        }
+        if (fdatasync(batch[i].fd) < 0)
+            rc = -1;
+    }
+    if (dir_fd >= 0 && fsync(dir_fd) < 0)
+        rc = -1;
+    return rc;
+}
+
+// Starts writeback of each write, then waits for the one before it to reach the disk
+static int write_behind(struct pending *batch, int n, struct pending *previous)
+{
+    int i, rc = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if (sync_file_range(batch[i].fd, batch[i].offset, batch[i].length, SYNC_FILE_RANGE_WRITE) < 0)
+            rc = -1;
+        if (previous->fd >= 0)
+        {
+            if (sync_file_range(previous->fd, previous->offset, previous->length,
+                                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+                rc = -1;
+            // Written out, so its pages need not stay cached
+            posix_fadvise(previous->fd, previous->offset, previous->length, POSIX_FADV_DONTNEED);
+            close(previous->fd);
+        }
+        *previous = batch[i];
+    }
+    return rc;
+}
+
+static void *sync_thread(void *arg)
+{
+    static struct pending batch[DURABLE_QUEUE];
+    struct pending previous = { -1, 0, 0, { 0, 0 } };
+    struct timespec deadline, start, end;
+    int n, i, due, timed_out = 0, rc;
+    double t;
+
+    (void)arg;
+    next_deadline(&deadline);
+    pthread_mutex_lock(&lock);
+    for (;;)
+    {
+        due = queued == DURABLE_QUEUE || (stopping && queued > 0);
+        if (policy == DURABLE_EVERY)
+            due |= frames_queued >= every_frames;
+        else if (policy == DURABLE_INTERVAL)
+            due |= timed_out && queued > 0;
+        else
+            due |= queued > 0;
+
+        if (!due)
+        {
+            if (stopping)
+                break;
+            if (policy == DURABLE_INTERVAL)
+            {
+                // Nothing was written in the last interval, start the next one
+                if (timed_out)
+                    next_deadline(&deadline);
+                timed_out = pthread_cond_timedwait(&wake, &lock, &deadline) == ETIMEDOUT;
+            }
+            else
+                pthread_cond_wait(&wake, &lock);
+            continue;
+        }
+
+        n = queued;
+        memcpy(batch, queue, n * sizeof(batch[0]));
+        queued = 0;
+        frames_queued = 0;
+        timed_out = 0;
+        if (policy == DURABLE_INTERVAL)
+            next_deadline(&deadline);
+        pthread_cond_broadcast(&space);
+        pthread_mutex_unlock(&lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (policy == DURABLE_WRITEBEHIND)
+            rc = write_behind(batch, n, &previous);
+        else
+            rc = sync_batch(batch, n);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        t = seconds_between(&start, &end);
+        syncs++;
+        synced_writes += n;
+        sync_time += t;
+        if (t > sync_max)
+            sync_max = t;
+        if (rc < 0)
+        {
+            sync_errors++;
+            syslog(LOG_ERR, "durability sync failed: %s", strerror(errno));
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (seconds_between(&batch[i].queued, &end) > age_max)
+                age_max = seconds_between(&batch[i].queued, &end);
+            if (policy != DURABLE_WRITEBEHIND)
+                close(batch[i].fd);
+        }
+
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    // The last write still has its writeback to wait for
+    if (previous.fd >= 0)
+    {
+        sync_file_range(previous.fd, previous.offset, previous.length,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        close(previous.fd);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts the sync thread for the chosen policy; does nothing for none.
+ *
+ * @param directory Frames directory, synced with the batch policies.
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+int durable_start(const char *directory)
+{
+    if (policy == DURABLE_NONE)
+        return 0;
+
+    if (policy != DURABLE_WRITEBEHIND)
+    {
+        dir_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd < 0)
+            syslog(LOG_WARNING, "cannot open %s to sync it: %s", directory, strerror(errno));
+    }
+
+    if (pthread_create(&syncer, NULL, sync_thread, NULL) != 0)
+        return -1;
+    running = 1;
+    return 0;
+}
+
+/**
+ * @brief Queues a write for syncing; the sync thread closes fd afterwards.
+ *
+ * Blocks only while DURABLE_QUEUE writes are already waiting.
+ *
+ * @param fd Descriptor now owned by the sync thread.
+ * @param offset Start of the written range.
+ * @param length Bytes written, 0 for the whole file.
+ */
+void durable_adopt(int fd, off_t offset, off_t length)
+{
+    struct timespec start, end;
+    double t;
+
+    if (!running)
+    {
+        close(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (queued == DURABLE_QUEUE)
+    {
+        capture_waits++;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (queued == DURABLE_QUEUE)
+            pthread_cond_wait(&space, &lock);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        t = seconds_between(&start, &end);
+        wait_time += t;
+        if (t > wait_max)
+            wait_max = t;
+    }
+
+    queue[queued].fd = fd;
+    queue[queued].offset = offset;
+    queue[queued].length = length;
+    clock_gettime(CLOCK_MONOTONIC, &queue[queued].queued);
+    queued++;
+    writes++;
+    // The batch policies are woken by their frame count or clock instead
+    if (policy == DURABLE_WRITEBEHIND || queued == DURABLE_QUEUE)
+        pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Queues a write to a descriptor the caller keeps, through a dup of it.
+ */
+void durable_written(int fd, off_t offset, off_t length)
+{
+    int copy;
+
+    if (!running)
+        return;
+
+    copy = dup(fd);
+    if (copy < 0)
+    {
+        syslog(LOG_ERR, "cannot dup for the sync thread: %s", strerror(errno));
+        return;
+    }
+    durable_adopt(copy, offset, length);
+}
+
+/**
+ * @brief Counts a finished frame towards every=N.
+ */
+void durable_frame(void)
+{
+    if (!running || policy != DURABLE_EVERY)
+        return;
+
+    pthread_mutex_lock(&lock);
+    if (++frames_queued >= every_frames)
+        pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Syncs whatever is still queued and stops the thread.
+ */
+void durable_stop(void)
+{
+    if (!running)
+        return;
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(syncer, NULL);
+    running = 0;
+
+    if (dir_fd >= 0)
+        close(dir_fd);
+    dir_fd = -1;
+}
+
+void durable_report(void)
+{
+    static const char *names[] = { "none", "every", "interval", "writebehind" };
+
+    if (policy == DURABLE_NONE)
+        return;
+
+    syslog(LOG_INFO, "Durability -- %s, %lu writes in %lu syncs, %lu failed, "
+           "sync mean %.3lf ms worst %.3lf ms, longest unsynced %.3lf ms\n",
+           names[policy], synced_writes, syncs, sync_errors,
+           syncs ? sync_time / syncs * 1000.0 : 0.0, sync_max * 1000.0, age_max * 1000.0);
+    syslog(LOG_INFO, "Durability -- capture waited on the sync thread %lu times in %lu writes, "
+           "%.3lf ms total %.3lf ms worst\n",
+           capture_waits, writes, wait_time * 1000.0, wait_max * 1000.0);
+}
@@ -0,0 +1,46 @@
+/*
+ *  Durability policy for written frames.
+ *
+ *  Without a policy nothing is ever synced. Frames sit in the page cache
+ *  until the kernel decides to write them, so a power cut loses an
+ *  unknown amount. When the kernel does flush, it throttles whichever
+ *  write happens to be running.
+ *
+ *  --durability takes one of:
+ *
+ *    none          the kernel flushes when it likes [default]
+ *    every=N       fdatasync everything written once N frames are queued
+ *    interval=ms   fdatasync everything written at least every ms
+ *    writebehind   sync_file_range each write as it arrives, and wait for
+ *                  the one before it. Dirty data stays bounded at about
+ *                  two writes, so the kernel never throttles. This limits
+ *                  how much is exposed, but file sizes and new names are
+ *                  not synced, so it does not make them durable.
+ *
+ *  The syncing happens on a thread of its own. Writers hand over the file
+ *  descriptor of each write instead of closing it (durable_adopt), or a
+ *  dup of a long-lived one (durable_written). The thread closes the
+ *  descriptors once they are synced. For the batch policies it also
+ *  syncs the frames directory, so new file names survive too.
+ *
+ *  Capture only waits if DURABLE_QUEUE writes are waiting for a sync.
+ *  The report shows how often that happened, the sync latency, and the
+ *  longest time a write stayed unsynced.
+ */
+#ifndef DURABLE_H
+#define DURABLE_H
+
+#include <sys/types.h>
+
+#define DURABLE_QUEUE   (256)   /* writes waiting for a sync before capture blocks */
+
+int durable_parse(const char *spec);
+int durable_start(const char *directory);
+int durable_enabled(void);
+void durable_adopt(int fd, off_t offset, off_t length);
+void durable_written(int fd, off_t offset, off_t length);
+void durable_frame(void);
+void durable_stop(void);
+void durable_report(void);
+
+#endif /* DURABLE_H */
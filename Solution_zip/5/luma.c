@@ -0,0 +1,193 @@
+/*
+ *  Vectorized luma sampling, sharpness and change metrics.
+ *
+ *  YUYV keeps luma in the even bytes, so 32 source bytes give 16 luma
+ *  values with one byte shuffle. Absolute differences are done on 16
+ *  lanes of bytes and widened to 16 bit lanes for accumulation; one row
+ *  of 640 pixels cannot overflow them, so they are reduced per row.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "luma.h"
+#include "simd.h"
+
+#define MAX_BLOCK_COLUMNS (1920 / 16)
+
+static const v16u8 even_bytes = { 0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30 };
+
+
+/**
+ * @brief Allocates a luma sample for frames of the given size.
+ *
+ * @param s Sample to initialise.
+ * @param width Frame width in pixels.
+ * @param height Frame height in lines.
+ * @param row_step Keep every row_step-th line, 1 keeps all of them.
+ * @return 0 on success, -1 when out of memory.
+ */
+int luma_sample_init(struct luma_sample *s, int width, int height, int row_step)
+{
+    s->width = width;
+    s->row_step = row_step > 0 ? row_step : 1;
+    s->rows = (height + s->row_step - 1) / s->row_step;
+    s->y = calloc((size_t)s->rows, (size_t)width);
+    return s->y ? 0 : -1;
+}
+
+void luma_sample_free(struct luma_sample *s)
+{
+    free(s->y);
+    s->y = NULL;
+}
+
+/**
+ * @brief Copies the luma of every row_step-th line of a YUYV frame into the sample.
+ *
+ * @param s Initialised sample.
+ * @param yuyv Frame data.
+ * @param stride Bytes per line in the frame.
+ */
+void luma_sample_take(struct luma_sample *s, const unsigned char *yuyv, int stride)
+{
+    int r, x;
+
+    for (r = 0; r < s->rows; r++)
+    {
+        const unsigned char *src = yuyv + (size_t)r * s->row_step * stride;
+        unsigned char *dst = s->y + (size_t)r * s->width;
+
+        for (x = 0; x + 16 <= s->width; x += 16)
+        {
+            v16u8 y = __builtin_shuffle(load16(src + 2 * x), load16(src + 2 * x + 16), even_bytes);
+
+            memcpy(dst + x, &y, sizeof(y));
+        }
+        for (; x < s->width; x++)
+            dst[x] = src[2 * x];
+    }
+}
+
+/**
+ * @brief Mean absolute horizontal luma gradient, higher for sharper frames.
+ *
+ * Motion blur and focus hunting both smear edges, which lowers this far
+ * more than ordinary scene content changes it.
+ */
+double luma_sharpness(const struct luma_sample *s)
+{
+    unsigned long total = 0;
+    int r, x;
+
+    if (s->width < 2)
+        return 0.0;
+
+    for (r = 0; r < s->rows; r++)
+    {
+        const unsigned char *y = s->y + (size_t)r * s->width;
+        v8u16 acc = { 0 };
+
+        for (x = 0; x + 17 <= s->width; x += 16)
+            acc = widen_add(acc, absdiff16(load16(y + x), load16(y + x + 1)));
+        total += reduce16(acc);
+
+        for (; x + 1 < s->width; x++)
+            total += abs(y[x + 1] - y[x]);
+    }
+
+    return (double)total / ((double)s->rows * (s->width - 1));
+}
+
+/**
+ * @brief Mean absolute luma difference between two samples of the same shape.
+ */
+double luma_mean_abs_diff(const struct luma_sample *a, const struct luma_sample *b)
+{
+    unsigned long total = 0;
+    int r, x;
+
+    for (r = 0; r < a->rows; r++)
+    {
+        const unsigned char *ya = a->y + (size_t)r * a->width;
+        const unsigned char *yb = b->y + (size_t)r * b->width;
+        v8u16 acc = { 0 };
+
+        for (x = 0; x + 16 <= a->width; x += 16)
+            acc = widen_add(acc, absdiff16(load16(ya + x), load16(yb + x)));
+        total += reduce16(acc);
+
+        for (; x < a->width; x++)
+            total += abs(ya[x] - yb[x]);
+    }
+
+    return (double)total / ((double)a->rows * a->width);
+}
+
+/**
+ * @brief Luma histogram of a sample with 256 >> shift bins.
+ *
+ * @param s Sample to count.
+ * @param hist Receives the counts, must hold 256 >> shift entries.
+ * @param shift Bin width as a power of two, 0 gives one bin per luma value.
+ */
+void luma_histogram(const struct luma_sample *s, unsigned int *hist, int shift)
+{
+    const unsigned char *y = s->y;
+    size_t i, n = (size_t)s->rows * s->width;
+
+    memset(hist, 0, (256 >> shift) * sizeof(*hist));
+    for (i = 0; i < n; i++)
+        hist[y[i] >> shift]++;
+}
+
+/**
+ * @brief Counts 16 pixel wide blocks whose mean absolute luma difference exceeds a threshold.
+ *
+ * A block spans 16 luma columns and block_rows sampled lines, so with a
+ * row_step of 4 and block_rows of 4 it covers 16x16 pixels of the frame.
+ * Block sums stay in 16 bit vector lanes until the block is complete.
+ * Columns that do not fill a whole block are ignored.
+ *
+ * @param a First sample.
+ * @param b Second sample, same shape as a.
+ * @param block_rows Sampled lines per block.
+ * @param threshold Mean absolute difference, in luma levels, that marks a block changed.
+ * @return Number of changed blocks.
+ */
+int luma_changed_blocks(const struct luma_sample *a, const struct luma_sample *b,
+                        int block_rows, double threshold)
+{
+    v8u16 acc[MAX_BLOCK_COLUMNS];
+    int columns = a->width / 16, changed = 0, r, bx, in_block = 0;
+    unsigned long limit;
+
+    if (columns > MAX_BLOCK_COLUMNS)
+        columns = MAX_BLOCK_COLUMNS;
+    if (block_rows < 1)
+        block_rows = 1;
+    limit = (unsigned long)(threshold * 16 * block_rows);
+    memset(acc, 0, sizeof(acc));
+
+    for (r = 0; r < a->rows; r++)
+    {
+        const unsigned char *ya = a->y + (size_t)r * a->width;
+        const unsigned char *yb = b->y + (size_t)r * b->width;
+
+        for (bx = 0; bx < columns; bx++)
+            acc[bx] = widen_add(acc[bx], absdiff16(load16(ya + 16 * bx), load16(yb + 16 * bx)));
+
+        if (++in_block == block_rows || r == a->rows - 1)
+        {
+            for (bx = 0; bx < columns; bx++)
+            {
+                if (reduce16(acc[bx]) > limit)
+                    changed++;
+            }
+            memset(acc, 0, sizeof(acc));
+            in_block = 0;
+        }
+    }
+
+    return changed;
+}
@@ -0,0 +1,31 @@
+/*
+ *  Cheap luma statistics on YUYV frames.
+ *
+ *  A luma sample keeps the Y values of every row_step-th line of a
+ *  frame, which is enough to judge sharpness and scene change while
+ *  touching only a fraction of the frame. The inner loops use GCC
+ *  vector extensions, so they compile to SSE2 on x86 and NEON on the
+ *  ARM boards without separate intrinsics code.
+ */
+#ifndef LUMA_H
+#define LUMA_H
+
+struct luma_sample
+{
+    unsigned char *y;       /* rows * width luma values */
+    int width;
+    int rows;
+    int row_step;
+};
+
+int luma_sample_init(struct luma_sample *s, int width, int height, int row_step);
+void luma_sample_free(struct luma_sample *s);
+void luma_sample_take(struct luma_sample *s, const unsigned char *yuyv, int stride);
+
+double luma_sharpness(const struct luma_sample *s);
+double luma_mean_abs_diff(const struct luma_sample *a, const struct luma_sample *b);
+void luma_histogram(const struct luma_sample *s, unsigned int *hist, int shift);
+int luma_changed_blocks(const struct luma_sample *a, const struct luma_sample *b,
+                        int block_rows, double threshold);
+
+#endif /* LUMA_H */
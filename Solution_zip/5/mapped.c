@@ -0,0 +1,370 @@
+/*
+ *  Memory mapped frame store with a background flusher, see mapped.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/mman.h>
+
+#include "mapped.h"
+#include "durable.h"
+
+struct window
+{
+    unsigned char *base;
+    off_t start;            /* file offset of base, a multiple of MAPPED_WINDOW */
+    size_t length;          /* MAPPED_WINDOW plus the overlap */
+};
+
+static int fd = -1;
+static size_t record_max;
+static struct window current, next, retired;
+static off_t write_offset;              /* end of the last committed image */
+static unsigned char *reserved;         /* pixel spot handed out and not yet committed */
+
+static pthread_t flusher;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;     /* flusher has work */
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;    /* next window is mapped */
+static int running, stopping, prepare_failed;
+static off_t next_start;                /* window the flusher is to prepare */
+static off_t committed, flushed;
+
+// Capture side
+static unsigned long frames, copied, windows, capture_waits;
+static unsigned long long bytes;
+static double wait_time, wait_max;
+// Flusher side, read once it has stopped
+static unsigned long flushes, prepared;
+static double flush_time, flush_max, prepare_time, prepare_max;
+
+
+static double elapsed_since(const struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Preallocates, maps and prefaults a window so capture never faults in it
+static int prepare_window(off_t start, struct window *w)
+{
+    struct timespec t0;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t length = (MAPPED_WINDOW + record_max + page - 1) & ~(page - 1);
+    double t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    // Blocks allocated up front, not one page at a time as they are dirtied
+    if (fallocate(fd, 0, start, length) < 0 && ftruncate(fd, start + length) < 0)
+        return -1;
+
+    w->base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, start);
+    if (w->base == MAP_FAILED)
+    {
+        w->base = NULL;
+        return -1;
+    }
+    w->start = start;
+    w->length = length;
+
+#ifdef MADV_POPULATE_WRITE
+    // Older kernels refuse it; capture then takes the faults itself
+    madvise(w->base, length, MADV_POPULATE_WRITE);
+#endif
+
+    t = elapsed_since(&t0);
+    prepared++;
+    prepare_time += t;
+    if (t > prepare_max)
+        prepare_max = t;
+    return 0;
+}
+
+static void *flush_thread(void *arg)
+{
+    struct window w, old;
+    struct timespec deadline, t0;
+    off_t start, from, upto;
+    int timed_out = 0, rc;
+    double t;
+
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    while (!stopping)
+    {
+        if (!next.base && !prepare_failed)
+        {
+            start = next_start;
+            pthread_mutex_unlock(&lock);
+            rc = prepare_window(start, &w);
+            pthread_mutex_lock(&lock);
+            if (rc < 0)
+            {
+                syslog(LOG_ERR, "cannot map frames.pnm at %lld: %s", (long long)start, strerror(errno));
+                prepare_failed = 1;
+            }
+            else
+                next = w;
+            pthread_cond_broadcast(&ready);
+            continue;
+        }
+
+        if (retired.base)
+        {
+            old = retired;
+            retired.base = NULL;
+            pthread_mutex_unlock(&lock);
+            munmap(old.base, old.length);
+            pthread_mutex_lock(&lock);
+            continue;
+        }
+
+        if (committed - flushed >= (off_t)MAPPED_FLUSH_BYTES || (timed_out && committed > flushed))
+        {
+            from = flushed;
+            upto = committed;
+            pthread_mutex_unlock(&lock);
+
+            // Starts writeback and returns; msync(MS_ASYNC) would do nothing on Linux
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            sync_file_range(fd, from, upto - from, SYNC_FILE_RANGE_WRITE);
+            t = elapsed_since(&t0);
+            flushes++;
+            flush_time += t;
+            if (t > flush_max)
+                flush_max = t;
+
+            pthread_mutex_lock(&lock);
+            flushed = upto;
+            timed_out = 0;
+            continue;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += MAPPED_FLUSH_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        timed_out = pthread_cond_timedwait(&wake, &lock, &deadline) == ETIMEDOUT;
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/**
+ * @brief Creates the store, maps its first window and starts the flusher.
+ *
+ * @param path File to create, replacing any earlier one.
+ * @param max_image Largest pixel payload of one image, in bytes.
+ * @return 0 on success, -1 on failure.
+ */
+int mapped_open(const char *path, size_t max_image)
+{
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    record_max = MAPPED_HEADER + max_image;
+    if (prepare_window(0, &current) < 0)
+    {
+        syslog(LOG_ERR, "cannot map %s: %s", path, strerror(errno));
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+    windows = 1;
+    next_start = MAPPED_WINDOW;
+
+    if (pthread_create(&flusher, NULL, flush_thread, NULL) != 0)
+    {
+        mapped_close();
+        return -1;
+    }
+    running = 1;
+    return 0;
+}
+
+// Moves capture onto the window the flusher prepared, waiting if it is not ready yet
+static int switch_window(void)
+{
+    struct timespec t0;
+    double t;
+
+    pthread_mutex_lock(&lock);
+    if (!next.base && !prepare_failed)
+    {
+        capture_waits++;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        while (!next.base && !prepare_failed)
+            pthread_cond_wait(&ready, &lock);
+        t = elapsed_since(&t0);
+        wait_time += t;
+        if (t > wait_max)
+            wait_max = t;
+    }
+    if (prepare_failed)
+    {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+
+    // Normally long gone, a window holds dozens of frames
+    if (retired.base)
+        munmap(retired.base, retired.length);
+    retired = current;
+    current = next;
+    next.base = NULL;
+    next_start = current.start + MAPPED_WINDOW;
+    windows++;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/**
+ * @brief Where the next image's pixels go, inside the mapping.
+ *
+ * Stays valid until mapped_commit(). At most max_image bytes may be written.
+ *
+ * @return The pixel spot, or NULL if the store could not be extended.
+ */
+unsigned char *mapped_reserve(void)
+{
+    if (reserved)
+        return reserved;
+
+    // An image belongs to the window holding its first byte, the overlap takes the rest
+    if (write_offset >= current.start + (off_t)MAPPED_WINDOW && switch_window() < 0)
+        return NULL;
+
+    reserved = current.base + (write_offset - current.start) + MAPPED_HEADER;
+    return reserved;
+}
+
+/**
+ * @brief Adds an image to the store, writing its header in front of the pixels.
+ *
+ * If pixels is the spot mapped_reserve() returned, nothing is copied.
+ * Any other buffer is copied in.
+ *
+ * @return Bytes the image takes in the file, or -1 on failure.
+ */
+int mapped_commit(const unsigned char *pixels, int size, const struct frame_geometry *geometry,
+                  unsigned int tag, const struct timespec *time)
+{
+    char header[MAPPED_HEADER + 1], tail[32];
+    unsigned char *record;
+    int n, tail_len, pad;
+
+    if (!mapped_reserve() || size < 0 || (size_t)size > record_max - MAPPED_HEADER)
+        return -1;
+
+    n = snprintf(header, sizeof(header), "P%c\n# timestamp %010lld.%09ld tag %u",
+                 geometry->channels == 1 ? '5' : '6', (long long)time->tv_sec, time->tv_nsec, tag);
+    tail_len = snprintf(tail, sizeof(tail), "\n%d %d\n255\n", geometry->width, geometry->height);
+    pad = MAPPED_HEADER - n - tail_len;
+    if (n < 0 || pad < 0)
+        return -1;
+
+    // The comment is padded with spaces so the pixels start MAPPED_HEADER bytes in
+    record = reserved - MAPPED_HEADER;
+    memcpy(record, header, n);
+    memset(record + n, ' ', pad);
+    memcpy(record + n + pad, tail, tail_len);
+    if (pixels != reserved)
+    {
+        memcpy(reserved, pixels, size);
+        copied++;
+    }
+
+    durable_written(fd, write_offset, MAPPED_HEADER + size);
+    reserved = NULL;
+    write_offset += MAPPED_HEADER + size;
+    frames++;
+    bytes += MAPPED_HEADER + size;
+
+    pthread_mutex_lock(&lock);
+    committed = write_offset;
+    if (committed - flushed >= (off_t)MAPPED_FLUSH_BYTES)
+        pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+
+    return MAPPED_HEADER + size;
+}
+
+/**
+ * @brief Stops the flusher, unmaps and cuts the preallocated tail off the file.
+ */
+void mapped_close(void)
+{
+    if (fd < 0)
+        return;
+
+    if (running)
+    {
+        pthread_mutex_lock(&lock);
+        stopping = 1;
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&lock);
+        pthread_join(flusher, NULL);
+        running = 0;
+    }
+
+    if (current.base)
+        munmap(current.base, current.length);
+    if (next.base)
+        munmap(next.base, next.length);
+    if (retired.base)
+        munmap(retired.base, retired.length);
+    current.base = next.base = retired.base = NULL;
+
+    // The flusher has stopped, so its statistics are safe to add to here
+    if (committed > flushed)
+    {
+        struct timespec t0;
+        double t;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        sync_file_range(fd, flushed, committed - flushed, SYNC_FILE_RANGE_WRITE);
+        t = elapsed_since(&t0);
+        flushes++;
+        flush_time += t;
+        if (t > flush_max)
+            flush_max = t;
+        flushed = committed;
+    }
+    if (ftruncate(fd, write_offset) < 0)
+        syslog(LOG_ERR, "cannot trim frames.pnm: %s", strerror(errno));
+    // The trimmed size is the last change to sync
+    durable_written(fd, 0, 0);
+    close(fd);
+    fd = -1;
+}
+
+// Call after mapped_close(), the flusher's figures are only final once it has stopped
+void mapped_report(void)
+{
+    if (!frames)
+        return;
+
+    syslog(LOG_INFO, "Mapped store -- %lu frames, %llu bytes, %lu copied in, %lu windows, "
+           "map ahead mean %.3lf ms worst %.3lf ms\n",
+           frames, bytes, copied, windows,
+           prepared ? prepare_time / prepared * 1000.0 : 0.0, prepare_max * 1000.0);
+    syslog(LOG_INFO, "Mapped store -- %lu background flushes, mean %.3lf ms worst %.3lf ms, "
+           "capture waited for a window %lu times, %.3lf ms total %.3lf ms worst\n",
+           flushes, flushes ? flush_time / flushes * 1000.0 : 0.0, flush_max * 1000.0,
+           capture_waits, wait_time * 1000.0, wait_max * 1000.0);
+}
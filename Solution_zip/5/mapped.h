@@ -0,0 +1,45 @@
+/*
+ *  Memory mapped frame store.
+ *
+ *  --store mapped writes every frame into one file, frames.pnm, as a
+ *  stream of back to back PPM/PGM images (netpbm tools and
+ *  ffmpeg -f image2pipe read it as is). The file is preallocated and
+ *  mapped MAPPED_WINDOW bytes at a time. mapped_reserve() hands out the
+ *  spot for the next image's pixels inside the mapping, so the transform
+ *  writes RGB straight into the page cache. There is no intermediate
+ *  buffer, no copy and no syscall per frame. mapped_commit() then fills
+ *  in the header in front of the pixels.
+ *
+ *  Every header is padded to MAPPED_HEADER bytes inside its timestamp
+ *  comment, so the pixel spot is known before the output shape is.
+ *
+ *  A flusher thread keeps the syscalls and page faults off the capture
+ *  thread:
+ *    - it starts writeback of committed bytes with
+ *      sync_file_range(SYNC_FILE_RANGE_WRITE) every MAPPED_FLUSH_BYTES,
+ *      or every MAPPED_FLUSH_MS when capture is slower;
+ *    - it preallocates, maps and prefaults the next window while the
+ *      current one fills;
+ *    - it unmaps windows capture has left.
+ *  Windows overlap by one record, so an image never straddles two.
+ */
+#ifndef MAPPED_H
+#define MAPPED_H
+
+#include <time.h>
+
+#include "writeback.h"
+
+#define MAPPED_HEADER       (64)            /* bytes of every image header, padding included */
+#define MAPPED_WINDOW       (64UL << 20)    /* bytes preallocated and mapped at a time */
+#define MAPPED_FLUSH_BYTES  (4UL << 20)     /* committed bytes that start a writeback */
+#define MAPPED_FLUSH_MS     (100)           /* longest committed bytes stay unflushed */
+
+int mapped_open(const char *path, size_t max_image);
+unsigned char *mapped_reserve(void);
+int mapped_commit(const unsigned char *pixels, int size, const struct frame_geometry *geometry,
+                  unsigned int tag, const struct timespec *time);
+void mapped_close(void);
+void mapped_report(void);
+
+#endif /* MAPPED_H */
@@ -0,0 +1,377 @@
+/*
+ *  Live capture metrics served over a unix socket.
+ *
+ *  Counters and gauges are plain atomics. Stage latencies go into a
+ *  log-linear histogram (8 sub-buckets per power of two microseconds)
+ *  so that p50/p99 can be estimated by the server thread without the
+ *  capture thread ever keeping or sorting samples.
+ *
+ *  Scrape with, for example:
+ *      curl --unix-socket /tmp/capture.sock http://localhost/metrics
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+#define HIST_LINEAR     (16)    /* 0..15 us get one bucket each */
+#define HIST_SUB_BITS   (3)
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    (HIST_LINEAR + (64 - 4) * HIST_SUB)
+#define PAGE_SIZE_MAX   (16 * 1024)
+
+struct stage_hist
+{
+    atomic_ullong bucket[HIST_BUCKETS];
+    atomic_ullong count;
+    atomic_ullong sum_ns;
+    atomic_ullong max_ns;
+};
+
+static atomic_ullong counters[METRIC_COUNTER_COUNT];
+static atomic_long gauges[METRIC_GAUGE_COUNT];
+static struct stage_hist stages[STAGE_COUNT];
+
+static const char *counter_names[METRIC_COUNTER_COUNT][2] =
+{
+    { "capture_frames_in_total",      "Frames dequeued from the V4L2 driver." },
+    { "capture_frames_written_total", "Frames written to the frames directory." },
+    { "capture_frames_dropped_total", "Frames lost according to driver sequence numbers." },
+    { "capture_bytes_written_total",  "Header and pixel bytes written." },
+    { "capture_write_errors_total",   "Failed opens or short writes during writeback." },
+    { "capture_deadline_misses_total{stage=\"acquisition\"}", "Stage durations that exceeded their deadline." },
+    { "capture_deadline_misses_total{stage=\"transform\"}",   "Stage durations that exceeded their deadline." },
+    { "capture_deadline_misses_total{stage=\"writeback\"}",   "Stage durations that exceeded their deadline." },
+    { "capture_frames_skipped_total{reason=\"selector\"}",      "Frames requeued without transform or writeback." },
+    { "capture_frames_skipped_total{reason=\"warmup\"}",        "Frames requeued without transform or writeback." },
+    { "capture_frames_skipped_total{reason=\"unchanged\"}",     "Frames requeued without transform or writeback." },
+    { "capture_bytes_saved_total",    "Writeback bytes avoided by skipping unchanged frames." },
+};
+
+static const char *gauge_names[METRIC_GAUGE_COUNT][2] =
+{
+    { "capture_driver_queue_depth",   "Buffers currently queued to the driver." },
+    { "capture_app_buffers_held",     "Buffers dequeued by the application and not yet requeued." },
+    { "capture_degrade_mode",         "Current degradation mode, 0 when running normally." },
+};
+
+static const char *stage_names[STAGE_COUNT] = { "acquisition", "transform", "writeback" };
+
+static int listen_fd = -1;
+static pthread_t server_thread;
+static atomic_int stopping;
+static char socket_name[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+
+void metrics_count(enum metric_counter counter, unsigned long n)
+{
+    atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
+
+void metrics_gauge_set(enum metric_gauge gauge, long value)
+{
+    atomic_store_explicit(&gauges[gauge], value, memory_order_relaxed);
+}
+
+void metrics_gauge_add(enum metric_gauge gauge, long delta)
+{
+    atomic_fetch_add_explicit(&gauges[gauge], delta, memory_order_relaxed);
+}
+
+static unsigned int hist_index(unsigned long long us)
+{
+    unsigned int msb;
+
+    if (us < HIST_LINEAR)
+        return (unsigned int)us;
+
+    msb = 63 - __builtin_clzll(us);
+    return HIST_LINEAR + (msb - 4) * HIST_SUB + ((us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// Midpoint of a bucket, in microseconds
+static double hist_value(unsigned int idx)
+{
+    unsigned int msb, sub;
+    double width;
+
+    if (idx < HIST_LINEAR)
+        return idx + 0.5;
+
+    msb = (idx - HIST_LINEAR) / HIST_SUB + 4;
+    sub = (idx - HIST_LINEAR) % HIST_SUB;
+    width = (double)(1ULL << (msb - HIST_SUB_BITS));
+    return (double)(1ULL << msb) + sub * width + width / 2.0;
+}
+
+/**
+ * @brief Records one stage duration. Safe to call from any thread, never blocks.
+ *
+ * @param stage Stage the sample belongs to.
+ * @param seconds Wall-clock duration of the stage.
+ */
+void metrics_observe(enum metric_stage stage, double seconds)
+{
+    struct stage_hist *h = &stages[stage];
+    unsigned long long ns, max;
+
+    if (seconds < 0)
+        seconds = 0;
+    ns = (unsigned long long)(seconds * 1e9);
+
+    atomic_fetch_add_explicit(&h->bucket[hist_index(ns / 1000)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_ns, ns, memory_order_relaxed);
+
+    max = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+    while (ns > max &&
+           !atomic_compare_exchange_weak_explicit(&h->max_ns, &max, ns,
+                                                  memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+const char *metrics_stage_name(enum metric_stage stage)
+{
+    return stage_names[stage];
+}
+
+static double hist_quantile(const unsigned long long *bucket, unsigned long long total, double q)
+{
+    unsigned long long rank, seen = 0;
+    unsigned int i;
+
+    if (total == 0)
+        return 0.0;
+
+    rank = (unsigned long long)(q * (double)(total - 1)) + 1;
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += bucket[i];
+        if (seen >= rank)
+            return hist_value(i) / 1e6;
+    }
+    return hist_value(HIST_BUCKETS - 1) / 1e6;
+}
+
+static int append(char *page, int len, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (len >= PAGE_SIZE_MAX)
+        return len;
+
+    va_start(ap, fmt);
+    n = vsnprintf(page + len, PAGE_SIZE_MAX - len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0)
+        return len;
+    return (len + n < PAGE_SIZE_MAX) ? len + n : PAGE_SIZE_MAX;
+}
+
+// HELP and TYPE are emitted once per metric family, labelled series share them
+static int append_family(char *page, int len, const char *name, const char *help,
+                         const char *type, const char **previous)
+{
+    size_t base = strcspn(name, "{");
+
+    if (*previous && strncmp(*previous, name, base) == 0 && strcspn(*previous, "{") == base)
+        return len;
+
+    *previous = name;
+    return append(page, len, "# HELP %.*s %s\n# TYPE %.*s %s\n",
+                  (int)base, name, help, (int)base, name, type);
+}
+
+static int format_page(char *page)
+{
+    const char *previous = NULL;
+    static unsigned long long snapshot[HIST_BUCKETS];
+    unsigned long long total;
+    int len = 0, i, s;
+
+    for (i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        len = append_family(page, len, counter_names[i][0], counter_names[i][1], "counter", &previous);
+        len = append(page, len, "%s %llu\n", counter_names[i][0],
+                     atomic_load_explicit(&counters[i], memory_order_relaxed));
+    }
+
+    for (i = 0; i < METRIC_GAUGE_COUNT; i++)
+    {
+        len = append_family(page, len, gauge_names[i][0], gauge_names[i][1], "gauge", &previous);
+        len = append(page, len, "%s %ld\n", gauge_names[i][0],
+                     atomic_load_explicit(&gauges[i], memory_order_relaxed));
+    }
+
+    len = append(page, len,
+                 "# HELP capture_stage_latency_seconds Wall-clock duration of each capture stage.\n"
+                 "# TYPE capture_stage_latency_seconds summary\n");
+    for (s = 0; s < STAGE_COUNT; s++)
+    {
+        struct stage_hist *h = &stages[s];
+
+        // The snapshot is not atomic as a whole, so derive the total from it
+        total = 0;
+        for (i = 0; i < HIST_BUCKETS; i++)
+        {
+            snapshot[i] = atomic_load_explicit(&h->bucket[i], memory_order_relaxed);
+            total += snapshot[i];
+        }
+
+        len = append(page, len,
+                     "capture_stage_latency_seconds{stage=\"%s\",quantile=\"0.5\"} %.9f\n"
+                     "capture_stage_latency_seconds{stage=\"%s\",quantile=\"0.99\"} %.9f\n"
+                     "capture_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n"
+                     "capture_stage_latency_seconds_count{stage=\"%s\"} %llu\n",
+                     stage_names[s], hist_quantile(snapshot, total, 0.5),
+                     stage_names[s], hist_quantile(snapshot, total, 0.99),
+                     stage_names[s], atomic_load_explicit(&h->sum_ns, memory_order_relaxed) / 1e9,
+                     stage_names[s], total);
+    }
+
+    len = append(page, len,
+                 "# HELP capture_stage_latency_max_seconds Worst observed duration of each capture stage.\n"
+                 "# TYPE capture_stage_latency_max_seconds gauge\n");
+    for (s = 0; s < STAGE_COUNT; s++)
+    {
+        len = append(page, len, "capture_stage_latency_max_seconds{stage=\"%s\"} %.9f\n",
+                     stage_names[s],
+                     atomic_load_explicit(&stages[s].max_ns, memory_order_relaxed) / 1e9);
+    }
+
+    return len;
+}
+
+static void send_all(int conn, const char *p, int len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = send(conn, p, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void *metrics_server(void *arg)
+{
+    static char page[PAGE_SIZE_MAX];
+    char request[512], head[128];
+    struct timeval tv = { 0, 100000 };
+    int conn, len, hlen;
+
+    (void)arg;
+
+    while (!atomic_load(&stopping))
+    {
+        conn = accept(listen_fd, NULL, NULL);
+        if (conn < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        // Swallow an HTTP request if the client sent one, but never wait long for it
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        (void)recv(conn, request, sizeof(request), 0);
+
+        len = format_page(page);
+        hlen = snprintf(head, sizeof(head),
+                        "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %d\r\n\r\n", len);
+        send_all(conn, head, hlen);
+        send_all(conn, page, len);
+        close(conn);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Binds the metrics socket and starts the server thread.
+ *
+ * @param socket_path Filesystem path of the unix socket. An existing socket is replaced.
+ * @return 0 on success, -1 on failure (capture continues without metrics).
+ */
+int metrics_start(const char *socket_path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        syslog(LOG_ERR, "metrics socket path too long: %s", socket_path);
+        return -1;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        syslog(LOG_ERR, "metrics socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    strcpy(socket_name, socket_path);
+    unlink(socket_path);
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 4) < 0)
+    {
+        syslog(LOG_ERR, "metrics bind %s: %s", socket_path, strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    if (pthread_create(&server_thread, NULL, metrics_server, NULL) != 0)
+    {
+        syslog(LOG_ERR, "metrics thread creation failed");
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(socket_path);
+        return -1;
+    }
+
+    syslog(LOG_INFO, "metrics available on %s\n", socket_path);
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    if (listen_fd < 0)
+        return;
+
+    atomic_store(&stopping, 1);
+    // Wakes the server thread out of accept()
+    shutdown(listen_fd, SHUT_RDWR);
+    pthread_join(server_thread, NULL);
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(socket_name);
+}
@@ -0,0 +1,54 @@
+/*
+ *  Live capture metrics, exported in Prometheus text format over a
+ *  local unix socket.
+ *
+ *  The capture thread only ever performs relaxed atomic updates on
+ *  fixed-size tables; formatting and socket I/O happen on a separate
+ *  server thread, so a slow or stuck scraper can never stall capture.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+enum metric_counter
+{
+    METRIC_FRAMES_IN,           /* frames dequeued from the driver */
+    METRIC_FRAMES_WRITTEN,      /* frames that reached the frames directory */
+    METRIC_FRAMES_DROPPED,      /* gaps in the driver sequence numbers */
+    METRIC_BYTES_WRITTEN,       /* header + pixel bytes written */
+    METRIC_WRITE_ERRORS,        /* failed opens or short writes */
+    METRIC_DEADLINE_MISSES_ACQUISITION,
+    METRIC_DEADLINE_MISSES_TRANSFORM,
+    METRIC_DEADLINE_MISSES_WRITEBACK,
+    METRIC_FRAMES_SKIPPED_SELECTOR,     /* not the best frame of their period */
+    METRIC_FRAMES_SKIPPED_WARMUP,       /* discarded while the camera settles */
+    METRIC_FRAMES_SKIPPED_UNCHANGED,    /* duplicates of the last written frame */
+    METRIC_BYTES_SAVED,                 /* writeback avoided by change gating */
+    METRIC_COUNTER_COUNT
+};
+
+enum metric_gauge
+{
+    METRIC_DRIVER_QUEUE_DEPTH,  /* buffers queued to the driver */
+    METRIC_APP_BUFFERS_HELD,    /* buffers dequeued and not yet requeued */
+    METRIC_DEGRADE_MODE,        /* current enum degrade_mode */
+    METRIC_GAUGE_COUNT
+};
+
+enum metric_stage
+{
+    STAGE_ACQUISITION,
+    STAGE_TRANSFORM,
+    STAGE_WRITEBACK,
+    STAGE_COUNT
+};
+
+void metrics_count(enum metric_counter counter, unsigned long n);
+void metrics_gauge_set(enum metric_gauge gauge, long value);
+void metrics_gauge_add(enum metric_gauge gauge, long delta);
+void metrics_observe(enum metric_stage stage, double seconds);
+const char *metrics_stage_name(enum metric_stage stage);
+
+int metrics_start(const char *socket_path);
+void metrics_stop(void);
+
+#endif /* METRICS_H */
@@ -0,0 +1,220 @@
+/*
+ *  Per-stage hardware performance counters, see perf.h.
+ *
+ *  The group is read with PERF_FORMAT_GROUP, so one read() returns all
+ *  four counters. If the PMU multiplexes the group with other events,
+ *  deltas are scaled by enabled / running time for the same interval.
+ *
+ *  The group counts the thread that opened it and nothing else. A stage
+ *  run on another thread (writeback and the raw transform on the ring
+ *  flusher) would read the capture thread's counts, so it is not sampled.
+ *  The report says how often that happened.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf.h"
+
+enum perf_counter
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNT
+};
+
+static const uint64_t configs[PERF_COUNT] =
+{
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+// Layout of a PERF_FORMAT_GROUP read with both time fields
+struct group_read
+{
+    uint64_t nr;
+    uint64_t time_enabled;
+    uint64_t time_running;
+    uint64_t values[PERF_COUNT];
+};
+
+struct stage_counts
+{
+    double totals[PERF_COUNT];
+    unsigned long long pixels;
+    unsigned long samples;
+    unsigned long other_thread;     /* runs off the counted thread, left out */
+    struct group_read start;
+};
+
+static int fds[PERF_COUNT] = { -1, -1, -1, -1 };
+static int enabled;
+static int user_only;
+static pthread_t counted;           /* the thread the group counts */
+static struct stage_counts stages[STAGE_COUNT];
+
+
+static int open_counter(uint64_t config, int group_fd, int exclude_kernel)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group_fd < 0;       // the leader starts the whole group
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    // this thread, any CPU
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static void close_all(void)
+{
+    int i;
+
+    for (i = 0; i < PERF_COUNT; i++)
+    {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+/**
+ * @brief Opens the counter group on the calling thread and starts it.
+ *
+ * Kernel time is counted when allowed, so writeback's syscalls show up;
+ * with perf_event_paranoid >= 2 only user space is counted.
+ *
+ * @return 0 on success, -1 if the counters are not available (capture continues without them).
+ */
+int perf_init(void)
+{
+    int i, exclude_kernel;
+
+    for (exclude_kernel = 0; exclude_kernel <= 1; exclude_kernel++)
+    {
+        for (i = 0; i < PERF_COUNT; i++)
+        {
+            fds[i] = open_counter(configs[i], i ? fds[0] : -1, exclude_kernel);
+            if (fds[i] < 0)
+                break;
+        }
+        if (i == PERF_COUNT)
+            break;
+
+        close_all();
+        if (errno != EACCES && errno != EPERM)
+            break;
+    }
+
+    if (fds[0] < 0)
+    {
+        syslog(LOG_ERR, "perf_event_open: %s, no hardware counters", strerror(errno));
+        return -1;
+    }
+
+    user_only = exclude_kernel;
+    counted = pthread_self();
+    ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    enabled = 1;
+    return 0;
+}
+
+int perf_enabled(void)
+{
+    return enabled;
+}
+
+void perf_begin(enum metric_stage stage)
+{
+    if (!enabled)
+        return;
+    if (!pthread_equal(pthread_self(), counted))
+    {
+        // Only counted here, stages[] is the counted thread's alone
+        __atomic_add_fetch(&stages[stage].other_thread, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (read(fds[0], &stages[stage].start, sizeof(struct group_read)) != sizeof(struct group_read))
+        stages[stage].start.nr = 0;
+}
+
+/**
+ * @brief Adds the counts since perf_begin() to the stage.
+ *
+ * @param stage Stage that just finished.
+ * @param pixels Pixels the stage processed, for the per-pixel figures.
+ */
+void perf_end(enum metric_stage stage, unsigned long pixels)
+{
+    struct stage_counts *s = &stages[stage];
+    struct group_read now;
+    double scale = 1.0;
+    uint64_t running;
+    int i;
+
+    if (!enabled || !pthread_equal(pthread_self(), counted) || s->start.nr != PERF_COUNT)
+        return;
+    if (read(fds[0], &now, sizeof(now)) != sizeof(now))
+        return;
+
+    running = now.time_running - s->start.time_running;
+    if (running == 0)
+        return;     // the group was never on the PMU during this stage
+    scale = (double)(now.time_enabled - s->start.time_enabled) / running;
+
+    for (i = 0; i < PERF_COUNT; i++)
+        s->totals[i] += (now.values[i] - s->start.values[i]) * scale;
+    s->pixels += pixels;
+    s->samples++;
+}
+
+void perf_report(void)
+{
+    int st;
+
+    if (!enabled)
+        return;
+
+    for (st = 0; st < STAGE_COUNT; st++)
+    {
+        struct stage_counts *s = &stages[st];
+        double px = s->pixels ? (double)s->pixels : 1.0;
+
+        if (s->other_thread)
+            syslog(LOG_INFO, "Perf %s -- %lu runs on another thread than the counted one, not sampled\n",
+                   metrics_stage_name(st), s->other_thread);
+        if (!s->samples)
+            continue;
+
+        syslog(LOG_INFO, "Perf %s%s -- %lu samples, %.0lf cycles/frame, IPC %.2lf, "
+               "%.4lf cache misses/pixel, %.4lf branch misses/pixel, %.2lf cycles/pixel\n",
+               metrics_stage_name(st), user_only ? " (user)" : "", s->samples,
+               s->totals[PERF_CYCLES] / s->samples,
+               s->totals[PERF_CYCLES] > 0 ? s->totals[PERF_INSTRUCTIONS] / s->totals[PERF_CYCLES] : 0.0,
+               s->totals[PERF_CACHE_MISSES] / px, s->totals[PERF_BRANCH_MISSES] / px,
+               s->totals[PERF_CYCLES] / px);
+    }
+
+    close_all();
+    enabled = 0;
+}
@@ -0,0 +1,24 @@
+/*
+ *  Per-stage hardware performance counters.
+ *
+ *  One perf_event_open() group per process (cycles leading instructions,
+ *  cache misses and branch misses) counts on the capture thread for the
+ *  whole run. Each stage reads the group once where it starts and once
+ *  where it ends, next to the existing clock_gettime() calls, and adds
+ *  the difference to that stage. At exit the totals are reported with
+ *  IPC and misses per pixel, which tells a compute-bound transform (high
+ *  IPC, few misses) from a memory-bound one. A stage run on another
+ *  thread (the ring flusher) is counted as skipped, not sampled.
+ */
+#ifndef PERF_H
+#define PERF_H
+
+#include "metrics.h"
+
+int perf_init(void);
+int perf_enabled(void);
+void perf_begin(enum metric_stage stage);
+void perf_end(enum metric_stage stage, unsigned long pixels);
+void perf_report(void);
+
+#endif /* PERF_H */
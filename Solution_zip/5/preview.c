@@ -0,0 +1,205 @@
+/*
+ *  Thumbnail and grey side outputs, see preview.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "preview.h"
+#include "writeback.h"
+
+struct side_output
+{
+    const char *prefix;
+    unsigned char *data;
+    struct frame_geometry geometry;
+    int rows_done;          /* source lines covered this frame */
+    unsigned long written, failures;
+    unsigned long long bytes;
+    double write_time, write_time_max;
+};
+
+static int enabled;
+static int src_width, src_height;
+static int factor, factor_shift;
+static struct side_output thumb = { .prefix = "thumb" }, grey = { .prefix = "grey" };
+static unsigned short *block_sums;     /* one thumbnail line of channel sums, at most 16 * 255 each */
+
+
+static int side_init(struct side_output *out, int width, int height, int channels)
+{
+    size_t size = (size_t)width * height * channels;
+
+    out->data = malloc(size);
+    if (!out->data)
+        return -1;
+    memset(out->data, 0, size);
+    out->geometry.width = width;
+    out->geometry.height = height;
+    out->geometry.channels = channels;
+    return 0;
+}
+
+/**
+ * @brief Allocates the side outputs.
+ *
+ * @param width Source frame width.
+ * @param height Source frame height.
+ * @param thumb_factor 2 or 4 for a thumbnail downscaled that much, 0 for none.
+ * @param with_grey Non-zero for a full resolution grey copy.
+ * @return 0 on success, -1 on a bad factor or allocation failure.
+ */
+int preview_init(int width, int height, int thumb_factor, int with_grey)
+{
+    if (thumb_factor != 0 && thumb_factor != 2 && thumb_factor != 4)
+        return -1;
+
+    src_width = width;
+    src_height = height;
+    factor = thumb_factor;
+    factor_shift = factor == 4 ? 4 : 2;     // log2 of the pixels per block
+
+    if (factor && side_init(&thumb, width / factor, height / factor, 3) < 0)
+        return -1;
+    if (factor && !(block_sums = malloc((size_t)(width / factor) * 3 * sizeof(*block_sums))))
+        return -1;
+    if (with_grey && side_init(&grey, width, height, 1) < 0)
+        return -1;
+
+    enabled = factor || with_grey;
+    return 0;
+}
+
+int preview_enabled(void)
+{
+    return enabled;
+}
+
+static void thumb_rows(const unsigned char *rgb, int first_row, int rows)
+{
+    int stride = src_width * 3, out_width = thumb.geometry.width;
+    int by, dy, x, i;
+
+    for (by = 0; by + factor <= rows; by += factor)
+    {
+        unsigned char *out = thumb.data + (size_t)((first_row + by) / factor) * out_width * 3;
+
+        memset(block_sums, 0, (size_t)out_width * 3 * sizeof(*block_sums));
+
+        // Lines are summed front to back so the strip is read sequentially
+        for (dy = 0; dy < factor; dy++)
+        {
+            const unsigned char *p = rgb + (size_t)(by + dy) * stride;
+            unsigned short *sum = block_sums;
+
+            if (factor == 2)
+                for (x = 0; x < out_width; x++, p += 6, sum += 3)
+                {
+                    sum[0] += p[0] + p[3];
+                    sum[1] += p[1] + p[4];
+                    sum[2] += p[2] + p[5];
+                }
+            else
+                for (x = 0; x < out_width; x++, p += 12, sum += 3)
+                {
+                    sum[0] += p[0] + p[3] + p[6] + p[9];
+                    sum[1] += p[1] + p[4] + p[7] + p[10];
+                    sum[2] += p[2] + p[5] + p[8] + p[11];
+                }
+        }
+
+        for (i = 0; i < out_width * 3; i++)
+            out[i] = (block_sums[i] + (1u << (factor_shift - 1))) >> factor_shift;
+    }
+}
+
+/**
+ * @brief Derives the side outputs for a strip that was just converted.
+ *
+ * @param yuyv Source lines of the strip, packed.
+ * @param rgb Converted lines of the strip, packed.
+ * @param first_row Frame line the strip starts at, a multiple of the thumbnail factor.
+ * @param rows Lines in the strip.
+ */
+void preview_rows(const unsigned char *yuyv, const unsigned char *rgb, int first_row, int rows)
+{
+    unsigned char *out;
+    int i, n;
+
+    if (first_row == 0)
+        thumb.rows_done = grey.rows_done = 0;
+
+    if (factor)
+    {
+        thumb_rows(rgb, first_row, rows);
+        thumb.rows_done += rows;
+    }
+
+    if (grey.data)
+    {
+        out = grey.data + (size_t)first_row * src_width;
+        n = rows * src_width;
+        for (i = 0; i < n; i++)
+            out[i] = yuyv[2 * i];
+        grey.rows_done += rows;
+    }
+}
+
+static void side_write(struct side_output *out, unsigned int tag, const struct timespec *time)
+{
+    struct timespec start, end;
+    double elapsed;
+    int size = out->geometry.width * out->geometry.height * out->geometry.channels;
+    int total;
+
+    // Only a frame that went through the full quality transform has fresh side outputs
+    if (!out->data || out->rows_done < src_height)
+        return;
+    out->rows_done = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    total = writeback_side(out->prefix, out->data, size, &out->geometry, tag, time, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (total < 0)
+    {
+        out->failures++;
+        return;
+    }
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    out->written++;
+    out->bytes += total;
+    out->write_time += elapsed;
+    if (elapsed > out->write_time_max)
+        out->write_time_max = elapsed;
+}
+
+/**
+ * @brief Writes each side output of the frame just transformed to its own file.
+ */
+void preview_write(unsigned int tag, const struct timespec *time)
+{
+    if (!enabled)
+        return;
+
+    side_write(&thumb, tag, time);
+    side_write(&grey, tag, time);
+}
+
+static void side_report(const struct side_output *out)
+{
+    if (!out->data)
+        return;
+
+    syslog(LOG_INFO, "Preview %s -- %dx%d, %lu written, %lu failed, %llu bytes, mean %.3lf ms, worst %.3lf ms\n",
+           out->prefix, out->geometry.width, out->geometry.height, out->written, out->failures, out->bytes,
+           out->written ? out->write_time / out->written * 1000.0 : 0.0, out->write_time_max * 1000.0);
+}
+
+void preview_report(void)
+{
+    side_report(&thumb);
+    side_report(&grey);
+}
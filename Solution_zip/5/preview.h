@@ -0,0 +1,26 @@
+/*
+ *  Side outputs of the transform: box-downscaled RGB thumbnail and grey copy.
+ *
+ *  The full quality transform converts the frame in strips of
+ *  PREVIEW_STRIP lines. Each strip's YUYV and RGB lines are still in
+ *  cache when preview_rows() turns them into thumbnail lines (the
+ *  average of each 2x2 or 4x4 block of converted pixels) and grey lines
+ *  (the luma bytes). So the extra outputs do not read the frame from
+ *  memory again. After the frame is written, preview_write() writes each
+ *  output as its own file (thumb<tag>.ppm, grey<tag>.pgm) and times it
+ *  separately.
+ */
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <time.h>
+
+#define PREVIEW_STRIP   (32)    /* lines per strip, a multiple of every thumbnail factor */
+
+int preview_init(int width, int height, int thumb_factor, int grey);
+int preview_enabled(void);
+void preview_rows(const unsigned char *yuyv, const unsigned char *rgb, int first_row, int rows);
+void preview_write(unsigned int tag, const struct timespec *time);
+void preview_report(void);
+
+#endif /* PREVIEW_H */
@@ -0,0 +1,415 @@
+/*
+ *  Post-run WCET and jitter report from a capture --trace file.
+ *
+ *  Replaces tailing syslog into transform_output.txt and averaging by
+ *  hand. For every span name in the trace it reports count, WCET, best
+ *  case, mean, median, standard deviation and jitter, the deadline miss
+ *  rate when a deadline is given, and a Cheddar-style service table
+ *  (T, C, D, U) with the rate monotonic least upper bound check.
+ *
+ *  The trace is read in large blocks and each line is scanned by hand,
+ *  so a 24 hour run (a few GB of trace) is processed in seconds.
+ *
+ *  Usage: capture_report [-d service=ms,...] [-p period_ms] trace.json
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <getopt.h>
+
+#define MAX_STAGES      (16)
+#define NAME_MAX_LEN    (32)
+#define READ_BLOCK      (4 * 1024 * 1024)
+
+struct stage
+{
+    char name[NAME_MAX_LEN];
+    uint32_t *ns;               /* every duration, for the median */
+    size_t count;
+    size_t capacity;
+    double sum, sum_sq;         /* microseconds */
+    uint32_t max_ns, min_ns;
+    double deadline_us;         /* 0 when no deadline was given */
+    size_t misses;
+};
+
+static struct stage stages[MAX_STAGES];
+static int n_stages;
+
+// Frame release times, taken as the end of each DQBUF wait
+static double last_release_us = -1;
+static double period_sum, period_sum_sq, period_max, period_min = 1e300;
+static double first_release_us = -1;
+static size_t releases;
+
+static const char *table_services[] = { "acquisition", "transform", "writeback", "qbuf" };
+
+
+static struct stage *stage_for(const char *name, size_t len)
+{
+    int i;
+
+    if (len >= NAME_MAX_LEN)
+        len = NAME_MAX_LEN - 1;
+
+    for (i = 0; i < n_stages; i++)
+        if (strlen(stages[i].name) == len && memcmp(stages[i].name, name, len) == 0)
+            return &stages[i];
+
+    if (n_stages == MAX_STAGES)
+        return NULL;
+
+    memcpy(stages[n_stages].name, name, len);
+    stages[n_stages].name[len] = '\0';
+    stages[n_stages].min_ns = UINT32_MAX;
+    return &stages[n_stages++];
+}
+
+static struct stage *find_stage(const char *name)
+{
+    return stage_for(name, strlen(name));
+}
+
+// Parses the "%.3f" microsecond numbers the tracer writes without going through strtod
+static double parse_us(const char *p)
+{
+    double whole = 0, frac = 0, scale = 1;
+    int neg = 0;
+
+    if (*p == '-')
+    {
+        neg = 1;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9')
+        whole = whole * 10 + (*p++ - '0');
+    if (*p == '.')
+    {
+        p++;
+        while (*p >= '0' && *p <= '9')
+        {
+            frac = frac * 10 + (*p++ - '0');
+            scale *= 10;
+        }
+    }
+    whole += frac / scale;
+    return neg ? -whole : whole;
+}
+
+static const char *find_key(const char *line, const char *end, const char *key, size_t keylen)
+{
+    const char *p;
+
+    for (p = line; p + keylen <= end; p++)
+        if (*p == '"' && memcmp(p, key, keylen) == 0)
+            return p + keylen;
+    return NULL;
+}
+
+static void add_duration(struct stage *s, double dur_us)
+{
+    uint32_t ns;
+
+    if (s->count == s->capacity)
+    {
+        s->capacity = s->capacity ? s->capacity * 2 : 65536;
+        s->ns = realloc(s->ns, s->capacity * sizeof(*s->ns));
+        if (!s->ns)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ns = dur_us * 1000.0 > (double)UINT32_MAX ? UINT32_MAX : (uint32_t)(dur_us * 1000.0);
+    s->ns[s->count++] = ns;
+    s->sum += dur_us;
+    s->sum_sq += dur_us * dur_us;
+    if (ns > s->max_ns)
+        s->max_ns = ns;
+    if (ns < s->min_ns)
+        s->min_ns = ns;
+    if (s->deadline_us > 0 && dur_us > s->deadline_us)
+        s->misses++;
+}
+
+static void parse_line(const char *line, const char *end)
+{
+    const char *name, *name_end, *ts, *dur;
+    struct stage *s;
+    double ts_us, dur_us, interval;
+
+    // Only complete events carry durations
+    if (!find_key(line, end, "\"ph\":\"X\"", 8))
+        return;
+
+    name = find_key(line, end, "\"name\":\"", 8);
+    ts = find_key(line, end, "\"ts\":", 5);
+    dur = find_key(line, end, "\"dur\":", 6);
+    if (!name || !ts || !dur)
+        return;
+
+    name_end = memchr(name, '"', end - name);
+    if (!name_end)
+        return;
+
+    s = stage_for(name, name_end - name);
+    if (!s)
+        return;
+
+    ts_us = parse_us(ts);
+    dur_us = parse_us(dur);
+    add_duration(s, dur_us);
+
+    if (name_end - name == 10 && memcmp(name, "dqbuf_wait", 10) == 0)
+    {
+        double release = ts_us + dur_us;
+
+        if (last_release_us >= 0)
+        {
+            interval = release - last_release_us;
+            period_sum += interval;
+            period_sum_sq += interval * interval;
+            if (interval > period_max)
+                period_max = interval;
+            if (interval < period_min)
+                period_min = interval;
+        }
+        else
+            first_release_us = release;
+        last_release_us = release;
+        releases++;
+    }
+}
+
+static int read_trace(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    char *buf, *line, *nl, *limit;
+    size_t have = 0, n;
+
+    if (!fp)
+    {
+        perror(path);
+        return -1;
+    }
+
+    buf = malloc(READ_BLOCK + 1);
+    if (!buf)
+    {
+        fclose(fp);
+        return -1;
+    }
+
+    while ((n = fread(buf + have, 1, READ_BLOCK - have, fp)) > 0 || have > 0)
+    {
+        have += n;
+        limit = buf + have;
+        line = buf;
+
+        while ((nl = memchr(line, '\n', limit - line)) != NULL)
+        {
+            parse_line(line, nl);
+            line = nl + 1;
+        }
+
+        // At end of file the unterminated remainder is the last line
+        if (n == 0)
+        {
+            parse_line(line, limit);
+            break;
+        }
+
+        have = limit - line;
+        if (have == READ_BLOCK)
+        {
+            fprintf(stderr, "line longer than %d bytes, giving up\n", READ_BLOCK);
+            break;
+        }
+        memmove(buf, line, have);
+    }
+
+    free(buf);
+    fclose(fp);
+    return 0;
+}
+
+static void swap_u32(uint32_t *a, uint32_t *b)
+{
+    uint32_t t = *a;
+    *a = *b;
+    *b = t;
+}
+
+// Quickselect with a three-way partition, k-th smallest; reorders the array.
+// Stage durations repeat a lot (qbuf is nearly constant), which would make
+// a two-way partition quadratic.
+static uint32_t select_kth(uint32_t *v, size_t n, size_t k)
+{
+    size_t lo = 0, hi = n, lt, gt, i;
+    uint32_t pivot;
+
+    while (hi - lo > 1)
+    {
+        pivot = v[lo + (hi - lo) / 2];
+        lt = lo;
+        gt = hi;
+        i = lo;
+        while (i < gt)
+        {
+            if (v[i] < pivot)
+                swap_u32(&v[i++], &v[lt++]);
+            else if (v[i] > pivot)
+                swap_u32(&v[i], &v[--gt]);
+            else
+                i++;
+        }
+
+        if (k < lt)
+            hi = lt;
+        else if (k >= gt)
+            lo = gt;
+        else
+            return pivot;
+    }
+    return v[lo];
+}
+
+static int parse_deadlines(char *spec)
+{
+    char *item, *save, *eq;
+    struct stage *s;
+
+    for (item = strtok_r(spec, ",", &save); item; item = strtok_r(NULL, ",", &save))
+    {
+        eq = strchr(item, '=');
+        if (!eq)
+            return -1;
+        *eq = '\0';
+        s = find_stage(item);
+        if (!s)
+        {
+            fprintf(stderr, "more than %d services, ignoring the deadline for %s\n", MAX_STAGES, item);
+            continue;
+        }
+        s->deadline_us = atof(eq + 1) * 1000.0;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d service=ms,...] [-p period_ms] trace.json\n"
+                    "-d   deadlines per service, e.g. transform=30,writeback=15\n"
+                    "-p   service period for the table [measured frame period]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    double period_us = 0, mean, sd, jitter, total_u = 0, lub, c_us, d_us;
+    int c, i, n_services = 0;
+
+    while ((c = getopt(argc, argv, "d:p:h")) != -1)
+    {
+        switch (c)
+        {
+            case 'd':
+                if (parse_deadlines(optarg) < 0)
+                {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+                period_us = atof(optarg) * 1000.0;
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (read_trace(argv[optind]) < 0)
+        return EXIT_FAILURE;
+
+    printf("Frame releases: %zu", releases);
+    if (releases > 1)
+    {
+        mean = period_sum / (releases - 1);
+        sd = sqrt(fmax(0.0, period_sum_sq / (releases - 1) - mean * mean));
+        printf(", period mean %.3f ms, sd %.3f ms, min %.3f ms, max %.3f ms, jitter %.3f ms\n"
+               "Achieved frame rate: %.3f Hz (frames / elapsed time)\n",
+               mean / 1e3, sd / 1e3, period_min / 1e3, period_max / 1e3,
+               (period_max - period_min) / 1e3,
+               (releases - 1) / ((last_release_us - first_release_us) / 1e6));
+        if (period_us == 0)
+            period_us = mean;
+    }
+    else
+        printf("\n");
+
+    printf("\n%-12s %9s %10s %10s %10s %10s %10s %10s %12s\n",
+           "stage", "count", "WCET ms", "BCET ms", "mean ms", "median ms", "sd ms", "jitter ms", "miss rate");
+    for (i = 0; i < n_stages; i++)
+    {
+        struct stage *s = &stages[i];
+
+        if (s->count == 0)
+            continue;
+
+        mean = s->sum / s->count;
+        sd = sqrt(fmax(0.0, s->sum_sq / s->count - mean * mean));
+        jitter = (s->max_ns - s->min_ns) / 1e6;
+
+        printf("%-12s %9zu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f ",
+               s->name, s->count, s->max_ns / 1e6, s->min_ns / 1e6, mean / 1e3,
+               select_kth(s->ns, s->count, s->count / 2) / 1e6, sd / 1e3, jitter);
+        if (s->deadline_us > 0)
+            printf("%11.3f%%\n", 100.0 * s->misses / s->count);
+        else
+            printf("%12s\n", "-");
+    }
+
+    if (period_us <= 0)
+        return EXIT_SUCCESS;
+
+    // Cheddar style: every service released once per frame, D = T unless given
+    printf("\n%-12s %10s %10s %10s %10s\n", "service", "T ms", "C ms", "D ms", "U");
+    for (i = 0; i < (int)(sizeof(table_services) / sizeof(table_services[0])); i++)
+    {
+        struct stage *s = NULL;
+        int j;
+
+        for (j = 0; j < n_stages; j++)
+            if (strcmp(stages[j].name, table_services[i]) == 0 && stages[j].count)
+                s = &stages[j];
+        if (!s)
+            continue;
+
+        c_us = s->max_ns / 1e3;
+        d_us = s->deadline_us > 0 ? s->deadline_us : period_us;
+        total_u += c_us / period_us;
+        n_services++;
+        printf("%-12s %10.3f %10.3f %10.3f %10.4f\n",
+               s->name, period_us / 1e3, c_us / 1e3, d_us / 1e3, c_us / period_us);
+    }
+
+    if (n_services)
+    {
+        lub = n_services * (pow(2.0, 1.0 / n_services) - 1.0);
+        printf("%-12s %10s %10s %10s %10.4f\n", "total", "", "", "", total_u);
+        printf("RM LUB for %d services: %.4f -- %s\n", n_services, lub,
+               total_u <= lub ? "feasible" : (total_u <= 1.0 ? "inconclusive, U <= 1" : "infeasible, U > 1"));
+    }
+
+    return EXIT_SUCCESS;
+}
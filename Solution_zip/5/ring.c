@@ -0,0 +1,404 @@
+/*
+ *  Pre-trigger ring recording, see ring.h.
+ *
+ *  Slot states only move HELD -> PENDING on the capture thread (store and
+ *  trigger both run there) and PENDING -> WRITING -> EMPTY on the flusher.
+ *  So once the capture thread has seen under the lock that the next slot
+ *  is not queued, it can copy into it without holding the lock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ring.h"
+#include "luma.h"
+#include "trace.h"
+
+#define RING_SLACK      (16)    /* slots beyond the pre-trigger window, room for the flusher to lag */
+#define MOTION_ROW_STEP (4)
+
+enum slot_state
+{
+    SLOT_EMPTY,
+    SLOT_HELD,      /* in the ring, may be overwritten */
+    SLOT_PENDING,   /* queued for the flusher */
+    SLOT_WRITING,
+};
+
+struct slot
+{
+    unsigned char *data;
+    int size;
+    struct frame_geometry geometry;
+    long long tag;
+    struct timespec time;
+    enum slot_state state;
+};
+
+static int enabled;
+static struct slot *slots;
+static unsigned char *pool;
+static size_t slot_bytes;
+static int n_slots, head;
+static long long pre_frames, post_frames;
+static long long record_until = -1;     /* frames up to this tag are queued as they arrive */
+static ring_writer writer;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher;
+static int stopping;
+
+static volatile sig_atomic_t signalled;
+static int command_fd = -1;
+static char command_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static struct luma_sample motion[2];
+static int motion_current, have_motion;
+static double motion_threshold;
+
+static unsigned long stored, flushed, flush_failures, overruns, triggers, events;
+
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    signalled = 1;
+}
+
+// Oldest queued slot, or -1
+static int next_pending(void)
+{
+    int k, i;
+
+    for (k = 0; k < n_slots; k++)
+    {
+        i = (head + k) % n_slots;
+        if (slots[i].state == SLOT_PENDING)
+            return i;
+    }
+    return -1;
+}
+
+static void *flush_thread(void *arg)
+{
+    struct slot *s;
+    int i, rc;
+
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+    for (;;)
+    {
+        i = next_pending();
+        if (i < 0)
+        {
+            if (stopping)
+                break;
+            pthread_cond_wait(&work, &lock);
+            continue;
+        }
+
+        s = &slots[i];
+        s->state = SLOT_WRITING;
+        pthread_mutex_unlock(&lock);
+
+        rc = writer(s->data, s->size, &s->geometry, s->tag, &s->time);
+
+        pthread_mutex_lock(&lock);
+        s->state = SLOT_EMPTY;
+        if (rc < 0)
+            flush_failures++;
+        else
+            flushed++;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Allocates the ring and starts the flusher thread.
+ *
+ * All slots come from one allocation that is touched up front, so the
+ * capture loop never allocates or takes a first-touch page fault.
+ * SIGUSR1 becomes a trigger.
+ *
+ * @param before Seconds kept ahead of a trigger.
+ * @param after Seconds recorded after a trigger.
+ * @param fps Nominal frame rate, converts the windows to frames.
+ * @param slot_size Largest frame that will be stored, in bytes.
+ * @param frame_writer Writes one flushed frame.
+ * @return 0 on success, -1 on failure.
+ */
+int ring_init(double before, double after, double fps, size_t slot_size, ring_writer frame_writer)
+{
+    struct sigaction sa;
+    int i;
+
+    pre_frames = (long long)(before * fps + 0.5);
+    post_frames = (long long)(after * fps + 0.5);
+    n_slots = pre_frames + 1 + RING_SLACK;
+    slot_bytes = slot_size;
+
+    slots = calloc(n_slots, sizeof(*slots));
+    pool = malloc((size_t)n_slots * slot_bytes);
+    if (!slots || !pool)
+    {
+        free(slots);
+        free(pool);
+        return -1;
+    }
+    memset(pool, 0, (size_t)n_slots * slot_bytes);
+    for (i = 0; i < n_slots; i++)
+        slots[i].data = pool + (size_t)i * slot_bytes;
+
+    writer = frame_writer;
+    if (pthread_create(&flusher, NULL, flush_thread, NULL) != 0)
+    {
+        free(slots);
+        free(pool);
+        return -1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    enabled = 1;
+    syslog(LOG_INFO, "Ring -- %d slots of %zu bytes (%.1lf MB), %lld frames before and %lld after a trigger\n",
+           n_slots, slot_bytes, (double)n_slots * slot_bytes / (1024.0 * 1024.0), pre_frames, post_frames);
+    return 0;
+}
+
+int ring_enabled(void)
+{
+    return enabled;
+}
+
+/**
+ * @brief Accepts triggers as datagrams on a unix socket.
+ *
+ * Any datagram is a trigger, e.g. `echo trigger | socat - UNIX-SENDTO:path`.
+ *
+ * @param socket_path Filesystem path of the socket. An existing socket is replaced.
+ * @return 0 on success, -1 on failure (signal and motion triggers still work).
+ */
+int ring_listen(const char *socket_path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        syslog(LOG_ERR, "ring socket path too long: %s", socket_path);
+        return -1;
+    }
+
+    command_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (command_fd < 0)
+    {
+        syslog(LOG_ERR, "ring socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+
+    if (bind(command_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        syslog(LOG_ERR, "ring bind %s: %s", socket_path, strerror(errno));
+        close(command_fd);
+        command_fd = -1;
+        return -1;
+    }
+
+    strcpy(command_path, socket_path);
+    return 0;
+}
+
+/**
+ * @brief Triggers on mean absolute luma change between consecutive frames.
+ *
+ * @param threshold Mean absolute difference, in luma levels, over every 4th line.
+ * @return 0 on success, -1 if the samples could not be allocated.
+ */
+int ring_set_motion(int width, int height, double threshold)
+{
+    if (luma_sample_init(&motion[0], width, height, MOTION_ROW_STEP) < 0 ||
+        luma_sample_init(&motion[1], width, height, MOTION_ROW_STEP) < 0)
+        return -1;
+
+    motion_threshold = threshold;
+    return 0;
+}
+
+/**
+ * @brief Copies a frame into the next slot of the ring.
+ *
+ * @param data Frame to keep, converted or raw.
+ * @param size Bytes in the frame, at most the slot size.
+ * @param geometry Shape handed back to the writer.
+ * @param tag Frame number, never negative.
+ * @param time Frame timestamp.
+ */
+void ring_store(const unsigned char *data, int size, const struct frame_geometry *geometry,
+                long long tag, const struct timespec *time)
+{
+    struct slot *s;
+
+    if ((size_t)size > slot_bytes)
+        size = slot_bytes;
+
+    pthread_mutex_lock(&lock);
+    s = &slots[head];
+    if (s->state == SLOT_PENDING || s->state == SLOT_WRITING)
+    {
+        overruns++;
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    pthread_mutex_unlock(&lock);
+
+    memcpy(s->data, data, size);
+    s->size = size;
+    s->geometry = *geometry;
+    s->tag = tag;
+    s->time = *time;
+
+    pthread_mutex_lock(&lock);
+    stored++;
+    head = (head + 1) % n_slots;
+    if (tag <= record_until)
+    {
+        s->state = SLOT_PENDING;
+        pthread_cond_signal(&work);
+    }
+    else
+        s->state = SLOT_HELD;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Queues the pre-trigger window and extends recording past the trigger.
+ *
+ * A trigger while a window is still being recorded just extends it.
+ *
+ * @param tag Frame the trigger applies to, already stored.
+ * @param cause Logged with the trigger.
+ */
+void ring_trigger(long long tag, const char *cause)
+{
+    struct timespec now;
+    int k, i, fresh;
+
+    pthread_mutex_lock(&lock);
+    triggers++;
+    fresh = tag > record_until;
+    if (fresh)
+        events++;
+
+    for (k = 1; k <= n_slots; k++)
+    {
+        i = (head - k + n_slots) % n_slots;
+        if (slots[i].state == SLOT_HELD && slots[i].tag + pre_frames >= tag && slots[i].tag <= tag)
+            slots[i].state = SLOT_PENDING;
+    }
+    if (tag + post_frames > record_until)
+        record_until = tag + post_frames;
+
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+
+    if (fresh)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        trace_instant("trigger", &now, (int)tag, 0);
+        syslog(LOG_INFO, "ring trigger at frame %lld by %s\n", tag, cause);
+    }
+}
+
+/**
+ * @brief Checks the signal, socket and motion triggers for the frame just stored.
+ *
+ * @param tag Frame number.
+ * @param yuyv Raw frame for the motion check, may be NULL when motion is off.
+ * @param stride Bytes per line in yuyv.
+ */
+void ring_poll(long long tag, const unsigned char *yuyv, int stride)
+{
+    char command[64];
+
+    if (signalled)
+    {
+        signalled = 0;
+        ring_trigger(tag, "SIGUSR1");
+    }
+
+    // Non-blocking, one cheap syscall per frame; drain so bursts count once
+    if (command_fd >= 0 && recv(command_fd, command, sizeof(command), MSG_DONTWAIT) >= 0)
+    {
+        while (recv(command_fd, command, sizeof(command), MSG_DONTWAIT) >= 0)
+            ;
+        ring_trigger(tag, "socket");
+    }
+
+    if (motion_threshold > 0 && yuyv)
+    {
+        luma_sample_take(&motion[motion_current], yuyv, stride);
+        if (have_motion && luma_mean_abs_diff(&motion[motion_current], &motion[!motion_current]) > motion_threshold)
+            ring_trigger(tag, "motion");
+        have_motion = 1;
+        motion_current = !motion_current;
+    }
+}
+
+/**
+ * @brief Writes out everything still queued and stops the flusher.
+ */
+void ring_stop(void)
+{
+    if (!enabled)
+        return;
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+    pthread_join(flusher, NULL);
+
+    if (command_fd >= 0)
+    {
+        close(command_fd);
+        unlink(command_path);
+        command_fd = -1;
+    }
+    luma_sample_free(&motion[0]);
+    luma_sample_free(&motion[1]);
+    free(pool);
+    free(slots);
+    pool = NULL;
+    slots = NULL;
+    enabled = 0;
+}
+
+void ring_report(void)
+{
+    if (!stored)
+        return;
+
+    syslog(LOG_INFO, "Ring -- %lu frames stored, %lu events (%lu triggers), %lu flushed, "
+           "%lu flush failures, %lu overruns\n",
+           stored, events, triggers, flushed, flush_failures, overruns);
+}
@@ -0,0 +1,36 @@
+/*
+ *  Pre-trigger ring recording.
+ *
+ *  Recent frames live in a fixed ring of preallocated slots in RAM and
+ *  nothing reaches the disk until a trigger: SIGUSR1, a datagram on the
+ *  ring's unix socket, or frame-to-frame luma motion above a threshold.
+ *  A trigger queues the frames of the last `before` seconds and every
+ *  frame of the next `after` seconds for a flusher thread, which hands
+ *  them to the writer oldest first. The capture thread never waits for
+ *  the flusher; if it falls so far behind that the ring wraps onto
+ *  frames still queued, new frames are dropped from the ring and counted.
+ */
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <time.h>
+
+#include "writeback.h"
+
+// Called on the flusher thread for every frame of a triggered window
+typedef int (*ring_writer)(const unsigned char *data, int size, const struct frame_geometry *geometry,
+                           unsigned int tag, const struct timespec *time);
+
+int ring_init(double before, double after, double fps, size_t slot_size, ring_writer writer);
+int ring_enabled(void);
+int ring_listen(const char *socket_path);
+int ring_set_motion(int width, int height, double threshold);
+void ring_store(const unsigned char *data, int size, const struct frame_geometry *geometry,
+                long long tag, const struct timespec *time);
+void ring_poll(long long tag, const unsigned char *yuyv, int stride);
+void ring_trigger(long long tag, const char *cause);
+void ring_stop(void);
+void ring_report(void);
+
+#endif /* RING_H */
@@ -0,0 +1,206 @@
+/*
+ *  Region of interest by driver crop or in software, see roi.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+
+#include "roi.h"
+
+static int enabled, in_software;
+static struct v4l2_rect rect;
+static int sensor_width, sensor_height;
+static size_t offset, span;             /* software ROI: first pixel and bytes to the last one */
+static const char *crop_method = "none";
+static char fallback_reason[96];
+
+
+/**
+ * @brief Parses WxH+X+Y, or WxH for a region at the top left corner.
+ *
+ * @return 0 on success, -1 on a malformed or odd-aligned region.
+ */
+int roi_parse(const char *spec)
+{
+    int w, h, x = 0, y = 0, n = 0;
+
+    if (sscanf(spec, "%dx%d%n", &w, &h, &n) != 2)
+        return -1;
+    if (spec[n])
+    {
+        spec += n;
+        n = 0;
+        if (sscanf(spec, "+%d+%d%n", &x, &y, &n) != 2 || spec[n])
+            return -1;
+    }
+    if (w <= 0 || h <= 0 || x < 0 || y < 0 || (w & 1) || (x & 1))
+        return -1;
+
+    rect.left = x;
+    rect.top = y;
+    rect.width = w;
+    rect.height = h;
+    enabled = 1;
+    return 0;
+}
+
+int roi_enabled(void)
+{
+    return enabled;
+}
+
+static int xioctl(int fd, unsigned long request, void *arg)
+{
+    int r;
+
+    do
+        r = ioctl(fd, request, arg);
+    while (r == -1 && errno == EINTR);
+    return r;
+}
+
+static int same_rect(const struct v4l2_rect *a, const struct v4l2_rect *b)
+{
+    return a->left == b->left && a->top == b->top && a->width == b->width && a->height == b->height;
+}
+
+// Asks for the crop rectangle, preferring the selection API; the granted rectangle comes back in got
+static int set_crop(int fd, const struct v4l2_rect *want, struct v4l2_rect *got)
+{
+    struct v4l2_selection sel;
+    struct v4l2_crop crop;
+
+    memset(&sel, 0, sizeof(sel));
+    sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target = V4L2_SEL_TGT_CROP;
+    sel.r = *want;
+    if (xioctl(fd, VIDIOC_S_SELECTION, &sel) == 0)
+    {
+        crop_method = "VIDIOC_S_SELECTION";
+        *got = sel.r;
+        return 0;
+    }
+
+    // Drivers older than the selection API may still crop
+    memset(&crop, 0, sizeof(crop));
+    crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    crop.c = *want;
+    if (xioctl(fd, VIDIOC_S_CROP, &crop) < 0 || xioctl(fd, VIDIOC_G_CROP, &crop) < 0)
+        return -1;
+    crop_method = "VIDIOC_S_CROP";
+    *got = crop.c;
+    return 0;
+}
+
+// Puts the driver back to the uncropped frame in the original format
+static void reset_crop(int fd, struct v4l2_format *fmt, const struct v4l2_format *original)
+{
+    struct v4l2_cropcap cropcap;
+    struct v4l2_rect full;
+
+    memset(&cropcap, 0, sizeof(cropcap));
+    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (xioctl(fd, VIDIOC_CROPCAP, &cropcap) == 0)
+        set_crop(fd, &cropcap.defrect, &full);
+
+    *fmt = *original;
+    if (xioctl(fd, VIDIOC_S_FMT, fmt) < 0)
+        xioctl(fd, VIDIOC_G_FMT, fmt);
+}
+
+/**
+ * @brief Sets up the ROI against the negotiated format, by driver crop if possible.
+ *
+ * Called after the format is set and before the buffers are requested.
+ * With a driver crop, fmt comes back describing the cropped frame. For a
+ * software ROI, width, height and sizeimage are narrowed to the region and
+ * bytesperline keeps the stride of the full frame.
+ *
+ * @param fd Open capture device.
+ * @param fmt Current format, updated in place.
+ * @return 0 on success, -1 if the region does not fit in the frame.
+ */
+int roi_apply(int fd, struct v4l2_format *fmt)
+{
+    struct v4l2_format original = *fmt, cropped;
+    struct v4l2_rect got;
+
+    if (!enabled)
+        return 0;
+
+    sensor_width = fmt->fmt.pix.width;
+    sensor_height = fmt->fmt.pix.height;
+    if (rect.left + rect.width > (unsigned int)sensor_width || rect.top + rect.height > (unsigned int)sensor_height)
+        return -1;
+
+    if (set_crop(fd, &rect, &got) < 0)
+        snprintf(fallback_reason, sizeof(fallback_reason), "driver cannot crop: %s", strerror(errno));
+    else if (!same_rect(&got, &rect))
+        snprintf(fallback_reason, sizeof(fallback_reason), "driver adjusted the crop to %ux%u+%d+%d",
+                 got.width, got.height, got.left, got.top);
+    else
+    {
+        // Without the matching format the driver would scale the crop back up
+        cropped = original;
+        cropped.fmt.pix.width = rect.width;
+        cropped.fmt.pix.height = rect.height;
+        if (xioctl(fd, VIDIOC_S_FMT, &cropped) == 0 &&
+            cropped.fmt.pix.width == rect.width && cropped.fmt.pix.height == rect.height)
+        {
+            *fmt = cropped;
+            syslog(LOG_INFO, "ROI -- %ux%u+%d+%d cropped by the driver with %s\n",
+                   rect.width, rect.height, rect.left, rect.top, crop_method);
+            return 0;
+        }
+        snprintf(fallback_reason, sizeof(fallback_reason), "driver scales the crop to %ux%u",
+                 cropped.fmt.pix.width, cropped.fmt.pix.height);
+    }
+
+    if (strcmp(crop_method, "none") != 0)
+        reset_crop(fd, fmt, &original);
+    crop_method = "none";
+
+    in_software = 1;
+    offset = (size_t)rect.top * fmt->fmt.pix.bytesperline + rect.left * 2;
+    span = (size_t)(rect.height - 1) * fmt->fmt.pix.bytesperline + rect.width * 2;
+    fmt->fmt.pix.width = rect.width;
+    fmt->fmt.pix.height = rect.height;
+    fmt->fmt.pix.sizeimage = span;
+    syslog(LOG_INFO, "ROI -- %ux%u+%d+%d in software, %s\n",
+           rect.width, rect.height, rect.left, rect.top, fallback_reason);
+    return 0;
+}
+
+/**
+ * @brief Where the region starts in a capture buffer.
+ */
+void *roi_frame(void *start)
+{
+    return in_software ? (unsigned char *)start + offset : start;
+}
+
+/**
+ * @brief Bytes of the region present in a buffer holding bytesused bytes.
+ */
+int roi_size(int bytesused)
+{
+    if (!in_software)
+        return bytesused;
+    if ((size_t)bytesused <= offset)
+        return 0;
+    return (size_t)bytesused - offset < span ? (int)((size_t)bytesused - offset) : (int)span;
+}
+
+void roi_report(void)
+{
+    if (!enabled || !sensor_width)
+        return;
+
+    syslog(LOG_INFO, "ROI -- %ux%u+%d+%d, %.1lf%% of the %dx%d frame, %s\n",
+           rect.width, rect.height, rect.left, rect.top,
+           100.0 * rect.width * rect.height / ((double)sensor_width * sensor_height), sensor_width, sensor_height,
+           in_software ? "software" : crop_method);
+}
@@ -0,0 +1,32 @@
+/*
+ *  Region of interest: only a band or box of the sensor image is kept.
+ *
+ *  --roi WxH+X+Y (X11 geometry, the offset defaults to +0+0). X and W
+ *  must be even because YUYV pixel pairs share chroma.
+ *
+ *  roi_apply() first asks the driver to crop. It uses VIDIOC_S_SELECTION
+ *  (VIDIOC_S_CROP on older drivers), then sets the format to the crop
+ *  size so the region is not scaled back up. If that works, the driver
+ *  delivers only the region and the capture buffers shrink with it.
+ *
+ *  If the driver refuses the crop, rounds the rectangle, or will not give
+ *  the matching format, the crop is reset and the ROI is done in
+ *  software. The full frame is still captured. The format the rest of
+ *  the program sees is narrowed to the ROI: each frame is handed on from
+ *  the ROI's first pixel, and its lines keep the full bytesperline. The
+ *  transform then reads only ROI lines. In both cases every output buffer
+ *  and PPM header is sized from the ROI.
+ */
+#ifndef ROI_H
+#define ROI_H
+
+#include <linux/videodev2.h>
+
+int roi_parse(const char *spec);
+int roi_enabled(void);
+int roi_apply(int fd, struct v4l2_format *fmt);
+void *roi_frame(void *start);
+int roi_size(int bytesused);
+void roi_report(void);
+
+#endif /* ROI_H */
@@ -0,0 +1,215 @@
+/*
+ *  Preallocated archive segments, see segment.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "segment.h"
+#include "durable.h"
+
+#define MAGIC_LEN       (8)
+#define END_MARKER      (48)    /* covers a record header of either archive format */
+
+static int enabled;
+static char path_template[PATH_MAX];
+static int path_index_offset;
+static char file_magic[MAGIC_LEN];
+static unsigned long long seg_size;
+static int n_segments, current = -1;
+static int fd = -1;
+static unsigned long long used;
+
+static unsigned long rotations, bytes_lost;
+
+
+static const char *segment_path(int index)
+{
+    char suffix[32];
+
+    // index digits are patched in place, the extension follows them
+    snprintf(suffix, sizeof(suffix), "%04d", index);
+    memcpy(path_template + path_index_offset, suffix, 4);
+    return path_template;
+}
+
+/**
+ * @brief Creates and preallocates every segment, and picks the oldest to write first.
+ *
+ * @param directory Existing directory for the segment files.
+ * @param extension File extension, e.g. "yuyv".
+ * @param magic The archive's 8 byte file magic, written at the start of each segment.
+ * @param quota Disk budget in bytes.
+ * @param segment_size Bytes per segment.
+ * @return 0 on success, -1 on failure.
+ */
+int segment_init(const char *directory, const char *extension, const char *magic,
+                 unsigned long long quota, unsigned long long segment_size)
+{
+    struct stat st;
+    time_t oldest = 0;
+    int i, f;
+
+    if (segment_size <= MAGIC_LEN + END_MARKER || quota < 2 * segment_size)
+    {
+        syslog(LOG_ERR, "quota must hold at least two segments");
+        return -1;
+    }
+
+    seg_size = segment_size;
+    n_segments = (int)(quota / segment_size);
+    memcpy(file_magic, magic, MAGIC_LEN);
+    path_index_offset = snprintf(path_template, sizeof(path_template), "%s/seg", directory);
+    snprintf(path_template + path_index_offset, sizeof(path_template) - path_index_offset,
+             "0000.%s", extension);
+
+    for (i = 0; i < n_segments; i++)
+    {
+        f = open(segment_path(i), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+        if (f < 0)
+        {
+            syslog(LOG_ERR, "Failed to create %s: %s", path_template, strerror(errno));
+            return -1;
+        }
+
+        // Zero filled and full size, so first-cycle readers stop at the unwritten part
+        if (fallocate(f, 0, 0, seg_size) < 0)
+        {
+            syslog(LOG_ERR, "Failed to preallocate %s: %s", path_template, strerror(errno));
+            close(f);
+            return -1;
+        }
+
+        // Start with the segment touched longest ago, keeping the newest of a previous run
+        if (fstat(f, &st) == 0 && (current < 0 || st.st_mtime < oldest))
+        {
+            oldest = st.st_mtime;
+            current = i;
+        }
+        close(f);
+    }
+
+    current = (current + n_segments - 1) % n_segments;
+    used = seg_size;    // forces the first segment_need() to open it
+    enabled = 1;
+    syslog(LOG_INFO, "Segments -- %d x %llu bytes preallocated in %s\n", n_segments, seg_size, directory);
+    return 0;
+}
+
+int segment_enabled(void)
+{
+    return enabled;
+}
+
+/**
+ * @brief Makes room for the next record, moving to the next segment if it does not fit.
+ *
+ * @param bytes Largest number of bytes the record may take.
+ * @param calls Incremented by the syscalls a rotation costs.
+ * @return 1 if a new segment was started, 0 if the record fits, -1 on failure
+ *         or if the record is larger than a segment.
+ */
+int segment_need(size_t bytes, int *calls)
+{
+    static const char zeros[END_MARKER];
+    ssize_t n;
+
+    if (used + bytes <= seg_size)
+        return 0;
+
+    // A fresh segment would not hold it either, and the segment cannot grow past its preallocated size
+    if (MAGIC_LEN + bytes > seg_size)
+    {
+        syslog(LOG_ERR, "%zu byte record does not fit a %llu byte segment", bytes, seg_size);
+        return -1;
+    }
+
+    if (fd >= 0)
+    {
+        // Mark the end so a reader does not run into last cycle's records
+        if (seg_size - used >= END_MARKER)
+        {
+            n = write(fd, zeros, END_MARKER);
+            (*calls)++;
+            if (n == END_MARKER)
+                durable_written(fd, used, END_MARKER);
+        }
+        bytes_lost += seg_size - used;
+        close(fd);
+        (*calls)++;
+    }
+
+    current = (current + 1) % n_segments;
+    fd = open(segment_path(current), O_WRONLY | O_CLOEXEC);
+    (*calls)++;
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "Failed to open %s: %s", path_template, strerror(errno));
+        return -1;
+    }
+
+    if (write(fd, file_magic, MAGIC_LEN) != MAGIC_LEN)
+    {
+        syslog(LOG_ERR, "Failed to write %s: %s", path_template, strerror(errno));
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+    (*calls)++;
+
+    durable_written(fd, 0, MAGIC_LEN);
+    used = MAGIC_LEN;
+    rotations++;
+    return 1;
+}
+
+// Positioned at the end of the records written so far
+int segment_fd(void)
+{
+    return fd;
+}
+
+// Where segment_fd() is positioned, in the current segment
+off_t segment_offset(void)
+{
+    return (off_t)used;
+}
+
+void segment_wrote(size_t bytes)
+{
+    used += bytes;
+}
+
+void segment_close(void)
+{
+    static const char zeros[END_MARKER];
+    ssize_t n;
+
+    if (fd >= 0)
+    {
+        if (seg_size - used >= END_MARKER)
+        {
+            n = write(fd, zeros, END_MARKER);
+            if (n == END_MARKER)
+                durable_written(fd, used, END_MARKER);
+        }
+        close(fd);
+    }
+    fd = -1;
+}
+
+void segment_report(void)
+{
+    if (!enabled)
+        return;
+
+    syslog(LOG_INFO, "Segments -- %d of %llu bytes, %lu segment switches, %lu bytes left unused at segment ends\n",
+           n_segments, seg_size, rotations, bytes_lost);
+}
@@ -0,0 +1,32 @@
+/*
+ *  Fixed set of preallocated archive segments, reused oldest first.
+ *
+ *  For continuous capture the raw and delta archives are split into
+ *  quota / segment_size files, all created and fallocate()d to full
+ *  size at start-up. Segments are then overwritten in place, never
+ *  truncated, so steady-state writeback only writes into extents that
+ *  already exist, and disk usage is fixed at the quota. Only the segment
+ *  being written is open.
+ *
+ *  Each segment starts with the archive's file magic. A zeroed record
+ *  header (the preallocated contents, or a marker written when a
+ *  segment is left) ends the valid records; readers also stop when
+ *  timestamps go backwards into a previous cycle's leftovers.
+ */
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+int segment_init(const char *directory, const char *extension, const char *magic,
+                 unsigned long long quota, unsigned long long segment_size);
+int segment_enabled(void);
+int segment_need(size_t bytes, int *calls);
+int segment_fd(void);
+off_t segment_offset(void);
+void segment_wrote(size_t bytes);
+void segment_close(void);
+void segment_report(void);
+
+#endif /* SEGMENT_H */
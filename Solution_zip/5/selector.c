@@ -0,0 +1,159 @@
+/*
+ *  Time-lapse frame selector.
+ *
+ *  score = sharpness - CHANGE_WEIGHT * change from the previous frame
+ *
+ *  A frame caught mid-transition (auto exposure step, someone walking
+ *  through, camera bump) differs strongly from its predecessor and is
+ *  usually blurred as well, so both terms push it down.
+ */
+
+#include <stdio.h>
+#include <syslog.h>
+
+#include "selector.h"
+#include "luma.h"
+#include "metrics.h"
+
+#define SAMPLE_ROW_STEP (4)
+#define CHANGE_WEIGHT   (1.0)
+
+static int enabled;
+static double period;
+static struct timespec origin;
+static struct luma_sample samples[2];
+static int current_sample;
+static int have_previous;
+
+static int candidate = -1;
+static long candidate_period;
+static double candidate_score;
+
+static unsigned long offered, emitted;
+static double score_time, score_time_max;
+
+
+static double elapsed(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Enables selection of one frame per 1/rate_hz seconds.
+ *
+ * @return 0 on success, -1 if the luma samples could not be allocated.
+ */
+int selector_init(double rate_hz, int width, int height)
+{
+    if (rate_hz <= 0)
+        return -1;
+
+    if (luma_sample_init(&samples[0], width, height, SAMPLE_ROW_STEP) < 0 ||
+        luma_sample_init(&samples[1], width, height, SAMPLE_ROW_STEP) < 0)
+        return -1;
+
+    period = 1.0 / rate_hz;
+    enabled = 1;
+    return 0;
+}
+
+int selector_enabled(void)
+{
+    return enabled;
+}
+
+/**
+ * @brief Scores a newly dequeued buffer against the current period's candidate.
+ *
+ * @param index V4L2 buffer index of the new frame.
+ * @param yuyv Its data.
+ * @param stride Bytes per line.
+ * @param when Dequeue time, CLOCK_MONOTONIC.
+ * @param emit Set to the buffer to transform and write now (the best of a closed period), or -1.
+ * @param release Set to a buffer that lost and can be requeued untouched, or -1.
+ */
+void selector_offer(int index, const void *yuyv, int stride, const struct timespec *when,
+                    int *emit, int *release)
+{
+    struct luma_sample *cur = &samples[current_sample];
+    struct luma_sample *prev = &samples[current_sample ^ 1];
+    struct timespec t0, t1;
+    double score, cost;
+    long this_period;
+
+    *emit = -1;
+    *release = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    luma_sample_take(cur, yuyv, stride);
+    score = luma_sharpness(cur);
+    if (have_previous)
+        score -= CHANGE_WEIGHT * luma_mean_abs_diff(cur, prev);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    cost = elapsed(&t0, &t1);
+    score_time += cost;
+    if (cost > score_time_max)
+        score_time_max = cost;
+
+    current_sample ^= 1;
+    have_previous = 1;
+
+    if (offered++ == 0)
+        origin = *when;
+    this_period = (long)(elapsed(&origin, when) / period);
+
+    if (candidate < 0)
+    {
+        candidate = index;
+        candidate_period = this_period;
+        candidate_score = score;
+        return;
+    }
+
+    if (this_period != candidate_period)
+    {
+        // Period closed, its best frame goes out and the new frame opens the next one
+        *emit = candidate;
+        emitted++;
+        candidate = index;
+        candidate_period = this_period;
+        candidate_score = score;
+        return;
+    }
+
+    metrics_count(METRIC_FRAMES_SKIPPED_SELECTOR, 1);
+    if (score > candidate_score)
+    {
+        *release = candidate;
+        candidate = index;
+        candidate_score = score;
+    }
+    else
+        *release = index;
+}
+
+/**
+ * @brief Hands over the candidate of the period still open, at the end of capture.
+ *
+ * @return The buffer to transform and write, or -1 if there is none.
+ */
+int selector_flush(void)
+{
+    int index = candidate;
+
+    if (candidate >= 0)
+        emitted++;
+    candidate = -1;
+    return index;
+}
+
+void selector_report(void)
+{
+    if (!enabled)
+        return;
+
+    syslog(LOG_INFO, "Selector -- %lu frames scored, %lu emitted at %lf s period, "
+           "scoring mean %lf s, worst %lf s\n",
+           offered, emitted, period, offered ? score_time / offered : 0.0, score_time_max);
+}
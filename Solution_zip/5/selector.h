@@ -0,0 +1,22 @@
+/*
+ *  Stable-frame selection for low rate (time-lapse) acquisition.
+ *
+ *  Instead of keeping whichever frame lands on the tick, every frame of
+ *  a period is scored on luma sharpness and on how much it differs from
+ *  the frame before it. The best candidate's buffer is kept dequeued
+ *  until its period closes, so only one frame per period is transformed
+ *  and written and losers are requeued without any copy.
+ */
+#ifndef SELECTOR_H
+#define SELECTOR_H
+
+#include <time.h>
+
+int selector_init(double rate_hz, int width, int height);
+int selector_enabled(void);
+void selector_offer(int index, const void *yuyv, int stride, const struct timespec *when,
+                    int *emit, int *release);
+int selector_flush(void);
+void selector_report(void);
+
+#endif /* SELECTOR_H */
@@ -0,0 +1,44 @@
+/*
+ *  Portable 16 byte vector helpers on top of GCC vector extensions.
+ *
+ *  These compile to SSE2 on x86 and NEON on ARM. Loads go through
+ *  memcpy so any alignment is fine; the compiler turns them into single
+ *  unaligned loads.
+ */
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <string.h>
+
+typedef unsigned char v16u8 __attribute__((vector_size(16)));
+typedef unsigned short v8u16 __attribute__((vector_size(16)));
+
+static inline v16u8 load16(const unsigned char *p)
+{
+    v16u8 v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline v16u8 absdiff16(v16u8 a, v16u8 b)
+{
+    v16u8 gt = (v16u8)(a > b);
+
+    return ((a - b) & gt) | ((b - a) & ~gt);
+}
+
+// Adds the 16 byte lanes pairwise into 8 lanes of 16 bits
+static inline v8u16 widen_add(v8u16 acc, v16u8 d)
+{
+    v8u16 w = (v8u16)d;
+
+    return acc + (w & 0x00ff) + (w >> 8);
+}
+
+static inline unsigned long reduce16(v8u16 acc)
+{
+    return (unsigned long)acc[0] + acc[1] + acc[2] + acc[3] + acc[4] + acc[5] + acc[6] + acc[7];
+}
+
+#endif /* SIMD_H */
@@ -0,0 +1,438 @@
+/*
+ *  Frame stream to stdout, see stream.h.
+ *
+ *  Frames handed to the pipe by reference are tracked in a FIFO with the
+ *  stream offset at which they end. The reader has consumed everything
+ *  up to (bytes queued - FIONREAD), so an entry whose end is at or
+ *  below that offset is no longer referenced by the pipe.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "stream.h"
+#include "convert.h"
+#include "trace.h"
+
+#define STREAM_MAX_HELD     (16)
+#define STREAM_PIPE_FRAMES  (4)     /* pipe capacity asked for, in frames */
+#define STREAM_MAX_ROWS     (1024)  /* per-line vectors for padded strides, within IOV_MAX */
+#define DRAIN_POLL_NS       (200000)
+
+struct held
+{
+    const void *buffer;
+    unsigned long long end;
+};
+
+static int enabled, broken;
+static enum stream_format format;
+static int out_fd = -1;
+static int is_pipe, use_splice;
+static int pipe_size;
+static int frame_width, frame_height, frame_stride;
+static size_t frame_bytes;
+
+static struct held held[STREAM_MAX_HELD];
+static int held_head, held_count, held_limit;
+static unsigned long long queued;
+
+static unsigned char *staging;
+static int n_slots, next_slot;
+
+static unsigned long frames, spliced_frames, copied_frames, stalls, short_frames;
+static double stall_time, stall_max, push_time;
+static struct timespec first_frame, last_frame;
+
+
+static double seconds_between(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static void note_stall(const struct timespec *start)
+{
+    struct timespec end;
+    double waited;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    waited = seconds_between(start, &end);
+    stall_time += waited;
+    if (waited > stall_max)
+        stall_max = waited;
+    stalls++;
+}
+
+// Stream offset up to which the reader has taken the data
+static unsigned long long consumed(void)
+{
+    int unread;
+
+    if (!is_pipe || ioctl(out_fd, FIONREAD, &unread) < 0)
+        return queued;
+    return queued - unread;
+}
+
+// Blocks until the oldest held entry has been read, counting the wait as a stall
+static void drain_oldest(void)
+{
+    struct timespec start, nap = { 0, DRAIN_POLL_NS };
+
+    if (!held_count || held[held_head].end <= consumed())
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (held[held_head].end > consumed())
+        nanosleep(&nap, NULL);
+    note_stall(&start);
+}
+
+static void hold(const void *buffer)
+{
+    held[(held_head + held_count) % STREAM_MAX_HELD].buffer = buffer;
+    held[(held_head + held_count) % STREAM_MAX_HELD].end = queued;
+    held_count++;
+}
+
+static int stream_held(const void *buffer)
+{
+    int k;
+
+    for (k = 0; k < held_count; k++)
+        if (held[(held_head + k) % STREAM_MAX_HELD].buffer == buffer)
+            return 1;
+    return 0;
+}
+
+static void drop_oldest(void)
+{
+    held_head = (held_head + 1) % STREAM_MAX_HELD;
+    held_count--;
+}
+
+/**
+ * @brief Moves vectors into the pipe by reference, or copies them when that is not possible.
+ *
+ * @return 1 if the data was spliced (the pipe now references it), 0 if copied, -1 on failure.
+ */
+static int push(struct iovec *iov, int iovcnt)
+{
+    struct pollfd pfd = { .fd = out_fd, .events = POLLOUT };
+    struct timespec start;
+    int idx = 0, spliced = use_splice;
+    ssize_t n;
+
+    while (idx < iovcnt)
+    {
+        if (use_splice)
+            n = vmsplice(out_fd, &iov[idx], iovcnt - idx, SPLICE_F_NONBLOCK);
+        else
+            n = writev(out_fd, &iov[idx], iovcnt - idx);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                // Pipe full, wait for the reader
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                poll(&pfd, 1, -1);
+                note_stall(&start);
+                continue;
+            }
+            if (use_splice && idx == 0 && (errno == EFAULT || errno == EINVAL))
+            {
+                // Some drivers' buffers cannot be pinned, copy from here on
+                syslog(LOG_WARNING, "stream: vmsplice not possible (%s), copying frames\n", strerror(errno));
+                use_splice = spliced = 0;
+                continue;
+            }
+            if (errno == EPIPE)
+                syslog(LOG_ERR, "stream: reader went away\n");
+            else
+                syslog(LOG_ERR, "stream write failed: %s\n", strerror(errno));
+            broken = 1;
+            return -1;
+        }
+
+        queued += n;
+        while (idx < iovcnt && (size_t)n >= iov[idx].iov_len)
+        {
+            n -= iov[idx].iov_len;
+            idx++;
+        }
+        if (idx < iovcnt)
+        {
+            iov[idx].iov_base = (char *)iov[idx].iov_base + n;
+            iov[idx].iov_len -= n;
+        }
+    }
+
+    return spliced;
+}
+
+/**
+ * @brief Takes over stdout for the stream and writes the stream header.
+ *
+ * @param stream_format Y4M or bare YUYV.
+ * @param width Pixels per line.
+ * @param height Lines per frame.
+ * @param stride Bytes per line in the capture buffers.
+ * @param fps Frame rate written to the Y4M header.
+ * @param max_held Capture buffers the stream may keep from the driver at once.
+ * @return 0 on success, -1 on failure.
+ */
+int stream_open(enum stream_format stream_format, int width, int height, int stride, double fps,
+                int max_held)
+{
+    char header[128];
+    struct iovec iov;
+    struct stat st;
+    FILE *fp;
+    int i, len;
+
+    format = stream_format;
+    frame_width = width;
+    frame_height = height;
+    frame_stride = stride;
+    frame_bytes = (size_t)width * height * 2;
+
+    fflush(stdout);
+    out_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    if (out_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+    {
+        syslog(LOG_ERR, "stream: cannot take over stdout: %s\n", strerror(errno));
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    is_pipe = fstat(out_fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    use_splice = is_pipe;
+    if (is_pipe)
+    {
+        // Room for a few frames lets the reader fall behind briefly without stalling capture
+        if (fcntl(out_fd, F_SETPIPE_SZ, (int)(frame_bytes * STREAM_PIPE_FRAMES)) < 0)
+        {
+            // Unprivileged, so take the largest pipe allowed
+            fp = fopen("/proc/sys/fs/pipe-max-size", "r");
+            if (fp && fscanf(fp, "%d", &i) == 1)
+                fcntl(out_fd, F_SETPIPE_SZ, i);
+            if (fp)
+                fclose(fp);
+        }
+        pipe_size = fcntl(out_fd, F_GETPIPE_SZ);
+    }
+
+    if (format == STREAM_Y4M)
+    {
+        // Everything still in the pipe fits in pipe_size bytes, so one slot more than that is never waited on
+        n_slots = (pipe_size > 0 ? pipe_size / frame_bytes : 0) + 2;
+        if (n_slots > STREAM_MAX_HELD)
+            n_slots = STREAM_MAX_HELD;
+        staging = malloc(n_slots * frame_bytes);
+        if (!staging)
+            return -1;
+        memset(staging, 0, n_slots * frame_bytes);
+
+        len = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1000 Ip A1:1 C422\n",
+                       width, height, (int)(fps * 1000 + 0.5));
+        iov.iov_base = header;
+        iov.iov_len = len;
+        use_splice = 0;     // header is on the stack
+        i = push(&iov, 1);
+        use_splice = is_pipe;
+        if (i < 0)
+            return -1;
+    }
+    else
+    {
+        held_limit = max_held < STREAM_MAX_HELD ? max_held : STREAM_MAX_HELD;
+        if (held_limit < 1)
+            use_splice = 0;
+        if (height > STREAM_MAX_ROWS && stride != width * 2)
+        {
+            syslog(LOG_ERR, "stream: %d padded lines is more than one vector per line allows\n", height);
+            return -1;
+        }
+    }
+
+    enabled = 1;
+    syslog(LOG_INFO, "Stream -- %s %dx%d to stdout, %s, pipe %d bytes\n",
+           format == STREAM_Y4M ? "y4m" : "raw yuyv", width, height,
+           use_splice ? "vmsplice" : "copying", pipe_size);
+    return 0;
+}
+
+int stream_enabled(void)
+{
+    return enabled;
+}
+
+/**
+ * @brief Sends one frame down the stream.
+ *
+ * @param yuyv Frame as captured.
+ * @param size Bytes in the frame.
+ * @param tag Frame number, for the trace.
+ * @param time Frame timestamp.
+ * A frame shorter than a whole image (a driver error frame, or a
+ * truncated bytesused) is counted and skipped, the stream goes on.
+ *
+ * @return 1 if the stream keeps a reference to yuyv (see stream_holds()), 0 if not,
+ *         -1 once the stream is broken and capture should stop.
+ */
+int stream_frame(const unsigned char *yuyv, int size, unsigned int tag, const struct timespec *time)
+{
+    static const char frame_header[] = "FRAME\n";
+    static struct iovec iov[STREAM_MAX_ROWS + 1];
+    struct timespec start, end;
+    unsigned char *slot;
+    int iovcnt = 0, row, rc;
+
+    if (broken)
+        return -1;
+    if ((size_t)size < (size_t)frame_stride * (frame_height - 1) + frame_width * 2)
+    {
+        if (!short_frames++)
+            syslog(LOG_WARNING, "stream: skipping short frame %u, %d bytes\n", tag, size);
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (format == STREAM_Y4M)
+    {
+        slot = staging + (size_t)next_slot * frame_bytes;
+        next_slot = (next_slot + 1) % n_slots;
+
+        // Held slots are in round robin order, so waiting on the oldest ones frees this one
+        while (stream_held(slot))
+        {
+            drain_oldest();
+            drop_oldest();
+        }
+
+        yuyv_to_planar422(yuyv, frame_width, frame_height, frame_stride, slot,
+                          slot + (size_t)frame_width * frame_height,
+                          slot + (size_t)frame_width * frame_height * 3 / 2);
+
+        iov[0].iov_base = (void *)frame_header;
+        iov[0].iov_len = sizeof(frame_header) - 1;
+        iov[1].iov_base = slot;
+        iov[1].iov_len = frame_bytes;
+        rc = push(iov, 2);
+        if (rc > 0)
+            hold(slot);
+    }
+    else
+    {
+        // The capture thread gets the buffer back through stream_reclaim()
+        if (use_splice && held_count == held_limit)
+            drain_oldest();
+
+        if (frame_stride == frame_width * 2)
+        {
+            iov[0].iov_base = (void *)yuyv;
+            iov[0].iov_len = frame_bytes;
+            iovcnt = 1;
+        }
+        else
+        {
+            for (row = 0; row < frame_height; row++)
+            {
+                iov[row].iov_base = (void *)(yuyv + (size_t)row * frame_stride);
+                iov[row].iov_len = frame_width * 2;
+            }
+            iovcnt = frame_height;
+        }
+        rc = push(iov, iovcnt);
+        if (rc > 0)
+            hold(yuyv);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (rc < 0)
+        return -1;
+
+    if (!frames)
+        first_frame = *time;
+    last_frame = *time;
+    frames++;
+    if (rc > 0)
+        spliced_frames++;
+    else
+        copied_frames++;
+    push_time += seconds_between(&start, &end);
+    trace_span("stream", &start, &end, tag, -1);
+
+    return format == STREAM_RAW && rc > 0;
+}
+
+/**
+ * @brief Tells whether a capture buffer is still referenced by the pipe.
+ */
+int stream_holds(const void *buffer)
+{
+    return format == STREAM_RAW && stream_held(buffer);
+}
+
+/**
+ * @brief Returns the next held capture buffer the reader has finished with.
+ *
+ * @return The buffer, which may be queued to the driver again, or NULL.
+ */
+const void *stream_reclaim(void)
+{
+    const void *buffer;
+
+    if (format != STREAM_RAW || !held_count || held[held_head].end > consumed())
+        return NULL;
+
+    buffer = held[held_head].buffer;
+    drop_oldest();
+    return buffer;
+}
+
+/**
+ * @brief Closes the stream; the reader sees end of file once it has drained the pipe.
+ */
+void stream_close(void)
+{
+    if (!enabled)
+        return;
+
+    // The pipe keeps its own page references, so buffers can be unmapped behind it
+    close(out_fd);
+    out_fd = -1;
+    held_count = 0;
+    free(staging);
+    staging = NULL;
+    enabled = 0;
+}
+
+void stream_report(void)
+{
+    double elapsed = seconds_between(&first_frame, &last_frame);
+
+    if (!frames && !short_frames)
+        return;
+
+    syslog(LOG_INFO, "Stream -- %lu frames, %llu bytes, %.2lf MB/s, %lu spliced, %lu copied, "
+           "%lu short frames skipped%s\n",
+           frames, queued, elapsed > 0 ? queued / elapsed / (1024.0 * 1024.0) : 0.0,
+           spliced_frames, copied_frames, short_frames, broken ? ", reader went away" : "");
+    syslog(LOG_INFO, "Stream -- %.3lf ms per frame handing off, %lu stalls, %.3lf s stalled, worst %.3lf ms\n",
+           frames ? push_time / frames * 1000.0 : 0.0, stalls, stall_time, stall_max * 1000.0);
+}
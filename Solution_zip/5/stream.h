@@ -0,0 +1,43 @@
+/*
+ *  Frame stream to stdout (-o).
+ *
+ *  Frames go to stdout as Y4M (planar 4:2:2, readable by ffmpeg, x264
+ *  and friends) or as bare YUYV, instead of being written to disk. When
+ *  stdout is a pipe they are vmsplice()d. The pipe then references the
+ *  pages instead of copying them:
+ *
+ *    raw  the capture buffer itself is spliced; the buffer stays out of
+ *         the driver queue until the reader has taken the frame
+ *    y4m  frames are split into planes in a small staging ring, and a
+ *         staging slot is only reused once the reader has taken it
+ *
+ *  How far the reader has got comes from FIONREAD on the pipe. When
+ *  stdout is not a pipe (a file or a terminal) frames are written
+ *  normally. Time spent waiting for the reader to make room is counted
+ *  as stall time.
+ *
+ *  Once the stream is open, anything else printed to stdout goes to
+ *  stderr instead, so it cannot corrupt the stream.
+ */
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include <time.h>
+
+enum stream_format
+{
+    STREAM_Y4M,
+    STREAM_RAW,
+};
+
+int stream_open(enum stream_format format, int width, int height, int stride, double fps,
+                int max_held);
+int stream_enabled(void);
+int stream_frame(const unsigned char *yuyv, int size, unsigned int tag, const struct timespec *time);
+int stream_holds(const void *buffer);
+const void *stream_reclaim(void);
+void stream_close(void);
+void stream_report(void);
+
+#endif /* STREAM_H */
@@ -0,0 +1,134 @@
+/*
+ *  Chrome trace event export of capture stage spans.
+ *
+ *  Each span is a complete ("ph":"X") event with its start and duration
+ *  in microseconds of CLOCK_MONOTONIC, the kernel thread id of the
+ *  thread that ran it, and the frame number in its args. The file is a
+ *  JSON object with one event per line, which keeps it easy to grep
+ *  and lets the report tool parse it without a JSON library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#define TRACE_STDIO_BUFFER (1024 * 1024)
+
+static FILE *trace_fp;
+static char *trace_buffer;
+static int trace_pid;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread int thread_id;
+
+static int current_tid(void)
+{
+    if (thread_id == 0)
+        thread_id = (int)syscall(SYS_gettid);
+    return thread_id;
+}
+
+static double to_us(const struct timespec *t)
+{
+    return (double)t->tv_sec * 1e6 + (double)t->tv_nsec / 1e3;
+}
+
+/**
+ * @brief Opens the trace file and writes the JSON preamble.
+ *
+ * @param path Output file, conventionally ending in .json.
+ * @return 0 on success, -1 if the file could not be created.
+ */
+int trace_open(const char *path)
+{
+    trace_fp = fopen(path, "w");
+    if (!trace_fp)
+    {
+        syslog(LOG_ERR, "trace open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    trace_buffer = malloc(TRACE_STDIO_BUFFER);
+    if (trace_buffer)
+        setvbuf(trace_fp, trace_buffer, _IOFBF, TRACE_STDIO_BUFFER);
+
+    trace_pid = (int)getpid();
+    fprintf(trace_fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(trace_fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"capture\"}}",
+            trace_pid);
+    fprintf(trace_fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"capture\"}}",
+            trace_pid, current_tid());
+
+    return 0;
+}
+
+void trace_close(void)
+{
+    if (!trace_fp)
+        return;
+
+    fprintf(trace_fp, "\n]}\n");
+    fclose(trace_fp);
+    trace_fp = NULL;
+    free(trace_buffer);
+    trace_buffer = NULL;
+}
+
+int trace_enabled(void)
+{
+    return trace_fp != NULL;
+}
+
+/**
+ * @brief Records one completed stage span.
+ *
+ * @param name Stage name shown on the timeline.
+ * @param start Stage start, CLOCK_MONOTONIC.
+ * @param end Stage end, CLOCK_MONOTONIC.
+ * @param frame Frame number the stage worked on.
+ * @param buffer_index V4L2 buffer index, or -1 when not applicable.
+ */
+void trace_span(const char *name, const struct timespec *start, const struct timespec *end,
+                int frame, int buffer_index)
+{
+    double ts;
+
+    if (!trace_fp)
+        return;
+
+    ts = to_us(start);
+    pthread_mutex_lock(&trace_lock);
+    fprintf(trace_fp,
+            ",\n{\"name\":\"%s\",\"cat\":\"capture\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":%d,\"tid\":%d,\"args\":{\"frame\":%d,\"buffer\":%d}}",
+            name, ts, to_us(end) - ts, trace_pid, current_tid(), frame, buffer_index);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * @brief Records a point event, such as a detected frame drop.
+ *
+ * @param name Event name shown on the timeline.
+ * @param when Event time, CLOCK_MONOTONIC.
+ * @param frame Frame number the event relates to.
+ * @param value Event specific value, stored in args.
+ */
+void trace_instant(const char *name, const struct timespec *when, int frame, long value)
+{
+    if (!trace_fp)
+        return;
+
+    pthread_mutex_lock(&trace_lock);
+    fprintf(trace_fp,
+            ",\n{\"name\":\"%s\",\"cat\":\"capture\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+            "\"pid\":%d,\"tid\":%d,\"args\":{\"frame\":%d,\"value\":%ld}}",
+            name, to_us(when), trace_pid, current_tid(), frame, value);
+    pthread_mutex_unlock(&trace_lock);
+}
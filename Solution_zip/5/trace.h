@@ -0,0 +1,21 @@
+/*
+ *  Per-frame stage spans written as Chrome trace event JSON, which
+ *  loads directly into chrome://tracing and ui.perfetto.dev.
+ *
+ *  Events are streamed one per line through a large stdio buffer so a
+ *  run of any length can be traced without holding it in memory.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <time.h>
+
+int trace_open(const char *path);
+void trace_close(void);
+int trace_enabled(void);
+
+void trace_span(const char *name, const struct timespec *start, const struct timespec *end,
+                int frame, int buffer_index);
+void trace_instant(const char *name, const struct timespec *when, int frame, long value);
+
+#endif /* TRACE_H */
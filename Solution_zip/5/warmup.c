@@ -0,0 +1,176 @@
+/*
+ *  Warm-up detection from histogram convergence and interval stability.
+ *
+ *  A frame counts as settled when the L1 distance between its normalised
+ *  32-bin luma histogram and the previous frame's is below
+ *  HIST_TOLERANCE, and its driver timestamp interval is within
+ *  INTERVAL_TOLERANCE of the smoothed interval. SETTLED_FRAMES settled
+ *  frames in a row end the warm-up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "warmup.h"
+#include "luma.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define HIST_SHIFT          (3)
+#define HIST_BINS           (256 >> HIST_SHIFT)
+#define HIST_TOLERANCE      (0.05)
+#define INTERVAL_TOLERANCE  (0.15)
+#define SETTLED_FRAMES      (3)
+#define SAMPLE_ROW_STEP     (8)
+
+static int enabled;
+static int done;
+static double timeout;
+static struct timespec stream_on, first_good;
+static struct luma_sample sample;
+static unsigned int hist[2][HIST_BINS];
+static int current_hist;
+static int have_previous;
+static double last_driver_time;
+static double interval_avg;
+static int settled;
+static unsigned long discarded;
+static int timed_out;
+static double last_hist_distance;
+
+
+static double seconds_between(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Enables adaptive warm-up.
+ *
+ * @param timeout_s Give up waiting and accept frames after this long since STREAMON.
+ * @return 0 on success, -1 if the luma sample could not be allocated.
+ */
+int warmup_init(int width, int height, double timeout_s)
+{
+    if (luma_sample_init(&sample, width, height, SAMPLE_ROW_STEP) < 0)
+        return -1;
+
+    timeout = timeout_s;
+    enabled = 1;
+    return 0;
+}
+
+// Call right after STREAMON, time-to-first-good-frame is measured from here
+void warmup_start(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &stream_on);
+}
+
+int warmup_enabled(void)
+{
+    return enabled;
+}
+
+int warmup_done(void)
+{
+    return !enabled || done;
+}
+
+static int histogram_settled(void)
+{
+    unsigned int *cur = hist[current_hist], *prev = hist[current_hist ^ 1];
+    double total = (double)sample.rows * sample.width, distance = 0;
+    int i;
+
+    luma_histogram(&sample, cur, HIST_SHIFT);
+    current_hist ^= 1;
+
+    if (!have_previous)
+        return 0;
+
+    for (i = 0; i < HIST_BINS; i++)
+        distance += abs((int)cur[i] - (int)prev[i]);
+    last_hist_distance = distance / total;
+
+    return last_hist_distance < HIST_TOLERANCE;
+}
+
+static int interval_settled(const struct timeval *driver_time)
+{
+    double t = driver_time->tv_sec + driver_time->tv_usec / 1e6;
+    double interval;
+    int ok = 0;
+
+    if (have_previous)
+    {
+        interval = t - last_driver_time;
+        if (interval_avg > 0)
+        {
+            ok = interval > 0 && (interval - interval_avg < INTERVAL_TOLERANCE * interval_avg) &&
+                 (interval_avg - interval < INTERVAL_TOLERANCE * interval_avg);
+            interval_avg = 0.75 * interval_avg + 0.25 * interval;
+        }
+        else
+            interval_avg = interval;
+    }
+    last_driver_time = t;
+    return ok;
+}
+
+/**
+ * @brief Judges one frame during warm-up.
+ *
+ * @param yuyv Frame data.
+ * @param stride Bytes per line.
+ * @param driver_time Driver capture timestamp of the frame.
+ * @param now Dequeue time, CLOCK_MONOTONIC.
+ * @return 1 if this frame is the first good one (warm-up is over), 0 to discard it.
+ */
+int warmup_offer(const void *yuyv, int stride, const struct timeval *driver_time,
+                 const struct timespec *now)
+{
+    int hist_ok, interval_ok;
+
+    if (warmup_done())
+        return 1;
+
+    luma_sample_take(&sample, yuyv, stride);
+    hist_ok = histogram_settled();
+    interval_ok = interval_settled(driver_time);
+    have_previous = 1;
+
+    settled = (hist_ok && interval_ok) ? settled + 1 : 0;
+
+    if (settled < SETTLED_FRAMES && seconds_between(&stream_on, now) < timeout)
+    {
+        discarded++;
+        metrics_count(METRIC_FRAMES_SKIPPED_WARMUP, 1);
+        return 0;
+    }
+
+    timed_out = settled < SETTLED_FRAMES;
+    done = 1;
+    first_good = *now;
+    trace_instant("warm", now, 0, (long)discarded);
+    luma_sample_free(&sample);
+    return 1;
+}
+
+void warmup_report(void)
+{
+    if (!enabled)
+        return;
+
+    if (!done)
+    {
+        syslog(LOG_INFO, "Warm-up -- never settled, %lu frames discarded\n", discarded);
+        return;
+    }
+
+    syslog(LOG_INFO, "Warm-up -- first good frame after %lf s, %lu frames discarded, %s "
+           "(histogram distance %lf, interval %lf s)\n",
+           seconds_between(&stream_on, &first_good), discarded,
+           timed_out ? "timed out" : "settled", last_hist_distance, interval_avg);
+}
@@ -0,0 +1,23 @@
+/*
+ *  Adaptive camera warm-up detection.
+ *
+ *  Replaces skipping a fixed START_UP_FRAMES: frames are discarded until
+ *  the luma histogram has stopped moving (auto exposure and white
+ *  balance have settled) and the driver's inter-frame interval is
+ *  steady, or until a timeout expires.
+ */
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include <time.h>
+#include <sys/time.h>
+
+int warmup_init(int width, int height, double timeout_s);
+void warmup_start(void);
+int warmup_enabled(void);
+int warmup_done(void);
+int warmup_offer(const void *yuyv, int stride, const struct timeval *driver_time,
+                 const struct timespec *now);
+void warmup_report(void);
+
+#endif /* WARMUP_H */
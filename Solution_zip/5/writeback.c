@@ -0,0 +1,610 @@
+/*
+ *  Frame writeback with precomputed header and filename templates.
+ *
+ *  The header for a geometry looks like
+ *      P6\n# timestamp 0000000123.000456789\n640 480\n255\n
+ *  and only the 19 timestamp digits change from frame to frame, so they
+ *  are overwritten in place instead of re-formatting the header. The
+ *  filename is treated the same way for its 4 digit frame tag.
+ *
+ *  In direct mode each template slot also owns a page aligned buffer,
+ *  so the pool holds one buffer per output shape and a steady run never
+ *  allocates. The frame is copied in after the header, zero padded to
+ *  the alignment and written with O_DIRECT.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/uio.h>
+
+#include "writeback.h"
+#include "delta.h"
+#include "archive.h"
+#include "segment.h"
+#include "mapped.h"
+#include "durable.h"
+
+#define TEMPLATE_SLOTS  (4)
+#define HEADER_MAX      (64)
+#define SEC_DIGITS      (10)
+#define NSEC_DIGITS     (9)
+#define TAG_DIGITS      (4)
+#define DIRECT_ALIGN    (4096)
+
+struct header_template
+{
+    struct frame_geometry geometry;
+    char text[HEADER_MAX];
+    int length;
+    int sec_offset;
+    int nsec_offset;
+    unsigned char *direct;      /* DIRECT_ALIGN aligned header + pixels + padding, O_DIRECT only */
+    size_t direct_size;
+};
+
+static struct header_template templates[TEMPLATE_SLOTS];
+static int templates_used;
+static int next_victim;
+
+static char frames_dir[PATH_MAX - 32];
+static char path_template[PATH_MAX];
+static int path_tag_offset;
+
+static struct writeback_stats stats;
+static int reference_fd = -1;
+static enum writeback_store store = STORE_PPM;
+static int direct;
+static unsigned long long quota_bytes, segment_bytes;
+static unsigned long long segment_quota;    /* what the side output files leave to the segments */
+static unsigned long recycle_slots;     /* PPM files kept under the quota, 0 keeps all */
+static unsigned long max_frame_bytes;   /* largest PPM file a frame produces */
+
+
+static void put_digits(char *dst, unsigned long long value, int digits)
+{
+    while (digits--)
+    {
+        dst[digits] = '0' + (char)(value % 10);
+        value /= 10;
+    }
+}
+
+/**
+ * @brief Sets the directory frames are written to and builds the filename template.
+ *
+ * @param directory Existing directory, without a trailing slash.
+ */
+void writeback_init(const char *directory)
+{
+    snprintf(frames_dir, sizeof(frames_dir), "%s", directory);
+    path_tag_offset = snprintf(path_template, sizeof(path_template), "%s/test", frames_dir);
+    // digits and extension are patched per frame
+    snprintf(path_template + path_tag_offset, sizeof(path_template) - path_tag_offset, "0000.ppm");
+}
+
+/**
+ * @brief Caps disk usage for continuous capture; call before writeback_set_store().
+ *
+ * Archive stores are split into preallocated segments reused oldest
+ * first. The PPM store instead keeps quota / frame_bytes files and
+ * overwrites them in place, tag modulo that count, so their blocks are
+ * reused rather than freed and allocated again.
+ *
+ * Side outputs (thumbnails, grey copies) are recycled over the same
+ * number of slots, so each slot's budget covers a frame and its side
+ * files. With an archive store the side files' share comes off the
+ * segments' budget.
+ *
+ * @param quota Disk budget in bytes, 0 for no limit.
+ * @param segment_size Archive segment size in bytes.
+ * @param frame_bytes Largest PPM file a frame produces.
+ * @param side_bytes Largest side output files a frame produces, together; 0 for none.
+ */
+void writeback_set_quota(unsigned long long quota, unsigned long long segment_size,
+                         unsigned long frame_bytes, unsigned long side_bytes)
+{
+    unsigned long long slot_bytes = (unsigned long long)frame_bytes + side_bytes;
+
+    quota_bytes = quota;
+    segment_bytes = segment_size;
+    max_frame_bytes = frame_bytes;
+    recycle_slots = quota && slot_bytes ? quota / slot_bytes : 0;
+    if (quota && recycle_slots == 0)
+        recycle_slots = 1;
+    segment_quota = quota > (unsigned long long)recycle_slots * side_bytes ?
+                    quota - (unsigned long long)recycle_slots * side_bytes : 0;
+}
+
+/**
+ * @brief Selects how frames are stored.
+ *
+ * @param new_store STORE_PPM, STORE_DELTA, STORE_RAW or STORE_MAPPED.
+ * @param key_interval Delta store only, frames between key frames.
+ * @param threshold Delta store only, mean absolute difference per sample below which a block is reused.
+ * @return 0 on success, -1 if the archive could not be created.
+ */
+int writeback_set_store(enum writeback_store new_store, int key_interval, double threshold)
+{
+    char path[PATH_MAX];
+    int segmented = quota_bytes && new_store != STORE_PPM;
+
+    if (new_store == STORE_MAPPED)
+    {
+        // One growing mapping has nothing to recycle
+        if (quota_bytes)
+        {
+            syslog(LOG_ERR, "the mapped store cannot keep to a quota");
+            return -1;
+        }
+        snprintf(path, sizeof(path), "%s/frames.pnm", frames_dir);
+        if (mapped_open(path, max_frame_bytes) < 0)
+            return -1;
+        store = new_store;
+        return 0;
+    }
+
+    if (segmented && segment_init(frames_dir, new_store == STORE_DELTA ? "cdl" : "yuyv",
+                                  new_store == STORE_DELTA ? DELTA_FILE_MAGIC : ARCHIVE_FILE_MAGIC,
+                                  segment_quota, segment_bytes) < 0)
+        return -1;
+
+    if (new_store == STORE_DELTA)
+    {
+        snprintf(path, sizeof(path), "%s/frames.cdl", frames_dir);
+        if (delta_open(segmented ? NULL : path, key_interval, threshold) < 0)
+            return -1;
+    }
+    else if (new_store == STORE_RAW)
+    {
+        snprintf(path, sizeof(path), "%s/frames.yuyv", frames_dir);
+        if (archive_open(segmented ? NULL : path) < 0)
+            return -1;
+    }
+
+    store = new_store;
+    return 0;
+}
+
+/**
+ * @brief Bypasses the page cache for PPM/PGM files.
+ *
+ * Buffered writes are fast on average, but once dirty pages pile up the
+ * kernel's writeback throttles the writer and a frame occasionally takes
+ * ten times as long. With O_DIRECT every frame pays for its own I/O, so
+ * the mean rises but the worst case stays close to it.
+ *
+ * @param enable Non-zero for O_DIRECT writes.
+ */
+void writeback_set_direct(int enable)
+{
+    direct = enable;
+}
+
+/**
+ * @brief Destination for the next frame's pixels, if the store provides one.
+ *
+ * With the mapped store this is the frame's spot in the output file, so
+ * the transform can write there directly. writeback_frame() with the same
+ * pointer then commits it without a copy.
+ *
+ * @return The destination, or NULL to use a buffer of the caller's.
+ */
+unsigned char *writeback_buffer(void)
+{
+    return store == STORE_MAPPED ? mapped_reserve() : NULL;
+}
+
+/**
+ * @brief writev() until every vector is written, continuing after short writes.
+ *
+ * Short writes resume where the kernel stopped, across vector boundaries
+ * if needed, instead of restarting a buffer. iov is modified.
+ *
+ * @param fd Destination.
+ * @param iov Vectors to write.
+ * @param iovcnt Number of vectors.
+ * @param calls Incremented once per writev() issued.
+ * @return Bytes written, or -1 on error.
+ */
+int writev_all(int fd, struct iovec *iov, int iovcnt, int *calls)
+{
+    int idx = 0, total = 0;
+    ssize_t n;
+
+    while (idx < iovcnt)
+    {
+        n = writev(fd, &iov[idx], iovcnt - idx);
+        (*calls)++;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "writev failed after %d bytes: %s", total, strerror(errno));
+            return -1;
+        }
+        // Nothing written and no error, trying again would spin
+        if (n == 0)
+        {
+            syslog(LOG_ERR, "writev wrote nothing after %d bytes", total);
+            return -1;
+        }
+        total += n;
+
+        // Skip the vectors that were fully written, then trim the partial one
+        while (idx < iovcnt && (size_t)n >= iov[idx].iov_len)
+        {
+            n -= iov[idx].iov_len;
+            idx++;
+        }
+        if (idx < iovcnt)
+        {
+            iov[idx].iov_base = (char *)iov[idx].iov_base + n;
+            iov[idx].iov_len -= n;
+            stats.short_writes++;
+        }
+    }
+
+    return total;
+}
+
+static struct header_template *template_for(const struct frame_geometry *geometry)
+{
+    struct header_template *t;
+    int i, n;
+
+    for (i = 0; i < templates_used; i++)
+    {
+        t = &templates[i];
+        if (t->geometry.width == geometry->width && t->geometry.height == geometry->height &&
+            t->geometry.channels == geometry->channels)
+            return t;
+    }
+
+    // Only a handful of shapes exist (normal, degraded, previews), so reuse round-robin
+    if (templates_used < TEMPLATE_SLOTS)
+        t = &templates[templates_used++];
+    else
+    {
+        t = &templates[next_victim];
+        next_victim = (next_victim + 1) % TEMPLATE_SLOTS;
+    }
+
+    t->geometry = *geometry;
+    n = snprintf(t->text, sizeof(t->text), "P%c\n# timestamp ", geometry->channels == 1 ? '5' : '6');
+    t->sec_offset = n;
+    t->nsec_offset = n + SEC_DIGITS + 1;
+    t->length = n + snprintf(t->text + n, sizeof(t->text) - n, "%0*d.%0*d\n%d %d\n255\n",
+                             SEC_DIGITS, 0, NSEC_DIGITS, 0, geometry->width, geometry->height);
+    return t;
+}
+
+static const char *filename_for(const char *prefix, unsigned int tag, int channels,
+                                char *fallback, size_t fallback_size)
+{
+    const char *ext = channels == 1 ? "pgm" : "ppm";
+
+    // Side outputs are few enough per frame that formatting their names is fine
+    if (tag > 9999 || strcmp(prefix, "test") != 0)
+    {
+        snprintf(fallback, fallback_size, "%s/%s%04u.%s", frames_dir, prefix, tag, ext);
+        return fallback;
+    }
+
+    put_digits(path_template + path_tag_offset, tag, TAG_DIGITS);
+    memcpy(path_template + path_tag_offset + TAG_DIGITS + 1, ext, 3);
+    return path_template;
+}
+
+static int write_buffered(struct header_template *t, const char *path,
+                          const unsigned char *data, int size, int *calls)
+{
+    struct iovec iov[2];
+    int total, dumpfd;
+
+    iov[0].iov_base = t->text;
+    iov[0].iov_len = t->length;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = size;
+
+    // A recycled file is overwritten in place; truncating first would free its blocks
+    dumpfd = open(path, O_WRONLY | O_CREAT | (recycle_slots ? 0 : O_TRUNC), 0666);
+    (*calls)++;
+    if (dumpfd < 0)
+    {
+        syslog(LOG_ERR, "Failed to open file for writing: %s", strerror(errno));
+        return -1;
+    }
+
+    total = writev_all(dumpfd, iov, 2, calls);
+    if (recycle_slots && total >= 0)
+    {
+        // Only shrinks a file left over from a larger frame
+        if (ftruncate(dumpfd, total) < 0)
+            total = -1;
+        (*calls)++;
+    }
+
+    // With a durability policy the sync thread closes it once synced
+    if (durable_enabled() && total >= 0)
+        durable_adopt(dumpfd, 0, total);
+    else
+    {
+        close(dumpfd);
+        (*calls)++;
+    }
+    return total;
+}
+
+/**
+ * @brief Writes a frame with O_DIRECT from the template's aligned buffer.
+ *
+ * The file is preallocated to the padded length so the write does not
+ * allocate blocks piecemeal, written in whole DIRECT_ALIGN units, then
+ * truncated back to the real PNM length.
+ */
+static int write_direct(struct header_template *t, const char *path,
+                        const unsigned char *data, int size, int *calls)
+{
+    size_t length = (size_t)t->length + size;
+    size_t padded = (length + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+    size_t done = 0;
+    ssize_t n;
+    int dumpfd;
+
+    if (padded > t->direct_size)
+    {
+        free(t->direct);
+        t->direct_size = 0;
+        if (posix_memalign((void **)&t->direct, DIRECT_ALIGN, padded) != 0)
+        {
+            t->direct = NULL;
+            return -1;
+        }
+        t->direct_size = padded;
+    }
+
+    memcpy(t->direct, t->text, t->length);
+    memcpy(t->direct + t->length, data, size);
+    memset(t->direct + length, 0, padded - length);
+
+    dumpfd = open(path, O_WRONLY | O_CREAT | (recycle_slots ? 0 : O_TRUNC) | O_DIRECT, 0666);
+    (*calls)++;
+    if (dumpfd < 0)
+    {
+        // tmpfs and some network filesystems refuse O_DIRECT outright
+        if (errno == EINVAL)
+        {
+            syslog(LOG_WARNING, "O_DIRECT not supported in %s, using buffered writes", frames_dir);
+            direct = 0;
+            return write_buffered(t, path, data, size, calls);
+        }
+        syslog(LOG_ERR, "Failed to open file for writing: %s", strerror(errno));
+        return -1;
+    }
+
+    // Not every filesystem can preallocate, the write still works without it
+    fallocate(dumpfd, 0, 0, padded);
+    (*calls)++;
+
+    while (done < padded)
+    {
+        n = write(dumpfd, t->direct + done, padded - done);
+        (*calls)++;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "O_DIRECT write failed after %zu bytes: %s", done, strerror(errno));
+            break;
+        }
+        if (n == 0)
+        {
+            syslog(LOG_ERR, "O_DIRECT write wrote nothing after %zu bytes", done);
+            break;
+        }
+        if ((size_t)n < padded - done)
+            stats.short_writes++;
+        done += n;
+    }
+
+    if (done == padded && ftruncate(dumpfd, length) < 0)
+        done = 0;
+    (*calls)++;
+    // The pixels are on the disk already, the new size and blocks are not
+    if (durable_enabled() && done == padded)
+        durable_adopt(dumpfd, 0, length);
+    else
+    {
+        close(dumpfd);
+        (*calls)++;
+    }
+
+    if (done != padded)
+        return -1;
+
+    stats.direct_frames++;
+    stats.padding_bytes += padded - length;
+    return (int)length;
+}
+
+// PNM file named <prefix><tag>, through the header template of its shape
+static int write_pnm(const char *prefix, const unsigned char *data, int size,
+                     const struct frame_geometry *geometry, unsigned int tag,
+                     const struct timespec *time, int *calls)
+{
+    struct header_template *t;
+    char fallback[PATH_MAX];
+    const char *path;
+
+    t = template_for(geometry);
+    put_digits(t->text + t->sec_offset, (unsigned long long)time->tv_sec, SEC_DIGITS);
+    put_digits(t->text + t->nsec_offset, (unsigned long long)time->tv_nsec, NSEC_DIGITS);
+    path = filename_for(prefix, recycle_slots ? tag % recycle_slots : tag, geometry->channels,
+                        fallback, sizeof(fallback));
+
+    if (direct)
+        return write_direct(t, path, data, size, calls);
+    return write_buffered(t, path, data, size, calls);
+}
+
+/**
+ * @brief Writes one frame as a PPM/PGM file with a single writev() in the common case.
+ *
+ * With the delta or raw store selected the frame is appended to that
+ * archive instead, and the mapped store adds it to its mapped file; with
+ * direct writes enabled it bypasses the page cache.
+ *
+ * @param data Pixel data.
+ * @param size Bytes of pixel data.
+ * @param geometry Image shape, selects the header template.
+ * @param tag Frame number used in the filename.
+ * @param time Timestamp recorded in the header comment.
+ * @param syscalls If not NULL, receives the number of syscalls this frame took.
+ * @return Total bytes written, or -1 on failure.
+ */
+int writeback_frame(const unsigned char *data, int size, const struct frame_geometry *geometry,
+                    unsigned int tag, const struct timespec *time, int *syscalls)
+{
+    struct timespec start, end;
+    int calls = 0, total;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (store == STORE_DELTA)
+        total = delta_write(data, size, geometry, tag, time, &calls);
+    else if (store == STORE_RAW)
+        total = archive_write(data, size, geometry, tag, time, &calls);
+    else if (store == STORE_MAPPED)
+        total = mapped_commit(data, size, geometry, tag, time);
+    else
+        total = write_pnm("test", data, size, geometry, tag, time, &calls);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    stats.syscalls += calls;
+    if ((unsigned int)calls > stats.max_syscalls)
+        stats.max_syscalls = calls;
+    if (syscalls)
+        *syscalls = calls;
+
+    if (total < 0)
+    {
+        stats.failures++;
+        return -1;
+    }
+
+    durable_frame();
+    stats.frames++;
+    stats.write_time += elapsed;
+    if (elapsed > stats.write_time_max)
+        stats.write_time_max = elapsed;
+    return total;
+}
+
+/**
+ * @brief Writes a side output of a frame, such as a thumbnail, as its own PPM/PGM file.
+ *
+ * Side outputs are always PNM files named <prefix><tag>, whatever the
+ * store, and follow the direct and quota settings of the main frames.
+ * They are not counted in the frame statistics.
+ *
+ * @param prefix Filename prefix, e.g. "thumb".
+ * @param syscalls If not NULL, receives the number of syscalls the write took.
+ * @return Total bytes written, or -1 on failure.
+ */
+int writeback_side(const char *prefix, const unsigned char *data, int size,
+                   const struct frame_geometry *geometry, unsigned int tag,
+                   const struct timespec *time, int *syscalls)
+{
+    int calls = 0, total;
+
+    total = write_pnm(prefix, data, size, geometry, tag, time, &calls);
+    if (syscalls)
+        *syscalls = calls;
+    return total;
+}
+
+/**
+ * @brief Records that a frame was skipped as a duplicate of an earlier one.
+ *
+ * Appends one line to duplicates.txt in the frames directory, which stays
+ * open for the run so a record costs a single write().
+ *
+ * @param tag Frame that was not written.
+ * @param reference_tag Last written frame it duplicates.
+ * @param time Timestamp of the skipped frame.
+ * @return Bytes appended, or -1 on failure.
+ */
+int writeback_reference(unsigned int tag, unsigned int reference_tag, const struct timespec *time)
+{
+    char path[PATH_MAX], record[96];
+    int len;
+
+    if (reference_fd < 0)
+    {
+        snprintf(path, sizeof(path), "%s/duplicates.txt", frames_dir);
+        reference_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        if (reference_fd < 0)
+        {
+            syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+            return -1;
+        }
+    }
+
+    len = snprintf(record, sizeof(record), "%u %u %ld.%09ld\n",
+                   tag, reference_tag, (long)time->tv_sec, time->tv_nsec);
+    return write(reference_fd, record, len) == len ? len : -1;
+}
+
+const struct writeback_stats *writeback_get_stats(void)
+{
+    return &stats;
+}
+
+void writeback_close(void)
+{
+    int i;
+
+    for (i = 0; i < TEMPLATE_SLOTS; i++)
+    {
+        free(templates[i].direct);
+        templates[i].direct = NULL;
+        templates[i].direct_size = 0;
+    }
+    if (store == STORE_DELTA)
+        delta_close();
+    else if (store == STORE_RAW)
+        archive_close();
+    else if (store == STORE_MAPPED)
+        mapped_close();
+    if (reference_fd >= 0)
+    {
+        close(reference_fd);
+        reference_fd = -1;
+    }
+}
+
+void writeback_report(void)
+{
+    unsigned long attempts = stats.frames + stats.failures;
+
+    syslog(LOG_INFO, "Writeback syscalls -- %lu frames, %lu failed, %.2lf syscalls/frame, "
+           "worst %u, %lu short writes\n",
+           stats.frames, stats.failures, attempts ? (double)stats.syscalls / attempts : 0.0,
+           stats.max_syscalls, stats.short_writes);
+    syslog(LOG_INFO, "Writeback latency -- %s, mean %.3lf ms, worst %.3lf ms, "
+           "%lu direct frames, %llu padding bytes\n",
+           store == STORE_DELTA ? "delta" : store == STORE_RAW ? "raw" : store == STORE_MAPPED ? "mapped" :
+           (direct ? "direct" : "buffered"),
+           stats.frames ? stats.write_time / stats.frames * 1000.0 : 0.0,
+           stats.write_time_max * 1000.0, stats.direct_frames, stats.padding_bytes);
+}
@@ -0,0 +1,61 @@
+/*
+ *  Frame writeback: header templates and single-syscall file writes.
+ *
+ *  Each output shape gets a PNM header template with fixed-width
+ *  timestamp digits, built once. Writing a frame then only patches the
+ *  digits in place and hands header and pixels to the kernel in one
+ *  writev(), continuing correctly after short writes.
+ */
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <time.h>
+#include <sys/uio.h>
+
+// Shape of a transformed image as it will be written out
+struct frame_geometry
+{
+    int width;
+    int height;
+    int channels;   /* 3 for PPM, 1 for PGM */
+};
+
+struct writeback_stats
+{
+    unsigned long frames;
+    unsigned long failures;
+    unsigned long syscalls;         /* open + writev + close, over all frames */
+    unsigned long short_writes;     /* writev calls that needed a continuation */
+    unsigned int max_syscalls;      /* worst single frame */
+    unsigned long direct_frames;    /* written with O_DIRECT */
+    unsigned long long padding_bytes; /* O_DIRECT alignment padding written then truncated */
+    double write_time;              /* seconds in writeback_frame(), successful frames */
+    double write_time_max;
+};
+
+enum writeback_store
+{
+    STORE_PPM,      /* one PPM/PGM file per frame */
+    STORE_DELTA,    /* key frames plus block deltas in one archive, see delta.h */
+    STORE_RAW,      /* untouched YUYV in one archive, see archive.h */
+    STORE_MAPPED,   /* PPM/PGM stream in one memory mapped file, see mapped.h */
+};
+
+void writeback_init(const char *directory);
+void writeback_set_direct(int enable);
+void writeback_set_quota(unsigned long long quota, unsigned long long segment_size,
+                         unsigned long frame_bytes, unsigned long side_bytes);
+int writeback_set_store(enum writeback_store store, int key_interval, double threshold);
+unsigned char *writeback_buffer(void);
+int writev_all(int fd, struct iovec *iov, int iovcnt, int *calls);
+int writeback_frame(const unsigned char *data, int size, const struct frame_geometry *geometry,
+                    unsigned int tag, const struct timespec *time, int *syscalls);
+int writeback_side(const char *prefix, const unsigned char *data, int size,
+                   const struct frame_geometry *geometry, unsigned int tag,
+                   const struct timespec *time, int *syscalls);
+int writeback_reference(unsigned int tag, unsigned int reference_tag, const struct timespec *time);
+const struct writeback_stats *writeback_get_stats(void);
+void writeback_close(void);
+void writeback_report(void);
+
+#endif /* WRITEBACK_H */
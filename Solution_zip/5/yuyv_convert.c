@@ -0,0 +1,274 @@
+/*
+ *  Batch converter for capture --store raw archives.
+ *
+ *  The archive is indexed by skipping from record header to record
+ *  header, then worker threads take records in order from a shared
+ *  counter, pread() the payload, convert it with the same code capture
+ *  uses and write test<tag>.ppm (or .pgm with -g). Records are
+ *  independent, so this scales with the number of cores.
+ *
+ *  Usage: yuyv_convert [-j threads] [-o dir] [-g] [-m matrix] frames.yuyv
+ *      -j n     worker threads [online CPUs]
+ *      -o dir   output directory [.]
+ *      -g       write greyscale PGM instead of brightened RGB PPM
+ *      -m name  colour matrix bt601, bt601-full, bt709 or bt709-full [bt601]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "archive.h"
+#include "convert.h"
+
+struct entry
+{
+    long offset;
+    struct archive_record rec;
+};
+
+static struct entry *entries;
+static size_t n_entries, capacity;
+static int archive_fd;
+static const char *out_dir = ".";
+static int grey;
+
+static atomic_size_t next_entry;
+static atomic_ulong converted, failed;
+
+
+static int build_index(FILE *fp)
+{
+    struct archive_record rec;
+    char magic[8];
+    long offset, end;
+
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, ARCHIVE_FILE_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "not a raw frame archive\n");
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    end = ftell(fp);
+    fseek(fp, 8, SEEK_SET);
+
+    for (offset = 8; fread(&rec, sizeof(rec), 1, fp) == 1; offset += sizeof(rec) + rec.payload)
+    {
+        // Zeros end a preallocated segment; a step back in time is a previous cycle's leftovers
+        if (rec.magic == 0 || (n_entries && (rec.sec < entries[n_entries - 1].rec.sec ||
+            (rec.sec == entries[n_entries - 1].rec.sec && rec.nsec < entries[n_entries - 1].rec.nsec))))
+            break;
+        if (rec.magic != ARCHIVE_RECORD_MAGIC)
+        {
+            fprintf(stderr, "bad record at offset %ld, stopping\n", offset);
+            break;
+        }
+        // A run cut short leaves a truncated last record behind
+        if (offset + (long)sizeof(rec) + (long)rec.payload > end)
+            break;
+
+        if (n_entries == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 4096;
+            entries = realloc(entries, capacity * sizeof(*entries));
+            if (!entries)
+            {
+                fprintf(stderr, "out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        entries[n_entries].offset = offset;
+        entries[n_entries].rec = rec;
+        n_entries++;
+
+        if (fseek(fp, rec.payload, SEEK_CUR) != 0)
+            break;
+    }
+
+    return 0;
+}
+
+static int convert_entry(const struct entry *e, unsigned char **in, size_t *in_size,
+                         unsigned char **out, size_t *out_size)
+{
+    const struct archive_record *rec = &e->rec;
+    size_t pixels = (size_t)rec->width * rec->height;
+    size_t need_out = pixels * (grey ? 1 : 3);
+    unsigned int row;
+    char path[4096];
+    FILE *fp;
+    int ok;
+
+    if (rec->payload > *in_size)
+    {
+        free(*in);
+        *in = malloc(rec->payload);
+        *in_size = *in ? rec->payload : 0;
+    }
+    if (need_out > *out_size)
+    {
+        free(*out);
+        *out = malloc(need_out);
+        *out_size = *out ? need_out : 0;
+    }
+    if (!*in || !*out || rec->stride < rec->width * 2 || (size_t)rec->stride * rec->height > rec->payload)
+        return -1;
+
+    if (pread(archive_fd, *in, rec->payload, e->offset + sizeof(*rec)) != (ssize_t)rec->payload)
+        return -1;
+
+    // Lines are converted one at a time so padded strides come out right
+    for (row = 0; row < rec->height; row++)
+    {
+        const unsigned char *line = *in + (size_t)row * rec->stride;
+
+        if (grey)
+            yuyv_to_grey(line, rec->width * 2, *out + (size_t)row * rec->width);
+        else
+            yuyv_to_rgb(line, rec->width * 2, *out + (size_t)row * rec->width * 3);
+    }
+
+    snprintf(path, sizeof(path), "%s/test%04u.%s", out_dir, rec->tag, grey ? "pgm" : "ppm");
+    fp = fopen(path, "wb");
+    if (!fp)
+    {
+        perror(path);
+        return -1;
+    }
+    fprintf(fp, "P%c\n# timestamp %010lld.%09lld\n%u %u\n255\n", grey ? '5' : '6',
+            (long long)rec->sec, (long long)rec->nsec, rec->width, rec->height);
+    ok = fwrite(*out, need_out, 1, fp) == 1;
+    return fclose(fp) == 0 && ok ? 0 : -1;
+}
+
+static void *worker(void *arg)
+{
+    unsigned char *in = NULL, *out = NULL;
+    size_t in_size = 0, out_size = 0, i;
+
+    (void)arg;
+
+    while ((i = atomic_fetch_add(&next_entry, 1)) < n_entries)
+    {
+        if (convert_entry(&entries[i], &in, &in_size, &out, &out_size) < 0)
+        {
+            fprintf(stderr, "frame %u failed\n", entries[i].rec.tag);
+            atomic_fetch_add(&failed, 1);
+        }
+        else
+            atomic_fetch_add(&converted, 1);
+    }
+
+    free(in);
+    free(out);
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-j threads] [-o dir] [-g] [-m matrix] frames.yuyv\n"
+                    "-j   worker threads [online CPUs]\n"
+                    "-o   output directory [.]\n"
+                    "-g   write greyscale PGM instead of RGB PPM\n"
+                    "-m   colour matrix bt601, bt601-full, bt709 or bt709-full [bt601]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct timespec start, end;
+    pthread_t *threads;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    double elapsed;
+    int c, i, rc;
+    FILE *fp;
+
+    while ((c = getopt(argc, argv, "j:o:gm:h")) != -1)
+    {
+        switch (c)
+        {
+            case 'j':
+                jobs = atol(optarg);
+                break;
+            case 'o':
+                out_dir = optarg;
+                break;
+            case 'g':
+                grey = 1;
+                break;
+            case 'm':
+                if (convert_set_matrix(optarg) < 0)
+                {
+                    fprintf(stderr, "unknown colour matrix '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (jobs < 1)
+        jobs = 1;
+
+    fp = fopen(argv[optind], "rb");
+    if (!fp)
+    {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (build_index(fp) < 0)
+    {
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+    archive_fd = fileno(fp);
+
+    threads = calloc(jobs, sizeof(*threads));
+    if (!threads)
+        return EXIT_FAILURE;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Workers share one frame counter, so however many start, every frame gets converted
+    for (i = 0; i < jobs; i++)
+    {
+        rc = pthread_create(&threads[i], NULL, worker, NULL);
+        if (rc != 0)
+        {
+            fprintf(stderr, "cannot start worker %d: %s\n", i + 1, strerror(rc));
+            break;
+        }
+    }
+    if (i == 0)
+    {
+        free(threads);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+    jobs = i;
+    for (i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%lu frames converted, %lu failed, %ld threads, %.3f s, %.1f frames/s\n",
+           atomic_load(&converted), atomic_load(&failed), jobs, elapsed,
+           elapsed > 0 ? atomic_load(&converted) / elapsed : 0.0);
+
+    free(threads);
+    fclose(fp);
+    return atomic_load(&failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}